@@ -5,8 +5,12 @@
 #include "epak.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define PASSWORD		"12358 Dummy password"
 
@@ -19,9 +23,9 @@ const char *test_string[] = {"00000000000000000000 This is a test string 1, don'
 
 
 // Tests writting a few strings into a file, both with and without compression.
-void pack_test(const char *filename)
+void pack_test(const char *filename, const char *mode)
 {
-	PACKFILE *pak = pack_fopen(filename, F_WRITE_NOPACK);
+	PACKFILE *pak = pack_fopen(filename, mode);
 	assert(pak && "Error creating test file");
 
 	// Test writing the string as a packfile, first uncompressed.
@@ -84,21 +88,1167 @@ void read_skip_test(const char *filename)
 	pack_fclose(pak);
 }
 
+// Writes packed chunks into a growable memory block and reads them back.
+void memory_test(void)
+{
+	char buf[255];
+	void *data;
+	long size;
+	int compressed, times;
+
+	PACKFILE *pak = pack_fopen_memstream(&data, &size, F_WRITE_PACKED);
+	assert(pak && "Error creating memory stream");
+	for (compressed = 0; compressed < 2; compressed++) {
+		pak = pack_fopen_chunk(pak, compressed);
+		assert(pak && "Error opening memory subchunk!");
+		for (times = 0; times < 5; times++)
+			pack_fwrite(test_string[compressed],
+				strlen(test_string[compressed]), pak);
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing memory stream!");
+	assert(data && size > 0);
+
+	pak = pack_fopen_memory(data, size, F_READ_PACKED);
+	assert(pak && "Couldn't read memory block");
+	if (pack_skip_chunks(pak, 1)) {
+		assert(0 && "Couldn't skip first memory chunk");
+	}
+	pak = pack_fopen_chunk(pak, 1);
+	assert(pak && "Couldn't open second memory subchunk");
+	const unsigned long ret = pack_fread(buf, strlen(test_string[1]), pak);
+	assert(ret == strlen(test_string[1]));
+	assert(!strncmp(buf, test_string[1], ret));
+	pack_fclose(pak);
+	free(data);
+
+	// Fixed size blocks refuse to grow.
+	pak = pack_fopen_memory(buf, 8, F_WRITE);
+	assert(pak);
+	pack_fwrite(test_string[0], strlen(test_string[0]), pak);
+	assert(pack_fclose(pak) && "Fixed memory block overflowed!");
+}
+
+// Parses the strings of pack_test() in place through pack_fpeek().
+void peek_test(const char *filename)
+{
+	const unsigned char *p;
+	const char *s = test_string[1];
+	const long len = strlen(s);
+	long total = 0, avail;
+
+	PACKFILE *pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read packfile");
+	if (pack_skip_chunks(pak, 1)) {
+		assert(0 && "Couldn't skip first chunk");
+	}
+	pak = pack_fopen_chunk(pak, 1);
+	assert(pak && "Couldn't open second subckunk");
+
+	while ((avail = pack_fpeek(pak, &p, len)) > 0) {
+		assert(avail >= len && "Short peek");
+		assert(!strncmp((const char *)p, s, len));
+		total += len;
+		if (pack_fconsume(pak, len)) {
+			assert(0 && "Couldn't consume peeked bytes");
+		}
+	}
+	assert(!avail && total == 5 * len);
+	assert(pack_feof(pak));
+	pack_fclose(pak);
+}
+
+// Unencrypted memory files are peeked without any copy.
+void peek_memory_test(void)
+{
+	const unsigned char *p;
+	const char *s = test_string[0];
+	const long len = strlen(s);
+
+	PACKFILE *pak = pack_fopen_memory((void *)s, len, F_READ);
+	assert(pak && "Couldn't open memory block");
+	assert(pack_getc(pak) == s[0]);
+	assert(pack_fpeek(pak, &p, 4) == len - 1 && p[0] == s[1]);
+	assert(!pack_fconsume(pak, len - 1));
+	assert(pack_fpeek(pak, &p, 0) == 0);
+	pack_fclose(pak);
+
+	pak = pack_fopen_memory((void *)s, len, F_READ);
+	assert(pack_fpeek(pak, &p, 0) == len && p == (const unsigned char *)s);
+	assert(!pack_fconsume(pak, 10) && pack_getc(pak) == s[10]);
+	pack_fclose(pak);
+}
+
+// Reads both chunks with the read-ahead modes.
+void read_ahead_test(const char *filename, const char *mode)
+{
+	char buf[255];
+	int compressed;
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Couldn't read packfile with read-ahead");
+	for (compressed = 0; compressed < 2; compressed++) {
+		const char *s = test_string[compressed];
+		pak = pack_fopen_chunk(pak, compressed);
+		assert(pak && "Couldn't open read-ahead subchunk");
+		const unsigned long ret = pack_fread(buf, strlen(s), pak);
+		assert(ret == strlen(s) && !strncmp(buf, s, ret));
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	assert(pack_getc(pak) == EOF && pack_feof(pak));
+	pack_fclose(pak);
+}
+
+// Nests chunks bigger than the buffers, so their headers get patched on disk.
+void nested_chunk_test(const char *filename, const char *mode)
+{
+	int outer, inner, i;
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating nested test file");
+	for (outer = 0; outer < 2; outer++) {
+		pak = pack_fopen_chunk(pak, outer);
+		for (inner = 0; inner < 2; inner++) {
+			pak = pack_fopen_chunk(pak, inner);
+			assert(pak && "Error opening nested subchunk!");
+			for (i = 0; i < 30000; i++)
+				pack_putc(i * (outer + inner + 1), pak);
+			pak = pack_fclose_chunk(pak);
+			assert(pak);
+		}
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing nested test file!");
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read nested test file");
+	for (outer = 0; outer < 2; outer++) {
+		pak = pack_fopen_chunk(pak, outer);
+		for (inner = 0; inner < 2; inner++) {
+			pak = pack_fopen_chunk(pak, inner);
+			assert(pak && "Couldn't open nested subchunk");
+			for (i = 0; i < 30000; i++)
+				assert(pack_getc(pak) == ((i * (outer + inner + 1)) & 0xFF));
+			assert(pack_getc(pak) == EOF);
+			pak = pack_fclose_chunk(pak);
+		}
+		pak = pack_fclose_chunk(pak);
+	}
+	assert(pack_getc(pak) == EOF);
+	pack_fclose(pak);
+
+	// Skip the inner chunks, then more chunks than there are.
+	pak = pack_fopen(filename, F_READ_PACKED);
+	for (outer = 0; outer < 2; outer++) {
+		pak = pack_fopen_chunk(pak, outer);
+		const unsigned int skipped = pack_skip_chunks_ex(pak, 1);
+		assert(skipped == 1);
+		pak = pack_fopen_chunk(pak, 1);
+		assert(pack_getc(pak) == 0 && pack_getc(pak) == (outer + 2));
+		pak = pack_fclose_chunk(pak);
+		const unsigned int none = pack_skip_chunks_ex(pak, 1);
+		assert(none == 0);
+		pak = pack_fclose_chunk(pak);
+	}
+	pack_fclose(pak);
+	pak = pack_fopen(filename, F_READ_PACKED);
+	const unsigned int skipped = pack_skip_chunks_ex(pak, 5);
+	assert(skipped == 2 && pack_feof(pak));
+	pack_fclose(pak);
+}
+
+// Reads the start of chunks ending a compressed file, where the output of
+// the decompressor outlasts the file it reads.
+void packed_tail_test(const char *filename)
+{
+	int i, c, count;
+
+	PACKFILE *pak = pack_fopen(filename, F_WRITE_PACKED);
+	assert(pak && "Error creating packed tail test file");
+	for (i = 0; i < 2; i++) {
+		pak = pack_fopen_chunk(pak, 0);
+		for (c = 0; c < 5000; c++)
+			pack_putc(c * 7 + i, pak);
+		pak = pack_fclose_chunk(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing packed tail test file!");
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read packed tail test file");
+	for (count = 0; ; count++) {
+		PACKFILE *chunk = pack_fopen_chunk(pak, 0);
+		if (!chunk)
+			break;
+		assert(pack_getc(chunk) == count);
+		pak = pack_fclose_chunk(chunk);
+	}
+	assert(count == 2);
+	assert(pack_getc(pak) == EOF);
+	pack_fclose(pak);
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pack_skip_chunks_ex(pak, 3) == 2);
+	assert(pack_getc(pak) == EOF);
+	pack_fclose(pak);
+}
+
+// Writes a table of contents and opens the chunks through it backwards.
+void toc_test(const char *filename, const char *mode)
+{
+	char buf[255];
+	int i;
+
+	PACKFILE *pak = pack_fopen(filename, "w!i");
+	assert(pak && "Error creating toc test file");
+	for (i = 0; i < 6; i++) {
+		const char *s = test_string[i % 2];
+		pak = pack_fopen_chunk(pak, i % 3 == 0);
+		assert(pak && "Error opening toc subchunk!");
+		pack_fwrite(s, strlen(s), pak);
+		pack_iputl(i, pak);
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing toc test file!");
+
+	pak = pack_fopen(filename, mode);
+	assert(pak && "Couldn't read toc test file");
+	assert(pack_chunk_count(pak) == 6);
+	for (i = 5; i >= 0; i--) {
+		const char *s = test_string[i % 2];
+		pak = pack_fopen_chunk_index(pak, i);
+		assert(pak && "Couldn't open indexed subchunk");
+		const unsigned long ret = pack_fread(buf, strlen(s), pak);
+		assert(ret == strlen(s) && !strncmp(buf, s, ret));
+		assert(pack_igetl(pak) == i);
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	assert(!pack_fopen_chunk_index(pak, 6));
+	pack_fclose(pak);
+
+	// Readers which don't know about the table stop before it.
+	pak = pack_fopen(filename, mode);
+	for (i = 0; ; i++) {
+		PACKFILE *chunk = pack_fopen_chunk(pak, 0);
+		if (!chunk)
+			break;
+		pak = pack_fclose_chunk(chunk);
+	}
+	assert(i == 6 && errno == ENOENT);
+	assert(pack_getc(pak) == EOF);
+	pack_fclose(pak);
+
+	// Without the 'i' flag there is no table, and stdio's 't' is ignored.
+	pak = pack_fopen(filename, "w!t");
+	pack_fclose(pak);
+	pak = pack_fopen(filename, mode);
+	assert(pak && pack_chunk_count(pak) == -1);
+	pack_fclose(pak);
+}
+
+// Writes many named chunks, some anonymous ones among them, and finds them.
+void named_chunk_test(const char *filename, int count)
+{
+	char name[32];
+	int i;
+
+	PACKFILE *pak = pack_fopen(filename, "w!i");
+	assert(pak && "Error creating named test file");
+	for (i = 0; i < count; i++) {
+		sprintf(name, "assets/%d.dat", i);
+		if (i % 5 == 0)
+			pak = pack_fopen_chunk(pak, 0);
+		else
+			pak = pack_fopen_chunk_named(pak, name, i % 2);
+		assert(pak && "Error opening named subchunk!");
+		pack_iputl(i, pak);
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing named test file!");
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read named test file");
+	assert(pack_chunk_count(pak) == count);
+	for (i = count - 1; i >= 0; i--) {
+		sprintf(name, "assets/%d.dat", i);
+		PACKFILE *chunk = pack_fopen_chunk_by_name(pak, name);
+		if (i % 5 == 0) {
+			assert(!chunk && "Found an anonymous chunk by name");
+			continue;
+		}
+		assert(chunk && "Couldn't open named subchunk");
+		assert(pack_igetl(chunk) == i);
+		pak = pack_fclose_chunk(chunk);
+		assert(pak);
+	}
+	assert(!pack_fopen_chunk_by_name(pak, "assets/missing.dat"));
+	pack_fclose(pak);
+
+	// Names need a table.
+	pak = pack_fopen("twice.epak", F_WRITE_NOPACK);
+	assert(!pack_fopen_chunk_named(pak, "nowhere", 0) && errno == EINVAL);
+	assert(!pack_fopen_chunk_concurrent(pak, "nowhere", 0) && errno == EINVAL);
+	pack_fclose(pak);
+
+	// Names have to be unique.
+	pak = pack_fopen("twice.epak", "w!i");
+	for (i = 0; i < 2; i++) {
+		pak = pack_fopen_chunk_named(pak, "twice", 0);
+		pak = pack_fclose_chunk(pak);
+	}
+	assert(pack_fclose(pak) && "Duplicated chunk names went unnoticed");
+}
+
+// Leaves packed chunks early or reads past their end, then checks that the
+// parent carries on right after them.
+void partial_chunk_test(const char *filename, const char *mode)
+{
+	const int size = 20000;
+	int i, c;
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating partial test file");
+	for (i = 0; i < 2; i++) {
+		pak = pack_fopen_chunk(pak, 1);
+		assert(pak && "Error opening partial subchunk!");
+		// Ends with a long match, which once made readers overrun the chunk.
+		for (c = 0; c < size; c++)
+			pack_putc("abcdefgh"[c % 8], pak);
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+		pack_mputl(0x12345678 + i, pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing partial test file!");
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read partial test file");
+	pak = pack_fopen_chunk(pak, 1);
+	const long first = pack_mgetl(pak);
+	assert(first == 0x61626364);
+	pak = pack_fclose_chunk(pak);
+	const long marker = pack_mgetl(pak);
+	assert(marker == 0x12345678);
+
+	pak = pack_fopen_chunk(pak, 1);
+	for (c = 0; pack_getc(pak) != EOF; c++)
+		;
+	assert(c == size && pack_feof(pak));
+	assert(pack_getc(pak) == EOF);
+	pak = pack_fclose_chunk(pak);
+	const long marker2 = pack_mgetl(pak);
+	assert(marker2 == 0x12345679);
+	pack_fclose(pak);
+}
+
+#define READERS		4
+
+// Reads every named chunk of the file written by named_chunk_test().
+void *shared_reader_thread(void *pak)
+{
+	char name[32];
+	int i;
+
+	for (i = 999; i >= 0; i -= 3) {
+		if (i % 5 == 0)
+			continue;
+		sprintf(name, "assets/%d.dat", i);
+		PACKFILE *chunk = pack_fopen_chunk_by_name(pak, name);
+		assert(chunk && "Couldn't open shared subchunk");
+		assert(pack_igetl(chunk) == i);
+		pak = pack_fclose_chunk(chunk);
+		assert(pak);
+	}
+
+	return pak;
+}
+
+// Reads one file through several handles at once, closing the original first.
+void shared_reader_test(const char *filename)
+{
+	pthread_t thread[READERS];
+	PACKFILE *reader[READERS];
+	int i;
+
+	PACKFILE *pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read shared test file");
+	for (i = 0; i < READERS; i++) {
+		reader[i] = pack_fdup_reader(pak);
+		assert(reader[i] && "Couldn't duplicate reader");
+	}
+	pack_fclose(pak);
+
+	for (i = 0; i < READERS; i++) {
+		const int started = pthread_create(&thread[i], NULL, shared_reader_thread, reader[i]);
+		assert(!started && "Couldn't start reader thread");
+	}
+	for (i = 0; i < READERS; i++) {
+		pthread_join(thread[i], NULL);
+		pack_fclose(reader[i]);
+	}
+}
+
+#define WRITERS		8
+
+struct writer_job
+{
+	PACKFILE *pak;
+	int n;
+};
+
+// Fills a chunk opened by concurrent_chunk_test() after its number.
+void *concurrent_writer_thread(void *_job)
+{
+	struct writer_job *job = _job;
+	int i;
+
+	pack_iputl(job->n, job->pak);
+	for (i = 0; i < 20000; i++)
+		pack_putc(i * job->n, job->pak);
+
+	return pack_fclose_chunk(job->pak);
+}
+
+// Writes chunks from several threads at once, then reads them in order.
+void concurrent_chunk_test(const char *filename, const char *mode)
+{
+	pthread_t thread[WRITERS];
+	struct writer_job job[WRITERS];
+	char name[32];
+	int n, i;
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating concurrent test file");
+	for (n = 0; n < WRITERS; n++) {
+		sprintf(name, "worker/%d", n);
+		job[n].pak = pack_fopen_chunk_concurrent(pak, n % 3 ? name : NULL, n % 2);
+		job[n].n = n;
+		assert(job[n].pak && "Error opening concurrent subchunk!");
+		const int started = pthread_create(&thread[n], NULL, concurrent_writer_thread, &job[n]);
+		assert(!started && "Couldn't start writer thread");
+	}
+	for (n = 0; n < WRITERS; n++) {
+		void *parent;
+		pthread_join(thread[n], &parent);
+		assert(parent == pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing concurrent test file!");
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read concurrent test file");
+	for (n = 0; n < WRITERS; n++) {
+		pak = pack_fopen_chunk(pak, n % 2);
+		assert(pak && "Couldn't open concurrent subchunk");
+		assert(pack_igetl(pak) == n);
+		for (i = 0; i < 20000; i++)
+			assert(pack_getc(pak) == ((i * n) & 0xFF));
+		pak = pack_fclose_chunk(pak);
+	}
+	pack_fclose(pak);
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	PACKFILE *chunk = pack_fopen_chunk_by_name(pak, "worker/5");
+	assert(chunk && "Couldn't find concurrent subchunk");
+	const long number = pack_igetl(chunk);
+	assert(number == 5);
+	pack_fclose(chunk);
+}
+
+// Writes a checksummed file, checks it, then damages one chunk.
+void checksum_test(const char *filename)
+{
+	int i;
+
+	PACKFILE *pak = pack_fopen(filename, "w!c");
+	assert(pak && "Error creating checksum test file");
+	for (i = 0; i < 6; i++) {
+		const char *s = test_string[i % 2];
+		pak = pack_fopen_chunk(pak, i % 3 == 1);
+		assert(pak && "Error opening checksum subchunk!");
+		pack_fwrite(s, strlen(s), pak);
+		if (i == 2) {
+			pak = pack_fopen_chunk(pak, 1);
+			assert(pak && "Error opening nested checksum subchunk!");
+			pack_fwrite(s, strlen(s), pak);
+			pak = pack_fclose_chunk(pak);
+		}
+		if (i == 4) {
+			int j;
+			for (j = 0; j < 100000; j++)
+				pack_putc(j * 7, pak);
+		}
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing checksum test file!");
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read checksum test file");
+	assert(pack_chunk_count(pak) == 6);
+	assert(pack_verify_chunks(pak, 3) == 0);
+	assert(pack_verify_chunks(pak, 1) == 0);
+	pak = pack_fopen_chunk_index(pak, 2);
+	pak = pack_fopen_chunk(pak, 1);
+	assert(pak && "Couldn't open nested checksum subchunk");
+	assert(pack_getc(pak) == test_string[0][0]);
+	pak = pack_fclose_chunk(pak);
+	pak = pack_fclose_chunk(pak);
+	pack_fclose(pak);
+
+	// Flip a byte of the first chunk, right after its header.
+	FILE *raw = fopen(filename, "r+b");
+	assert(raw && "Couldn't damage checksum test file");
+	fseek(raw, 16, SEEK_SET);
+	const int c = fgetc(raw);
+	fseek(raw, 16, SEEK_SET);
+	fputc(c ^ 0x20, raw);
+	fclose(raw);
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pack_verify_chunks(pak, 4) == 1);
+	pack_fclose(pak);
+
+	// Files written without the 'c' flag have nothing to check.
+	pak = pack_fopen(filename, "w!i");
+	pak = pack_fopen_chunk(pak, 0);
+	pak = pack_fclose_chunk(pak);
+	pack_fclose(pak);
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && pack_verify_chunks(pak, 2) == -1 && errno == ENOENT);
+	pack_fclose(pak);
+}
+
+#define KEYS		4
+
+struct key_job
+{
+	PACKFILE_KEY *key;
+	int n;
+};
+
+// Writes and reads back a packed file with the key of one thread.
+void *key_thread(void *_job)
+{
+	struct key_job *job = _job;
+	PACKFILE_KEY *key = job->key;
+	char filename[32];
+	int i;
+
+	sprintf(filename, "key %d.epak", job->n);
+	PACKFILE *pak = pack_fopen_key(filename, F_WRITE_PACKED, key);
+	assert(pak && "Error creating key test file");
+	pak = pack_fopen_chunk(pak, 0);
+	for (i = 0; i < 50000; i++)
+		pack_putc(i % 251, pak);
+	pak = pack_fclose_chunk(pak);
+	pack_fclose(pak);
+
+	pak = pack_fopen_key(filename, F_READ_PACKED, key);
+	assert(pak && "Couldn't read key test file");
+	pak = pack_fopen_chunk(pak, 0);
+	for (i = 0; i < 50000; i++)
+		assert(pack_getc(pak) == i % 251);
+	pak = pack_fclose_chunk(pak);
+	pack_fclose(pak);
+
+	return NULL;
+}
+
+// Uses different keys from several threads at once.
+void key_test(void)
+{
+	pthread_t thread[KEYS];
+	PACKFILE_KEY *key[KEYS];
+	struct key_job job[KEYS];
+	char password[32];
+	int i;
+
+	for (i = 0; i < KEYS; i++) {
+		sprintf(password, "key number %d", i);
+		key[i] = packfile_key_create(password);
+		assert(key[i] && "Couldn't create key");
+		job[i].key = key[i];
+		job[i].n = i;
+		const int started = pthread_create(&thread[i], NULL, key_thread, &job[i]);
+		assert(!started && "Couldn't start key thread");
+	}
+	for (i = 0; i < KEYS; i++)
+		pthread_join(thread[i], NULL);
+
+	// Keys can be released while their files are still open.
+	PACKFILE *pak = pack_fopen_key("key.epak", F_WRITE_NOPACK, key[1]);
+	packfile_key_destroy(key[1]);
+	pack_iputl(0x12345678, pak);
+	pack_fclose(pak);
+
+	packfile_password("key number 1");
+	pak = pack_fopen("key.epak", F_READ_PACKED);
+	assert(pak && pack_igetl(pak) == 0x12345678);
+	pack_fclose(pak);
+	packfile_password(0);
+
+	pak = pack_fopen_key("key.epak", F_READ_PACKED, key[2]);
+	assert(!pak && errno == EDOM);
+	pak = pack_fopen_key("key.epak", F_READ_PACKED, NULL);
+	assert(!pak && errno == EDOM);
+
+	for (i = 0; i < KEYS; i++)
+		if (i != 1)
+			packfile_key_destroy(key[i]);
+}
+
+// Round trips packed, nested and indexed data through ChaCha20 keys.
+void chacha20_test(void)
+{
+	unsigned char secret[32], raw[64];
+	char buf[255];
+	int i;
+
+	for (i = 0; i < 32; i++)
+		secret[i] = i * 7 + 1;
+	PACKFILE_KEY *key = packfile_key_create_chacha20(secret);
+	assert(key && "Couldn't create ChaCha20 key");
+
+	PACKFILE *pak = pack_fopen_key("chacha.epak", "w!c", key);
+	assert(pak && "Error creating ChaCha20 test file");
+	for (i = 0; i < 4; i++) {
+		const char *s = test_string[i % 2];
+		pak = pack_fopen_chunk(pak, i % 2);
+		pack_fwrite(s, strlen(s), pak);
+		pak = pack_fopen_chunk(pak, 0);
+		pack_iputl(i, pak);
+		pak = pack_fclose_chunk(pak);
+		pak = pack_fclose_chunk(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing ChaCha20 test file!");
+
+	// Nothing but the header is readable.
+	FILE *f = fopen("chacha.epak", "rb");
+	assert(f && fread(raw, 1, sizeof(raw), f) == sizeof(raw));
+	fclose(f);
+	assert(raw[0] == 's' && raw[1] == 'l' && raw[2] == 'h' && raw[3] == '#');
+	assert(memcmp(raw + 16 + 12, test_string[0], 20));
+
+	pak = pack_fopen_key("chacha.epak", F_READ_PACKED, key);
+	assert(pak && "Couldn't read ChaCha20 test file");
+	for (i = 0; i < 4; i++)
+		pak = pack_fclose_chunk(pack_fopen_chunk(pak, 0));
+	assert(!pack_fopen_chunk(pak, 0) && errno == ENOENT);
+	pack_fclose(pak);
+
+	pak = pack_fopen_key("chacha.epak", F_READ_PACKED, key);
+	assert(pak && "Couldn't read ChaCha20 test file");
+	assert(pack_verify_chunks(pak, 2) == 0);
+	PACKFILE *dup = pack_fdup_reader(pak);
+	for (i = 3; i >= 0; i--) {
+		const char *s = test_string[i % 2];
+		pak = pack_fopen_chunk_index(pak, i);
+		assert(pak && "Couldn't open ChaCha20 subchunk");
+		const long ret = pack_fread(buf, strlen(s), pak);
+		assert(ret == (long)strlen(s) && !strncmp(buf, s, ret));
+		pak = pack_fopen_chunk(pak, 0);
+		assert(pack_igetl(pak) == i);
+		pak = pack_fclose_chunk(pak);
+		pak = pack_fclose_chunk(pak);
+	}
+	pack_fclose(pak);
+
+	// The duplicate starts after the header, and skips by seeking.
+	dup = pack_fopen_chunk(dup, 0);
+	assert(dup && pack_fseek(dup, strlen(test_string[0])) == 0);
+	dup = pack_fopen_chunk(dup, 0);
+	assert(pack_igetl(dup) == 0);
+	dup = pack_fclose_chunk(dup);
+	dup = pack_fclose_chunk(dup);
+	pack_fclose(dup);
+
+	// Staged chunks spill to disk encrypted with the same key.
+	packfile_chunk_memory(100);
+	pak = pack_fopen_key("chacha.epak", F_WRITE_PACKED, key);
+	pak = pack_fopen_chunk(pak, 0);
+	for (i = 0; i < 10000; i++)
+		pack_putc(i * 3, pak);
+	pak = pack_fclose_chunk(pak);
+	pack_fclose(pak);
+	packfile_chunk_memory(F_CHUNK_MEMORY);
+
+	pak = pack_fopen_key("chacha.epak", F_READ_PACKED, key);
+	assert(pak && "Couldn't read packed ChaCha20 test file");
+	pak = pack_fopen_chunk(pak, 0);
+	for (i = 0; i < 10000; i++)
+		assert(pack_getc(pak) == ((i * 3) & 0xFF));
+	pak = pack_fclose_chunk(pak);
+	pack_fclose(pak);
+
+	// Other keys and passwords can't read the file.
+	secret[0] ^= 1;
+	PACKFILE_KEY *wrong = packfile_key_create_chacha20(secret);
+	pak = pack_fopen_key("chacha.epak", F_READ_PACKED, wrong);
+	assert(!pak && errno == EDOM);
+	pak = pack_fopen("chacha.epak", F_READ_PACKED);
+	assert(!pak && errno == EDOM);
+	packfile_key_destroy(wrong);
+
+	// The key stream ends where the block counter would wrap, at 256GB.
+	const int64_t limit = (int64_t)64 << 32;
+	const int grown = truncate("chacha.epak", limit + 4096);
+	assert(!grown && "Couldn't grow ChaCha20 test file");
+	pak = pack_fopen_key("chacha.epak", F_READ, key);
+	assert(pak && pack_fseek64(pak, limit - 16 - 8) == 0);
+	assert(pack_fread(buf, 8, pak) == 8);
+	assert(pack_getc(pak) == EOF && pack_ferror(pak) && errno == EFBIG);
+	pack_fclose(pak);
+	remove("chacha.epak");
+
+	packfile_key_destroy(key);
+}
+
+// Writes integer arrays in both byte orders and reads them back, partly
+// through the single value functions to check the layout.
+void array_test(const char *filename, const char *mode)
+{
+	enum { COUNT = 3000 };
+	static uint16_t w[COUNT], w2[COUNT];
+	static uint32_t l[COUNT], l2[COUNT + 1];
+	int i;
+	long ret, v;
+
+	for (i = 0; i < COUNT; i++) {
+		w[i] = (uint16_t)(i * 40503u);
+		l[i] = i * 2654435761u;
+	}
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating array file");
+	pak = pack_fopen_chunk(pak, 1);
+	assert(pak);
+	ret = pack_iwrite_u16(pak, w, COUNT);
+	assert(ret == COUNT);
+	ret = pack_mwrite_u16(pak, w, COUNT);
+	assert(ret == COUNT);
+	ret = pack_iwrite_u32(pak, l, COUNT);
+	assert(ret == COUNT);
+	ret = pack_mwrite_u32(pak, l, COUNT);
+	assert(ret == COUNT);
+	pak = pack_fclose_chunk(pak);
+	assert(pak);
+	ret = pack_fclose(pak);
+	assert(!ret);
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Error reading array file");
+	pak = pack_fopen_chunk(pak, 0);
+	assert(pak);
+	v = pack_igetw(pak);
+	assert(v == w[0]);
+	ret = pack_iread_u16(pak, w2 + 1, COUNT - 1);
+	assert(ret == COUNT - 1);
+	assert(!memcmp(w + 1, w2 + 1, (COUNT - 1) * sizeof(*w)));
+	v = pack_mgetw(pak);
+	assert(v == w[0]);
+	ret = pack_mread_u16(pak, w2 + 1, COUNT - 1);
+	assert(ret == COUNT - 1);
+	assert(!memcmp(w + 1, w2 + 1, (COUNT - 1) * sizeof(*w)));
+	v = pack_igetl(pak);
+	assert((uint32_t)v == l[0]);
+	ret = pack_iread_u32(pak, l2 + 1, COUNT - 1);
+	assert(ret == COUNT - 1);
+	assert(!memcmp(l + 1, l2 + 1, (COUNT - 1) * sizeof(*l)));
+	ret = pack_mread_u32(pak, l2, COUNT + 1);
+	assert(ret == COUNT);
+	assert(!memcmp(l, l2, COUNT * sizeof(*l)));
+	pak = pack_fclose_chunk(pak);
+	assert(pak);
+	pack_fclose(pak);
+}
+
+// Writes and reads bytes one at a time through the inline fast paths,
+// crossing several buffer boundaries and the end of the file.
+void fast_byte_test(const char *filename, const char *mode)
+{
+	enum { COUNT = 3 * F_BUF_SIZE + 7 };
+	int i, c;
+	long ret;
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating byte file");
+	for (i = 0; i < COUNT; i++) {
+		c = pack_putc_fast(i * 7 + (i >> 8), pak);
+		assert(c == ((i * 7 + (i >> 8)) & 0xFF));
+	}
+	ret = pack_fclose(pak);
+	assert(!ret);
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Error reading byte file");
+	for (i = 0; i < COUNT; i++) {
+		assert(!pack_feof(pak));
+		c = pack_getc_fast(pak);
+		assert(c == ((i * 7 + (i >> 8)) & 0xFF));
+	}
+	assert(pack_feof(pak));
+	c = pack_getc_fast(pak);
+	assert(c == EOF);
+	pack_fclose(pak);
+}
+
+// Writes varints, zigzag values and blobs, enough of them to straddle
+// buffer boundaries, then reads them back and checks a malformed varint.
+void varint_test(const char *filename, const char *mode)
+{
+	static const uint64_t edge[] = {0, 1, 127, 128, 300, 16383, 16384,
+		0x7FFFFFFFFFFFFFFFull, 0x8000000000000000ull, 0xFFFFFFFFFFFFFFFFull};
+	const int edges = sizeof(edge) / sizeof(edge[0]);
+	enum { COUNT = 2000 };
+	const long len = strlen(test_string[0]);
+	char str[16];
+	uint64_t u;
+	int64_t z;
+	long ret;
+	int i, n;
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating varint file");
+	for (i = 0; i < COUNT; i++) {
+		n = pack_vputl(edge[i % edges] + i, pak);
+		assert(n > 0 && n <= 10);
+		n = pack_zputl(-(int64_t)(edge[i % edges] >> 1) + i, pak);
+		assert(n > 0);
+	}
+	ret = pack_putblob(test_string[0], len, pak);
+	assert(ret == len);
+	ret = pack_putblob(test_string[1], 0, pak);
+	assert(ret == 0);
+	ret = pack_putblob(test_string[0], len, pak);
+	assert(ret == len);
+	n = pack_zputl(INT64_MIN, pak);
+	assert(n == 10);
+	for (i = 0; i < 10; i++)
+		pack_putc(0x80, pak);
+	pack_putc(0, pak);
+	ret = pack_fclose(pak);
+	assert(!ret);
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Error reading varint file");
+	for (i = 0; i < COUNT; i++) {
+		n = pack_vgetl(pak, &u);
+		assert(n > 0 && u == edge[i % edges] + i);
+		n = pack_zgetl(pak, &z);
+		assert(n > 0 && z == -(int64_t)(edge[i % edges] >> 1) + i);
+	}
+	ret = pack_getblob(str, sizeof(str), pak);
+	assert(ret == len && !memcmp(str, test_string[0], sizeof(str)));
+	ret = pack_getblob(NULL, 0, pak);
+	assert(ret == 0);
+	ret = pack_getblob(str, sizeof(str), pak);
+	assert(ret == len);
+	n = pack_zgetl(pak, &z);
+	assert(n == 10 && z == INT64_MIN);
+	errno = 0;
+	n = pack_vgetl(pak, &u);
+	assert(n == EOF && errno == EOVERFLOW);
+	pack_fclose(pak);
+}
+
+// Writes chunks with 64-bit headers, one of them nested, and reads them
+// back sequentially and through the table, checking the positions.
+void large_chunk_test(const char *filename, const char *mode)
+{
+	const long len = strlen(test_string[0]);
+	char buf[255];
+	int64_t pos;
+	long ret;
+	int i;
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating large chunk file");
+	pos = pack_ftell64(pak);
+	assert(pos == 0);
+	for (i = 0; i < 3; i++) {
+		pak = pack_fopen_chunk(pak, i == 1);
+		assert(pak);
+		if (i == 2) {
+			pak = pack_fopen_chunk(pak, 0);
+			assert(pak);
+		}
+		pack_fwrite(test_string[0], len, pak);
+		pos = pack_ftell64(pak);
+		assert(pos == len);
+		pack_iputl(i, pak);
+		if (i == 2) {
+			pak = pack_fclose_chunk(pak);
+			assert(pak);
+		}
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+	}
+	pos = pack_ftell64(pak);
+	assert(pos > 4 * 20 + 2 * len);
+	ret = pack_fclose(pak);
+	assert(!ret);
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Error reading large chunk file");
+	pos = pack_ftell64(pak);
+	assert(pos == 0);
+	ret = pack_skip_chunks_ex(pak, 1);
+	assert(ret == 1);
+	pak = pack_fopen_chunk(pak, 0);
+	assert(pak);
+	ret = pack_fread(buf, len, pak);
+	assert(ret == len && !memcmp(buf, test_string[0], len));
+	ret = pack_igetl(pak);
+	assert(ret == 1);
+	pos = pack_ftell64(pak);
+	assert(pos == len + 4);
+	pak = pack_fclose_chunk(pak);
+	assert(pak);
+	pak = pack_fopen_chunk(pak, 0);
+	assert(pak);
+	pak = pack_fopen_chunk(pak, 0);
+	assert(pak);
+	ret = pack_fseek64(pak, len);
+	assert(!ret);
+	ret = pack_igetl(pak);
+	assert(ret == 2);
+	pak = pack_fclose_chunk(pak);
+	assert(pak);
+	pak = pack_fclose_chunk(pak);
+	assert(pak);
+	pack_fclose(pak);
+
+	if (strpbrk(mode, "tc")) {
+		pak = pack_fopen(filename, F_READ_PACKED);
+		assert(pak);
+		ret = pack_chunk_count(pak);
+		assert(ret == 3);
+		if (strchr(mode, 'c')) {
+			ret = pack_verify_chunks(pak, 2);
+			assert(ret == 0);
+		}
+		pak = pack_fopen_chunk_index(pak, 1);
+		assert(pak);
+		ret = pack_fread(buf, len, pak);
+		assert(ret == len && !memcmp(buf, test_string[0], len));
+		pak = pack_fclose_chunk(pak);
+		assert(pak);
+		pack_fclose(pak);
+	}
+}
+
+// Writes a record from separate blocks with pack_fwritev() and reads it
+// back split differently with pack_freadv(), past the end of the file.
+void vectored_test(const char *filename, const char *mode, const char *read_mode)
+{
+	enum { BODY = 5 * F_BUF_SIZE + 3 };
+	static unsigned char body[BODY], back[BODY + 100];
+	struct iovec iov[4];
+	long ret;
+	int i;
+
+	for (i = 0; i < BODY; i++)
+		body[i] = i * 13 + (i >> 9);
+
+	PACKFILE *pak = pack_fopen(filename, mode);
+	assert(pak && "Error creating vectored file");
+	iov[0].iov_base = (void *)test_string[0];
+	iov[0].iov_len = 10;
+	iov[1].iov_base = body;
+	iov[1].iov_len = BODY;
+	iov[2].iov_base = NULL;
+	iov[2].iov_len = 0;
+	iov[3].iov_base = (void *)test_string[1];
+	iov[3].iov_len = 5;
+	ret = pack_fwritev(pak, iov, 4);
+	assert(ret == 10 + BODY + 5);
+	// A small record stays in the buffer.
+	ret = pack_fwritev(pak, iov + 3, 1);
+	assert(ret == 5);
+	ret = pack_fclose(pak);
+	assert(!ret);
+
+	pak = pack_fopen(filename, read_mode);
+	assert(pak && "Error reading vectored file");
+	ret = pack_fread(back, 3, pak);
+	assert(ret == 3 && !memcmp(back, test_string[0], 3));
+	iov[0].iov_base = back + 3;
+	iov[0].iov_len = 7;
+	iov[1].iov_base = back + 10;
+	iov[1].iov_len = 3 * F_BUF_SIZE;
+	iov[2].iov_base = NULL;
+	iov[2].iov_len = 0;
+	iov[3].iov_base = back + 10 + 3 * F_BUF_SIZE;
+	iov[3].iov_len = BODY - 3 * F_BUF_SIZE + 100;
+	ret = pack_freadv(pak, iov, 4);
+	assert(ret == 7 + BODY + 10);
+	assert(!memcmp(back, test_string[0], 10));
+	assert(!memcmp(back + 10, body, BODY));
+	assert(!memcmp(back + 10 + BODY, test_string[1], 5));
+	assert(!memcmp(back + 15 + BODY, test_string[1], 5));
+	assert(pack_feof(pak));
+	pack_fclose(pak);
+}
+
+#define ARCHIVES	4
+
+// Writes and reads back a packed archive of nested chunks, staged with a
+// limit of its own.
+void *archive_thread(void *_n)
+{
+	const int n = (int)(intptr_t)_n;
+	char filename[32];
+	int i, j;
+
+	sprintf(filename, "archive %d.epak", n);
+	PACKFILE *pak = pack_fopen(filename, F_WRITE_PACKED);
+	assert(pak && "Error creating archive test file");
+	pack_chunk_memory(pak, n * 300);
+	for (i = 0; i < 8; i++) {
+		pak = pack_fopen_chunk(pak, i & 1);
+		pack_iputl(i * n, pak);
+		pak = pack_fopen_chunk(pak, 0);
+		for (j = 0; j < 1000 * i; j++)
+			pack_putc(j ^ n, pak);
+		pak = pack_fclose_chunk(pak);
+		pak = pack_fclose_chunk(pak);
+	}
+	const int closing = pack_fclose(pak);
+	assert(!closing && "Error closing archive test file!");
+
+	pak = pack_fopen(filename, F_READ_PACKED);
+	assert(pak && "Couldn't read archive test file");
+	for (i = 0; i < 8; i++) {
+		pak = pack_fopen_chunk(pak, 0);
+		assert(pak && pack_igetl(pak) == i * n);
+		pak = pack_fopen_chunk(pak, 0);
+		for (j = 0; j < 1000 * i; j++)
+			assert(pack_getc(pak) == ((j ^ n) & 0xFF));
+		assert(pack_getc(pak) == EOF);
+		pak = pack_fclose_chunk(pak);
+		pak = pack_fclose_chunk(pak);
+	}
+	pack_fclose(pak);
+
+	return NULL;
+}
+
+// Works on unrelated archives from several threads while the defaults
+// keep changing.
+void archive_test(void)
+{
+	pthread_t thread[ARCHIVES];
+	int i;
+
+	for (i = 0; i < ARCHIVES; i++) {
+		const int started = pthread_create(&thread[i], NULL, archive_thread,
+			(void *)(intptr_t)i);
+		assert(!started && "Couldn't start archive thread");
+	}
+	for (i = 0; i < 100; i++)
+		packfile_chunk_memory(i & 1 ? 0 : F_CHUNK_MEMORY);
+	for (i = 0; i < ARCHIVES; i++)
+		pthread_join(thread[i], NULL);
+
+	packfile_chunk_memory(F_CHUNK_MEMORY);
+}
+
 int main(void)
 {
 	printf("Testing epak functions.\n");
 
 	packfile_password(PASSWORD);
-	pack_test("with pass.epak");
+	pack_test("with pass.epak", F_WRITE_NOPACK);
+	pack_test("behind with pass.epak", "w!d");
 
 	packfile_password(0);
-	pack_test("no pass.epak");
+	pack_test("no pass.epak", F_WRITE_NOPACK);
+	pack_test("behind no pass.epak", "w!du");
 
 	packfile_password(PASSWORD);
 	read_skip_test("with pass.epak");
+	read_skip_test("behind with pass.epak");
 
 	packfile_password(0);
 	read_skip_test("no pass.epak");
+	read_skip_test("behind no pass.epak");
+
+	peek_test("no pass.epak");
+	read_ahead_test("no pass.epak", "rps");
+	read_ahead_test("no pass.epak", "rpd");
+	read_ahead_test("no pass.epak", "rpu");
+	// The stdio binary flag is accepted and ignored.
+	read_ahead_test("no pass.epak", "rpb");
+	packfile_password(PASSWORD);
+	peek_test("with pass.epak");
+	read_ahead_test("with pass.epak", "rpd");
+	read_ahead_test("with pass.epak", "rpu");
+
+	memory_test();
+	packfile_password(0);
+	memory_test();
+	peek_memory_test();
+
+	nested_chunk_test("nested.epak", F_WRITE_NOPACK);
+	packfile_password(PASSWORD);
+	nested_chunk_test("nested with pass.epak", "w!du");
+	// Stage the chunks of a packed file partly on disk.
+	packfile_chunk_memory(1000);
+	nested_chunk_test("nested with pass.epak", F_WRITE_PACKED);
+	packfile_chunk_memory(F_CHUNK_MEMORY);
+	toc_test("toc with pass.epak", F_READ_PACKED);
+	toc_test("toc with pass.epak", "rpd");
+	packfile_password(0);
+	toc_test("toc no pass.epak", "rpu");
+	named_chunk_test("named no pass.epak", 1000);
+	shared_reader_test("named no pass.epak");
+	packfile_password(PASSWORD);
+	named_chunk_test("named with pass.epak", 7);
+	partial_chunk_test("partial with pass.epak", F_WRITE_NOPACK);
+	packed_tail_test("tail with pass.epak");
+	packfile_chunk_memory(5000);
+	concurrent_chunk_test("concurrent with pass.epak", "w!i");
+	concurrent_chunk_test("concurrent with pass.epak", "w!c");
+	packfile_chunk_memory(F_CHUNK_MEMORY);
+	checksum_test("checksum with pass.epak");
+	packfile_password(0);
+	partial_chunk_test("partial no pass.epak", F_WRITE_PACKED);
+	packed_tail_test("tail no pass.epak");
+	checksum_test("checksum no pass.epak");
+	key_test();
+	chacha20_test();
+	array_test("array no pass.epak", F_WRITE_NOPACK);
+	packfile_password(PASSWORD);
+	array_test("array with pass.epak", F_WRITE_PACKED);
+	fast_byte_test("bytes with pass.epak", F_WRITE_PACKED);
+	packfile_password(0);
+	fast_byte_test("bytes no pass.epak", F_WRITE_NOPACK);
+	varint_test("varint no pass.epak", F_WRITE_NOPACK);
+	packfile_password(PASSWORD);
+	varint_test("varint with pass.epak", F_WRITE_PACKED);
+	large_chunk_test("large with pass.epak", "w!li");
+	large_chunk_test("large with pass.epak", "w!lc");
+	packfile_password(0);
+	large_chunk_test("large no pass.epak", "wpl");
+	large_chunk_test("large no pass.epak", "w!i");
+	vectored_test("vectored no pass.epak", F_WRITE, F_READ);
+	vectored_test("vectored no pass.epak", F_WRITE_PACKED, F_READ_PACKED);
+	packfile_password(PASSWORD);
+	vectored_test("vectored with pass.epak", F_WRITE_NOPACK, F_READ_PACKED);
+	archive_test();
 
 	printf("Test finished.\n");
 
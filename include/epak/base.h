@@ -25,6 +25,7 @@
 
 #define _AL_MALLOC_ATOMIC		malloc
 #define _AL_MALLOC				malloc
+#define _AL_REALLOC				realloc
 #define _AL_FREE				free
 #define AL_ASSERT				assert
 
@@ -41,6 +42,10 @@
 	#define	AL_MIN(a,b) (((a)<(b))?(a):(b))
 #endif
 
+#ifndef AL_MAX
+	#define	AL_MAX(a,b) (((a)>(b))?(a):(b))
+#endif
+
 #ifndef O_BINARY
 	#define O_BINARY	0
 #endif
@@ -54,16 +59,21 @@
 #define PACKFILE_FLAG_ERROR      16    /* an error has occurred */
 #define PACKFILE_FLAG_OLD_CRYPT  32    /* backward compatibility mode */
 #define PACKFILE_FLAG_EXEDAT     64    /* reading from our executable */
+#define PACKFILE_FLAG_MEMORY     128   /* data lives in a memory block */
+#define PACKFILE_FLAG_INPLACE    256   /* chunk written straight into its parent */
+#define PACKFILE_FLAG_CHECKSUM   512   /* data written is checksummed */
+#define PACKFILE_FLAG_LARGE      1024  /* chunks have 64-bit headers */
 
 #define ALLEGRO_NO_STRICMP 1
 #define ALLEGRO_NO_STRUPR 1
 
 #ifndef AL_INLINE
-	#define AL_INLINE(type, name, args, code)    static type name args code
+	#define AL_INLINE(type, name, args, code)    static inline type name args code
 #endif
 
 typedef struct PACKFILE_VTABLE_t PACKFILE_VTABLE;
 typedef struct PACKFILE_t PACKFILE;
+typedef struct PACKFILE_KEY_t PACKFILE_KEY;
 typedef struct LZSS_PACK_DATA_t LZSS_PACK_DATA;
 typedef struct LZSS_UNPACK_DATA_t LZSS_UNPACK_DATA;
 
@@ -19,6 +19,9 @@
 #ifndef ALLEGRO_FILE_H
 #define ALLEGRO_FILE_H
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 #include "epak/base.h"
 
 #ifdef __cplusplus
@@ -34,13 +37,44 @@
 
 /// 4K buffer for caching data
 #define F_BUF_SIZE      4096
+/// 64K windows for background read-ahead
+#define F_AHEAD_SIZE    (16 * F_BUF_SIZE)
+/// chunks are staged in memory up to 1MB by default
+#define F_CHUNK_MEMORY  (1024 * 1024)
 /// magic number for packed files
 #define F_PACK_MAGIC    0x736C6821L
 /// magic number for autodetect
 #define F_NOPACK_MAGIC  0x736C682EL
 /// magic number for appended data
 #define F_EXE_MAGIC     0x736C682BL
-
+/// magic number starting files encrypted with ChaCha20
+#define F_CHACHA_MAGIC  0x736C6823L
+/// in place of the size of a chunk whose header has 64-bit sizes
+#define F_CHUNK64_MAGIC 0xFFFFFFFFL
+/// magic number ending the chunk table of contents
+#define F_TOC_MAGIC     0x746F6331L
+/// magic number ending a table of contents with chunk names
+#define F_TOC_NAMES_MAGIC 0x746F6332L
+/// magic number ending a table of contents with chunk checksums
+#define F_TOC_CRC_MAGIC 0x746F6333L
+/// magic number ending a table of contents with 64-bit positions
+#define F_TOC64_MAGIC   0x746F6334L
+/// magic number ending a table with 64-bit positions and chunk checksums
+#define F_TOC64_CRC_MAGIC 0x746F6335L
+
+
+
+/// Memory block backing a file opened with pack_fopen_memory()
+struct _al_packfile_memory
+{
+	unsigned char *data;                ///< start of the block
+	long size;                          ///< number of valid bytes in the block
+	long pos;                           ///< current read/write position
+	long capacity;                      ///< allocated size of the block
+	void **out;                         ///< growable blocks are published here
+	long *out_size;                     ///< along with their size
+	long limit;                         ///< staged chunks spill to disk past this
+};
 
 
 struct _al_normal_packfile_details
@@ -50,12 +84,29 @@ struct _al_normal_packfile_details
 	unsigned char *buf_pos;             ///< position in buffer
 	int buf_size;                       ///< number of bytes in the buffer
 	long todo;                          ///< number of bytes still on the disk
+	int64_t pos;                        ///< bytes moved through the buffer so far
+	int64_t origin;                     ///< value of pos where the data starts
 	PACKFILE *parent;		            ///< nested, parent file
 	LZSS_PACK_DATA *pack_data;			///< for LZSS compression
 	LZSS_UNPACK_DATA *unpack_data; 		///< for LZSS decompression
 	char *filename;                     ///< name of the file
+	PACKFILE_KEY *key;                  ///< encryption key, shared with other files
 	char *passdata;                     ///< encryption key data
+	long keypos;                        ///< position in a ChaCha20 key stream
+	unsigned char nonce[12];            ///< ChaCha20 nonce of the file
 	char *passpos;                      ///< current key position
+	struct _al_packfile_memory mem;     ///< for PACKFILE_FLAG_MEMORY files
+	struct _al_packfile_readahead *ahead; ///< for the 's' and 'd' modes
+	struct _al_packfile_uring *uring;   ///< for the 'u' mode
+	struct _al_packfile_behind *behind; ///< for the 'd' mode when writing
+	long chunk_header;                  ///< parent position of an in-place chunk header
+	int64_t chunk_end;                  ///< parent position where a chunk being read ends
+	struct _al_packfile_toc *toc;       ///< for the 'i' mode and indexed reads
+	struct _al_packfile_shared *shared; ///< descriptor shared by pack_fdup_reader()
+	struct _al_packfile_siblings *siblings; ///< chunks opened by pack_fopen_chunk_concurrent()
+	struct _al_packfile_sibling *sibling; ///< queue entry of such a chunk
+	unsigned long checksum;             ///< CRC-32C of the data written so far
+	long chunk_memory;                  ///< staging limit for chunks written into the file
 	unsigned char buf[F_BUF_SIZE];      ///< the actual data buffer
 };
 
@@ -91,11 +142,32 @@ struct PACKFILE_VTABLE_t
 
 
 void packfile_password(const char *password);
+PACKFILE_KEY *packfile_key_create(const char *password);
+PACKFILE_KEY *packfile_key_create_chacha20(const unsigned char *key);
+void packfile_key_destroy(PACKFILE_KEY *key);
+void packfile_chunk_memory(long limit);
+void pack_chunk_memory(PACKFILE *f, long limit);
 PACKFILE *pack_fopen(const char *filename, const char *mode);
+PACKFILE *pack_fopen_key(const char *filename, const char *mode, PACKFILE_KEY *key);
 PACKFILE *pack_fopen_vtable(const PACKFILE_VTABLE *vtable, void *userdata);
+PACKFILE *pack_fopen_memory(void *buf, long len, const char *mode);
+PACKFILE *pack_fopen_memory_key(void *buf, long len, const char *mode, PACKFILE_KEY *key);
+PACKFILE *pack_fopen_memstream(void **bufp, long *sizep, const char *mode);
+PACKFILE *pack_fopen_memstream_key(void **bufp, long *sizep, const char *mode,
+	PACKFILE_KEY *key);
+PACKFILE *pack_fdup_reader(PACKFILE *f);
 int pack_fclose(PACKFILE *f);
 int pack_fseek(PACKFILE *f, int offset);
+int pack_fseek64(PACKFILE *f, int64_t offset);
+int64_t pack_ftell64(PACKFILE *f);
 int pack_skip_chunks(PACKFILE *f, unsigned int num_chunks);
+unsigned int pack_skip_chunks_ex(PACKFILE *f, unsigned int num_chunks);
+long pack_chunk_count(PACKFILE *f);
+PACKFILE *pack_fopen_chunk_index(PACKFILE *f, long index);
+PACKFILE *pack_fopen_chunk_named(PACKFILE *f, const char *name, int pack);
+PACKFILE *pack_fopen_chunk_by_name(PACKFILE *f, const char *name);
+PACKFILE *pack_fopen_chunk_concurrent(PACKFILE *f, const char *name, int pack);
+long pack_verify_chunks(PACKFILE *f, int threads);
 PACKFILE *pack_fopen_chunk(PACKFILE *f, int pack);
 PACKFILE *pack_fclose_chunk(PACKFILE *f);
 int pack_getc(PACKFILE *f);
@@ -110,9 +182,59 @@ int pack_mgetw(PACKFILE *f);
 long pack_mgetl(PACKFILE *f);
 int pack_mputw(int w, PACKFILE *f);
 long pack_mputl(long l, PACKFILE *f);
+long pack_iread_u16(PACKFILE *f, uint16_t *dst, long count);
+long pack_iread_u32(PACKFILE *f, uint32_t *dst, long count);
+long pack_mread_u16(PACKFILE *f, uint16_t *dst, long count);
+long pack_mread_u32(PACKFILE *f, uint32_t *dst, long count);
+long pack_iwrite_u16(PACKFILE *f, const uint16_t *src, long count);
+long pack_iwrite_u32(PACKFILE *f, const uint32_t *src, long count);
+long pack_mwrite_u16(PACKFILE *f, const uint16_t *src, long count);
+long pack_mwrite_u32(PACKFILE *f, const uint32_t *src, long count);
+int pack_vputl(uint64_t v, PACKFILE *f);
+int pack_vgetl(PACKFILE *f, uint64_t *v);
+int pack_zputl(int64_t v, PACKFILE *f);
+int pack_zgetl(PACKFILE *f, int64_t *v);
+long pack_putblob(const void *p, long n, PACKFILE *f);
+long pack_getblob(void *p, long max, PACKFILE *f);
 long pack_fread(void *p, long n, PACKFILE *f);
 long pack_fwrite(const void *p, long n, PACKFILE *f);
+long pack_freadv(PACKFILE *f, const struct iovec *iov, int iovcnt);
+long pack_fwritev(PACKFILE *f, const struct iovec *iov, int iovcnt);
 int pack_ungetc(int c, PACKFILE *f);
+long pack_fpeek(PACKFILE *f, const unsigned char **ptr, long min_len);
+int pack_fconsume(PACKFILE *f, long n);
+
+
+
+/** Like pack_getc(), but takes the byte straight from the buffer of a
+ * "normal" packfile when there is more than one left, in the way of
+ * getc_unlocked(). The last byte of the buffer and other kinds of files
+ * go through the vtable, which handles end of file and refilling.
+ */
+AL_INLINE(int, pack_getc_fast, (PACKFILE *f),
+{
+	if (f->is_normal_packfile && (f->normal.buf_size > 1)) {
+		f->normal.buf_size--;
+		return *(f->normal.buf_pos++);
+	}
+
+	return pack_getc(f);
+})
+
+
+/** Like pack_putc(), but stores the byte straight into the buffer of a
+ * "normal" packfile while it has room, calling into the vtable only
+ * when the buffer has to be flushed.
+ */
+AL_INLINE(int, pack_putc_fast, (int c, PACKFILE *f),
+{
+	if (f->is_normal_packfile && (f->normal.buf_size + 1 < F_BUF_SIZE)) {
+		f->normal.buf_size++;
+		return (*(f->normal.buf_pos++) = (unsigned char)c);
+	}
+
+	return pack_putc(c, f);
+})
 
 
 
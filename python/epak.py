@@ -9,6 +9,13 @@ import _epak
 
 class Epak:
 	def __init__(self, filename, mode):
+		"""Opens filename with pack_fopen().
+
+		The mode takes the pack_fopen() flags rather than those of
+		the builtin open(): 'rb' and 'rt' are the same as 'r', 'd'
+		asks for a background reader or writer thread and 'i' for a
+		chunk table.
+		"""
 		self.filename = filename
 		self.mode = mode
 		self.pak = _epak.open(filename, mode)
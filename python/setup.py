@@ -8,7 +8,7 @@ from distutils.core import setup, Extension
 
 include_dirs = ["include"]
 lib_dirs = ["obj"]
-libraries = ["epak"]
+libraries = ["epak", "pthread"]
 extra_compile_args = ["-Wall", "-W", "-Werror",  "-Wno-unused",
 	"-g",  "-fno-common",  "-pipe"]
 extra_link_args = ["-gA"]
@@ -28,11 +28,14 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/fcntl.h>
+#include <sys/random.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -51,32 +54,153 @@
 
 #define OPEN_PERMS	(S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
+/* io_uring is used when the kernel headers are available */
+#if defined(__linux__) && defined(__has_include) && !defined(ALLEGRO_NO_IO_URING)
+	#if __has_include(<linux/io_uring.h>)
+		#define ALLEGRO_HAVE_IO_URING
+	#endif
+#endif
+
+#ifdef ALLEGRO_HAVE_IO_URING
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+#endif
+
+/* CRC-32C instructions, checked for at run time on x86 */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(ALLEGRO_NO_CRC32C)
+	#define ALLEGRO_HAVE_SSE42_CRC32C
+	#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32) && !defined(ALLEGRO_NO_CRC32C)
+	#define ALLEGRO_HAVE_ARM_CRC32C
+	#include <arm_acle.h>
+#endif
 
-static char the_password[256] = "";
+/* wide XOR for the password cipher and byte swapping for integer arrays */
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
-static int _packfile_filesize = 0;
-static int _packfile_datasize = 0;
+/* I/O strategies requested through the mode string */
+#define IO_SEQUENTIAL	1	/* 's': sequential access hints */
+#define IO_BACKGROUND	2	/* 'd': background read-ahead thread */
+#define IO_URING		4	/* 'u': asynchronous io_uring transfers */
 
-static int _packfile_type = 0;
 
-static PACKFILE_VTABLE normal_vtable;
+#define PACKFILE_KEY_MAX	255		/* longest password */
 
+#define KEY_XOR			0		/* repeating password */
+#define KEY_CHACHA20	1		/* ChaCha20 stream cipher */
 
+#define CHACHA_HEADER	16		/* F_CHACHA_MAGIC and the nonce */
+#define CHACHA_LIMIT	((int64_t)64 << 32)	/* key stream before the counter wraps */
 
+#define IOV_BATCH		64		/* blocks passed to readv() or writev() at once */
 
-/** _al_sane_strncpy:
- *  strncpy() substitution which properly null terminates a string.
- *  By Henrik Stokseth.
- */
-static char *_al_sane_strncpy(char *dest, const char *src, size_t n)
+#define CHUNK_HEADER	8		/* 32-bit sizes of a chunk */
+#define CHUNK64_HEADER	20		/* F_CHUNK64_MAGIC and 64-bit sizes */
+
+/* byte order of the integer arrays in memory */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	#define NATIVE_INTEL	FALSE
+#else
+	#define NATIVE_INTEL	TRUE
+#endif
+
+#define SWAP_ITEMS		(F_BUF_SIZE / 4)	/* 32 bit items converted at a time */
+
+
+/* a password ready for use, see packfile_key_create() */
+struct PACKFILE_KEY_t
 {
-	if (n <= 0)
-		return dest;
-	dest[0] = '\0';
-	strncat(dest, src, n - 1);
+	pthread_mutex_t lock;
+	int refs;							/* files using the key, plus the owner */
+	int cipher;							/* KEY_* constant */
+	uint32_t chacha[8];					/* KEY_CHACHA20 key words */
+	long len;							/* length of the password */
+	int32_t mask[2];					/* for old and new magic numbers */
+	char data[1];						/* password, then repeated, see xor_password() */
+};
+
+
+/* the key used by pack_fopen() and friends, see packfile_password() */
+static PACKFILE_KEY *default_key = NULL;
+static int default_key_error = FALSE;
+static pthread_mutex_t default_key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* default for pack_chunk_memory(), see packfile_chunk_memory() */
+static long chunk_memory_limit = F_CHUNK_MEMORY;
+
+static PACKFILE_VTABLE normal_vtable;
+
+static int32_t key_mask(AL_CONST char *password, int new_format);
+static void key_seek(PACKFILE *f, long pos);
+static int key_exhausted(PACKFILE *f, long pos, long n);
+static void chacha20_xor(AL_CONST uint32_t *key, AL_CONST unsigned char *nonce, long pos,
+	unsigned char *p, long n);
+static int chacha20_nonce(unsigned char *nonce);
+static void write_chacha20_header(PACKFILE *f);
+static int read_chacha20_header(PACKFILE *f);
+
+static void raw_attach(PACKFILE *f, int fd, AL_CONST struct _al_packfile_memory *mem);
+static long raw_read(PACKFILE *f, unsigned char *p, long n);
+static long raw_write(PACKFILE *f, AL_CONST unsigned char *p, long n);
+static int raw_vectored(PACKFILE *f);
+static long raw_iov(PACKFILE *f, AL_CONST struct iovec *iov, int iovcnt, long skip, int write);
+static int raw_seek(PACKFILE *f, long offset);
+static int raw_patch(PACKFILE *f, long offset, AL_CONST unsigned char *p, long n);
+static int raw_pwrite(int hndl, AL_CONST unsigned char *p, long n, off_t offset);
+static int raw_seekable(PACKFILE *f);
+static int raw_spill(PACKFILE *f);
+static long raw_pread(PACKFILE *f, long offset, unsigned char *p, long n);
+static long raw_size(PACKFILE *f);
+static void raw_discard(PACKFILE *f);
+static int open_temp_file(void);
+static int raw_close(PACKFILE *f);
+static void raw_setup_io(PACKFILE *f, int io);
+static void raw_read_ahead(PACKFILE *f, int background);
+static int raw_read_at(PACKFILE *f, off_t pos);
+static int raw_dup(PACKFILE *dst, PACKFILE *src, long pos);
+static long raw_tell(PACKFILE *f);
+static long read_ahead_read(struct _al_packfile_readahead *a, unsigned char *p, long n);
+static void start_write_behind(PACKFILE *f);
+static void destroy_read_ahead(struct _al_packfile_readahead *a);
+
+static int normal_no_more_input(PACKFILE *f);
+static int normal_fill_buffer(PACKFILE *f, unsigned char *dst, int n);
+static int normal_flush_buffer(PACKFILE *f, int last);
+static int normal_patch(PACKFILE *f, long pos, AL_CONST unsigned char *p, int n);
+static int normal_fseek64(PACKFILE *f, int64_t offset);
+
+static struct _al_packfile_toc *create_toc(int checksums);
+static void destroy_toc(struct _al_packfile_toc *toc);
+static long toc_add(PACKFILE *f, AL_CONST char *name);
+static void toc_finish(PACKFILE *f, long index, long offset, long filesize, long datasize,
+	unsigned long crc);
+static void toc_drop(PACKFILE *f);
+static int toc_write(PACKFILE *f);
+static struct _al_packfile_toc *toc_read(PACKFILE *f);
+static struct _al_packfile_toc *toc_get(PACKFILE *f);
+static int toc_trim(PACKFILE *f);
+static long toc_count(PACKFILE *f);
+static int toc_seek(PACKFILE *f, long index, int *pack);
+static long toc_find(PACKFILE *f, AL_CONST char *name);
+static int toc_names(PACKFILE *f);
+
+static int share_packfile(PACKFILE *f, PACKFILE *dup);
+static int release_shared(PACKFILE *f);
+static int toc_shared(PACKFILE *f);
+
+static PACKFILE *open_concurrent_chunk(PACKFILE *f, AL_CONST char *name, int pack);
+static PACKFILE *close_concurrent_chunk(PACKFILE *f);
+static void destroy_siblings(struct _al_packfile_siblings *s);
+
+static void checksum_chunk(PACKFILE *f, PACKFILE *chunk);
+static unsigned long crc32c(unsigned long crc, AL_CONST unsigned char *p, long n);
+static long toc_verify(PACKFILE *f, int threads);
+
+
 
-	return dest;
-}
 
 /// Checks a path, if it is a directory returns non zero.
 static int _exists_dir(const char *path)
@@ -108,14 +232,11 @@ static int _exists_dir(const char *path)
  * any strings like "I'm the password for the datafile", it would be
  * fairly easy to get access to your data :-)
  *
- * Note #1: when writing a packfile, you can change the password
- * to whatever you want after opening the file, without affecting the
- * write operation. On the contrary, when writing a sub-chunk of a
- * packfile, you must make sure that the password that was active at
- * the time the sub-chunk was opened is still active before closing
- * the sub-chunk. This is guaranteed to be true if you didn't call
- * the packfile_password() routine in the meantime. Read operations,
- * either on packfiles or sub-chunks, have no such restriction.
+ * Note #1: files keep the password that was active when they were
+ * opened, along with their sub-chunks, so you can change the password
+ * to whatever you want at any time without affecting the files already
+ * open. Threads which need different passwords at the same time should
+ * use packfile_key_create() and pack_fopen_key() instead.
  *
  * Note #2: as explained above, the password is used for all
  * read/write operations on files, including for several functions
@@ -129,71 +250,412 @@ static int _exists_dir(const char *path)
  */
 void packfile_password(const char *password)
 {
-	int i = 0;
-	int c;
+	PACKFILE_KEY *key = NULL, *old;
+	int error = FALSE;
 
-	if (password) {
-		while ((c = (*password++)) != 0) {
-			the_password[i++] = c;
-			if (i >= (int)sizeof(the_password)-1)
-				break;
-		}
+	if ((password) && (password[0]) && ((key = packfile_key_create(password)) == NULL))
+		error = TRUE;
+
+	pthread_mutex_lock(&default_key_lock);
+	old = default_key;
+	default_key = key;
+	default_key_error = error;
+	pthread_mutex_unlock(&default_key_lock);
+
+	if (old)
+		packfile_key_destroy(old);
+}
+
+
+
+/** Prepares a password for pack_fopen_key() and the other functions
+ * taking a key. All the work of setting up the password is done once
+ * here, so opening files with the key doesn't allocate anything for it,
+ * and any number of files and threads can use the key at the same time.
+ * Passwords longer than 255 characters are truncated, as with
+ * packfile_password().
+ *
+ * Example:
+ * \code
+ *	PACKFILE_KEY *key = packfile_key_create(user_password);
+ *	PACKFILE *f = pack_fopen_key("save.dat", F_READ_PACKED, key);
+ *	packfile_key_destroy(key);
+ *	...
+ *	pack_fclose(f);
+ * \endcode
+ *
+ * \return Returns the key, to be released with packfile_key_destroy(),
+ * or NULL on error storing the code in `errno'. An empty password is
+ * an error, since files opened without a key aren't encrypted.
+ */
+PACKFILE_KEY *packfile_key_create(const char *password)
+{
+	PACKFILE_KEY *key;
+	long len, i;
+	AL_ASSERT(password);
+
+	if ((len = AL_MIN((long)strlen(password), PACKFILE_KEY_MAX)) == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* the password is followed by a copy repeated over F_BUF_SIZE more
+	 * bytes, so that xor_password() can work a word at a time from any
+	 * position
+	 */
+	if ((key = _AL_MALLOC(sizeof(*key) + 2 * len + F_BUF_SIZE)) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&key->lock, NULL)) {
+		_AL_FREE(key);
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	the_password[i] = 0;
+	key->refs = 1;
+	key->cipher = KEY_XOR;
+	key->len = len;
+
+	memcpy(key->data, password, len);
+	key->data[len] = 0;
+	for (i=0; i<len+F_BUF_SIZE; i+=len)
+		memcpy(key->data + len + 1 + i, password, AL_MIN(len, len + F_BUF_SIZE - i));
+
+	key->mask[0] = key_mask(key->data, FALSE);
+	key->mask[1] = key_mask(key->data, TRUE);
+
+	return key;
 }
 
 
 
-/* encrypt_id:
- *  Helper for encrypting magic numbers, using the current password.
+/** Prepares a key for the ChaCha20 stream cipher from the 32 bytes at
+ * `key', which should be random or derived from a password with a proper
+ * key derivation function. Files opened with the key are fully encrypted
+ * with ChaCha20 as defined in RFC 8439, using a random nonce stored in
+ * the first 16 bytes of the file along with ::F_CHACHA_MAGIC. Data is
+ * encrypted and decrypted a buffer at a time, and seeking only moves the
+ * block counter, so these files are about as fast as unencrypted ones.
+ * A file can hold up to 256GB.
+ *
+ * ChaCha20 only provides confidentiality: combine it with the `c' mode
+ * flag and pack_verify_chunks() to detect tampering.
+ *
+ * \return Returns the key, to be released with packfile_key_destroy(),
+ * or NULL on error storing the code in `errno'.
+ */
+PACKFILE_KEY *packfile_key_create_chacha20(const unsigned char *key)
+{
+	PACKFILE_KEY *k;
+	int i;
+	AL_ASSERT(key);
+
+	if ((k = _AL_MALLOC(sizeof(*k))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&k->lock, NULL)) {
+		_AL_FREE(k);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	k->refs = 1;
+	k->cipher = KEY_CHACHA20;
+	for (i=0; i<8; i++)
+		k->chacha[i] = (uint32_t)key[i*4] | ((uint32_t)key[i*4+1] << 8) |
+			((uint32_t)key[i*4+2] << 16) | ((uint32_t)key[i*4+3] << 24);
+
+	/* the cipher hides the magic numbers already */
+	k->len = 1;
+	k->mask[0] = k->mask[1] = 0;
+	k->data[0] = 0;
+
+	return k;
+}
+
+
+
+/** Releases a key returned by packfile_key_create(). Files opened with the
+ * key keep using it until they are closed, so the key can be released as
+ * soon as the files have been opened.
+ */
+void packfile_key_destroy(PACKFILE_KEY *key)
+{
+	int refs;
+
+	if (!key)
+		return;
+
+	pthread_mutex_lock(&key->lock);
+	refs = --key->refs;
+	pthread_mutex_unlock(&key->lock);
+
+	if (refs > 0)
+		return;
+
+	pthread_mutex_destroy(&key->lock);
+	_AL_FREE(key);
+}
+
+
+
+/** Sets how many bytes of a chunk are kept in memory while it is being
+ * written into a parent which doesn't allow writing it in place, such as
+ * a compressed file or a pipe. Bigger chunks are moved to a temporary
+ * file, encrypted with the current password. Pass zero to always use a
+ * temporary file. The default is F_CHUNK_MEMORY.
+ *
+ * Only files opened afterwards are affected; use pack_chunk_memory() to
+ * change the limit of a file which is already open.
+ */
+void packfile_chunk_memory(long limit)
+{
+	__atomic_store_n(&chunk_memory_limit, AL_MAX(limit, 0), __ATOMIC_RELAXED);
+}
+
+
+
+/** Like packfile_chunk_memory(), but only for chunks opened in `f' from
+ * now on, and the chunks nested in them. This doesn't affect other files,
+ * so threads writing different archives can use different limits.
+ */
+void pack_chunk_memory(PACKFILE *f, long limit)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->is_normal_packfile);
+
+	f->normal.chunk_memory = AL_MAX(limit, 0);
+}
+
+
+
+/* key_mask:
+ *  Computes the mask with which encrypt_id() hides magic numbers.
  */
-static int32_t encrypt_id(long x, int new_format)
+static int32_t key_mask(AL_CONST char *password, int new_format)
 {
 	int32_t mask = 0;
 	int i, pos;
 
-	if (the_password[0]) {
-		for (i=0; the_password[i]; i++)
-			mask ^= ((int32_t)the_password[i] << ((i&3) * 8));
+	for (i=0; password[i]; i++)
+		mask ^= ((int32_t)password[i] << ((i&3) * 8));
 
-		for (i=0, pos=0; i<4; i++) {
-			mask ^= (int32_t)the_password[pos++] << (24-i*8);
-			if (!the_password[pos])
-				pos = 0;
-		}
+	for (i=0, pos=0; i<4; i++) {
+		mask ^= (int32_t)password[pos++] << (24-i*8);
+		if (!password[pos])
+			pos = 0;
+	}
+
+	if (new_format)
+		mask ^= 42;
+
+	return mask;
+}
 
-		if (new_format)
-			mask ^= 42;
+
+
+/* encrypt_id:
+ *  Helper for encrypting magic numbers, using the given key.
+ */
+static int32_t encrypt_id(AL_CONST PACKFILE_KEY *key, long x, int new_format)
+{
+	if (!key)
+		return x;
+
+	return x ^ key->mask[new_format ? 1 : 0];
+}
+
+
+
+/* default_key_get:
+ *  Returns a reference to the key set with packfile_password(), which may
+ *  be NULL. Returns FALSE if that key couldn't be created.
+ */
+static int default_key_get(PACKFILE_KEY **key)
+{
+	int ok;
+
+	pthread_mutex_lock(&default_key_lock);
+	*key = default_key;
+	if (*key) {
+		pthread_mutex_lock(&(*key)->lock);
+		(*key)->refs++;
+		pthread_mutex_unlock(&(*key)->lock);
 	}
+	ok = !default_key_error;
+	pthread_mutex_unlock(&default_key_lock);
 
-	return x ^ mask;
+	if (!ok)
+		errno = ENOMEM;
+
+	return ok;
 }
 
 
 
-/* clone_password:
- *  Sets up a local password string for use by this packfile.
+/* use_key:
+ *  Makes f encrypt with key, which may be NULL, from the byte at pos.
  */
-static int clone_password(PACKFILE *f)
+static void use_key(PACKFILE *f, PACKFILE_KEY *key, long pos)
 {
 	AL_ASSERT(f);
 	AL_ASSERT(f->is_normal_packfile);
+	AL_ASSERT(!f->normal.key);
 
-	if (the_password[0]) {
-		if ((f->normal.passdata = _AL_MALLOC_ATOMIC(strlen(the_password)+1)) == NULL) {
-			errno = ENOMEM;
-			return FALSE;
-		}
-		_al_sane_strncpy(f->normal.passdata, the_password, strlen(the_password)+1);
-		f->normal.passpos = f->normal.passdata;
+	if (key) {
+		pthread_mutex_lock(&key->lock);
+		key->refs++;
+		pthread_mutex_unlock(&key->lock);
+
+		f->normal.key = key;
+		f->normal.passdata = key->data;
+		key_seek(f, pos);
 	}
 	else {
 		f->normal.passpos = NULL;
 		f->normal.passdata = NULL;
 	}
+}
 
-	return TRUE;
+
+
+/* key_seek:
+ *  Moves f to position pos of its key stream.
+ */
+static void key_seek(PACKFILE *f, long pos)
+{
+	if (f->normal.key->cipher == KEY_CHACHA20) {
+		f->normal.keypos = pos;
+		f->normal.passpos = f->normal.passdata;
+	}
+	else {
+		f->normal.passpos = f->normal.passdata + pos % f->normal.key->len;
+	}
+}
+
+
+
+/* key_tell:
+ *  Returns the position of f in its key stream, as far as it is known.
+ */
+static long key_tell(PACKFILE *f)
+{
+	if (f->normal.key->cipher == KEY_CHACHA20)
+		return f->normal.keypos;
+
+	return f->normal.passpos - f->normal.passdata;
+}
+
+
+
+/* key_exhausted:
+ *  Tells whether n bytes from position pos would run past the end of the
+ *  key stream of f, which only ChaCha20 has.
+ */
+static int key_exhausted(PACKFILE *f, long pos, long n)
+{
+	return (f->normal.key->cipher == KEY_CHACHA20) && ((int64_t)pos + n > CHACHA_LIMIT);
+}
+
+
+
+/* drop_key:
+ *  Stops f from using its key.
+ */
+static void drop_key(PACKFILE *f)
+{
+	if (f->normal.key) {
+		packfile_key_destroy(f->normal.key);
+		f->normal.key = NULL;
+	}
+
+	f->normal.passdata = NULL;
+	f->normal.passpos = NULL;
+}
+
+
+
+/* file_key:
+ *  Returns the key of f, or of the file it is a chunk of.
+ */
+static PACKFILE_KEY *file_key(PACKFILE *f)
+{
+	while ((f) && (!f->normal.key))
+		f = f->normal.parent;
+
+	return f ? f->normal.key : NULL;
+}
+
+
+
+/* xor_bytes:
+ *  XORs n bytes at p with the ones at key.
+ */
+static void xor_bytes(unsigned char *p, AL_CONST unsigned char *key, long n)
+{
+	uint64_t w, k;
+
+#ifdef __SSE2__
+	for (; n >= 16; p+=16, key+=16, n-=16) {
+		__m128i v = _mm_loadu_si128((AL_CONST __m128i *)p);
+		v = _mm_xor_si128(v, _mm_loadu_si128((AL_CONST __m128i *)key));
+		_mm_storeu_si128((__m128i *)p, v);
+	}
+#endif
+
+	for (; n >= 8; p+=8, key+=8, n-=8) {
+		memcpy(&w, p, 8);
+		memcpy(&k, key, 8);
+		w ^= k;
+		memcpy(p, &w, 8);
+	}
+
+	while (n-- > 0)
+		*p++ ^= *key++;
+}
+
+
+
+/* xor_password:
+ *  Encrypts or decrypts n bytes at p with the password of f, as the bytes
+ *  found at position pos of the file.
+ */
+static void xor_password(PACKFILE *f, long pos, unsigned char *p, long n)
+{
+	AL_CONST unsigned char *tile;
+	long len, c;
+
+	if (f->normal.key->cipher == KEY_CHACHA20) {
+		chacha20_xor(f->normal.key->chacha, f->normal.nonce, pos, p, n);
+		return;
+	}
+
+	len = f->normal.key->len;
+	tile = (AL_CONST unsigned char *)f->normal.key->data + len + 1;
+
+	for (pos %= len; n > 0; pos = (pos + c) % len) {
+		c = AL_MIN(n, F_BUF_SIZE);
+		xor_bytes(p, tile + pos, c);
+		p += c;
+		n -= c;
+	}
+}
+
+
+
+/* xor_stream:
+ *  Encrypts or decrypts the next n bytes of f, moving along the key.
+ */
+static void xor_stream(PACKFILE *f, unsigned char *p, long n)
+{
+	long pos = key_tell(f);
+
+	xor_password(f, pos, p, n);
+	key_seek(f, pos + n);
 }
 
 
@@ -229,12 +691,30 @@ static PACKFILE *create_packfile(int is_normal_packfile)
 		f->normal.flags = 0;
 		f->normal.buf_size = 0;
 		f->normal.filename = NULL;
+		f->normal.key = NULL;
+		f->normal.keypos = 0;
+		memset(f->normal.nonce, 0, sizeof(f->normal.nonce));
 		f->normal.passdata = NULL;
 		f->normal.passpos = NULL;
 		f->normal.parent = NULL;
 		f->normal.pack_data = NULL;
 		f->normal.unpack_data = NULL;
 		f->normal.todo = 0;
+		f->normal.pos = 0;
+		f->normal.origin = 0;
+		f->normal.hndl = -1;
+		f->normal.ahead = NULL;
+		f->normal.uring = NULL;
+		f->normal.behind = NULL;
+		f->normal.chunk_header = 0;
+		f->normal.chunk_end = 0;
+		f->normal.checksum = 0;
+		f->normal.chunk_memory = __atomic_load_n(&chunk_memory_limit, __ATOMIC_RELAXED);
+		f->normal.toc = NULL;
+		f->normal.shared = NULL;
+		f->normal.siblings = NULL;
+		f->normal.sibling = NULL;
+		memset(&f->normal.mem, 0, sizeof(f->normal.mem));
 	}
 
 	return f;
@@ -255,8 +735,12 @@ static void free_packfile(PACKFILE *f)
 		if (f->is_normal_packfile) {
 			AL_ASSERT(!f->normal.pack_data);
 			AL_ASSERT(!f->normal.unpack_data);
+			AL_ASSERT(!f->normal.key);
 			AL_ASSERT(!f->normal.passdata);
 			AL_ASSERT(!f->normal.passpos);
+
+			if (f->normal.siblings)
+				destroy_siblings(f->normal.siblings);
 		}
 
 		_AL_FREE(f);
@@ -265,21 +749,39 @@ static void free_packfile(PACKFILE *f)
 
 
 
+/* start_tell:
+ *  Makes pack_ftell64() count from the current position of f, once the
+ *  headers of the file have been read or written.
+ */
+static void start_tell(PACKFILE *f)
+{
+	if (f->normal.flags & PACKFILE_FLAG_WRITE)
+		f->normal.origin = f->normal.pos + f->normal.buf_size;
+	else
+		f->normal.origin = f->normal.pos - AL_MAX(f->normal.buf_size, 0);
+}
+
+
+
 /**
- *  Converts the given file descriptor into a PACKFILE. The mode can have
- *  the same values as for pack_fopen() and must be compatible with the
- *  mode of the file descriptor. Unlike the libc fdopen(), pack_fdopen()
- *  is unable to convert an already partially read or written file (i.e.
- *  the file offset must be 0).
+ *  Converts the given file descriptor or memory block into a PACKFILE. If
+ *  mem is not NULL the file descriptor is ignored and all the data is read
+ *  from or written to the memory block instead. The mode can have the same
+ *  values as for pack_fopen() and must be compatible with the mode of the
+ *  file descriptor. Unlike the libc fdopen(), pack_fdopen() is unable to
+ *  convert an already partially read or written file (i.e. the file offset
+ *  must be 0).
  *
  *  \return On success, it returns a pointer to a file structure, and on error
  *  it returns NULL and stores an error code in errno. An attempt to read
  *  a normal file in packed mode will cause errno to be set to EDOM.
  */
-static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
+static PACKFILE *_pack_open_raw(int fd, AL_CONST struct _al_packfile_memory *mem,
+	AL_CONST char *mode, PACKFILE_KEY *key)
 {
 	PACKFILE *f, *f2;
 	long header = FALSE;
+	int io = 0, toc = FALSE, checksums = FALSE;
 	int c;
 
 	if ((f = create_packfile(TRUE)) == NULL)
@@ -293,6 +795,12 @@ static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 			case 'w': case 'W': f->normal.flags |= PACKFILE_FLAG_WRITE; break;
 			case 'p': case 'P': f->normal.flags |= PACKFILE_FLAG_PACK; break;
 			case '!': f->normal.flags &= ~PACKFILE_FLAG_PACK; header = TRUE; break;
+			case 's': case 'S': io |= IO_SEQUENTIAL; break;
+			case 'd': case 'D': io |= IO_BACKGROUND; break;
+			case 'u': case 'U': io |= IO_URING; break;
+			case 'i': case 'I': toc = TRUE; break;
+			case 'c': case 'C': toc = checksums = TRUE; break;
+			case 'l': case 'L': f->normal.flags |= PACKFILE_FLAG_LARGE; break;
 		}
 	}
 
@@ -307,31 +815,53 @@ static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 				return NULL;
 			}
 
-			if ((f->normal.parent = _pack_fdopen(fd, F_WRITE)) == NULL) {
+			if ((f->normal.parent = _pack_open_raw(fd, mem, F_WRITE, key)) == NULL) {
 				free_lzss_pack_data(f->normal.pack_data);
 				f->normal.pack_data = NULL;
 				free_packfile(f);
 				return NULL;
 			}
 
-			pack_mputl(encrypt_id(F_PACK_MAGIC, TRUE), f->normal.parent);
+			raw_setup_io(f->normal.parent, io);
+
+			pack_mputl(encrypt_id(key, F_PACK_MAGIC, TRUE), f->normal.parent);
 
 			f->normal.todo = 4;
+
+			if (io & IO_BACKGROUND)
+				start_write_behind(f);
 		}
 		else {
 			/* write a 'real' file */
-			if (!clone_password(f)) {
+			if (toc && (f->normal.toc = create_toc(checksums)) == NULL) {
+				free_packfile(f);
+				return NULL;
+			}
+
+			use_key(f, key, 0);
+
+			if ((key) && (key->cipher == KEY_CHACHA20) && (chacha20_nonce(f->normal.nonce))) {
+				if (f->normal.toc)
+					destroy_toc(f->normal.toc);
+				drop_key(f);
 				free_packfile(f);
 				return NULL;
 			}
 
-			f->normal.hndl = fd;
+			raw_attach(f, fd, mem);
+			raw_setup_io(f, io);
 			f->normal.todo = 0;
 
 			errno = 0;
 
+			if ((key) && (key->cipher == KEY_CHACHA20))
+				write_chacha20_header(f);
+
 			if (header)
-				pack_mputl(encrypt_id(F_NOPACK_MAGIC, TRUE), f);
+				pack_mputl(encrypt_id(key, F_NOPACK_MAGIC, TRUE), f);
+
+			if (io & IO_BACKGROUND)
+				start_write_behind(f);
 		}
 	}
 	else {
@@ -345,23 +875,27 @@ static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 				return NULL;
 			}
 
-			if ((f->normal.parent = _pack_fdopen(fd, F_READ)) == NULL) {
+			if ((f->normal.parent = _pack_open_raw(fd, mem, F_READ, key)) == NULL) {
 				free_lzss_unpack_data(f->normal.unpack_data);
 				f->normal.unpack_data = NULL;
 				free_packfile(f);
 				return NULL;
 			}
 
+			raw_setup_io(f->normal.parent, io);
+
 			header = pack_mgetl(f->normal.parent);
 
-			if ((f->normal.parent->normal.passpos) &&
-				 ((header == encrypt_id(F_PACK_MAGIC, FALSE)) ||
-				  (header == encrypt_id(F_NOPACK_MAGIC, FALSE))))
+			if ((f->normal.parent->normal.passpos) && (key->cipher == KEY_XOR) &&
+				 ((header == encrypt_id(key, F_PACK_MAGIC, FALSE)) ||
+				  (header == encrypt_id(key, F_NOPACK_MAGIC, FALSE))))
 			{
-				/* duplicate the file descriptor */
-				int fd2 = dup(fd);
+				/* duplicate the file descriptor, memory blocks can simply
+				 * be read again from their start
+				 */
+				int fd2 = mem ? -1 : dup(fd);
 
-				if (fd2<0) {
+				if (!mem && fd2<0) {
 					pack_fclose(f->normal.parent);
 					free_packfile(f);
 					return NULL;
@@ -371,45 +905,48 @@ static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 				pack_fclose(f->normal.parent);
 
 				/* backward compatibility mode */
-				if (!clone_password(f)) {
-					free_packfile(f);
-					return NULL;
-				}
-
+				use_key(f, key, 0);
 				f->normal.flags |= PACKFILE_FLAG_OLD_CRYPT;
 
 				/* re-open the parent file */
-				lseek(fd2, 0, SEEK_SET);
+				if (!mem)
+					lseek(fd2, 0, SEEK_SET);
 
-				if ((f->normal.parent = _pack_fdopen(fd2, F_READ)) == NULL) {
+				if ((f->normal.parent = _pack_open_raw(fd2, mem, F_READ, key)) == NULL) {
+					drop_key(f);
 					free_packfile(f);
 					return NULL;
 				}
 
+				raw_setup_io(f->normal.parent, io);
+
 				f->normal.parent->normal.flags |= PACKFILE_FLAG_OLD_CRYPT;
 
 				pack_mgetl(f->normal.parent);
 
-				if (header == encrypt_id(F_PACK_MAGIC, FALSE))
-					header = encrypt_id(F_PACK_MAGIC, TRUE);
+				if (header == encrypt_id(key, F_PACK_MAGIC, FALSE))
+					header = encrypt_id(key, F_PACK_MAGIC, TRUE);
 				else
-					header = encrypt_id(F_NOPACK_MAGIC, TRUE);
+					header = encrypt_id(key, F_NOPACK_MAGIC, TRUE);
 			}
 
-			if (header == encrypt_id(F_PACK_MAGIC, TRUE)) {
+			if (header == encrypt_id(key, F_PACK_MAGIC, TRUE)) {
 				f->normal.todo = LONG_MAX;
 			}
-			else if (header == encrypt_id(F_NOPACK_MAGIC, TRUE)) {
+			else if (header == encrypt_id(key, F_NOPACK_MAGIC, TRUE)) {
 				f2 = f->normal.parent;
 				free_lzss_unpack_data(f->normal.unpack_data);
 				f->normal.unpack_data = NULL;
+				drop_key(f);
 				free_packfile(f);
+				start_tell(f2);
 				return f2;
 			}
 			else {
 				pack_fclose(f->normal.parent);
 				free_lzss_unpack_data(f->normal.unpack_data);
 				f->normal.unpack_data = NULL;
+				drop_key(f);
 				free_packfile(f);
 				errno = EDOM;
 				return NULL;
@@ -417,27 +954,54 @@ static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
 		}
 		else {
 			/* read a 'real' file */
-			f->normal.todo = lseek(fd, 0, SEEK_END);	/* size of the file */
-			if (f->normal.todo < 0) {
-				free_packfile(f);
-				return NULL;
+			if (mem) {
+				f->normal.todo = mem->size;
+			}
+			else {
+				f->normal.todo = lseek(fd, 0, SEEK_END);	/* size of the file */
+				if (f->normal.todo < 0) {
+					free_packfile(f);
+					return NULL;
+				}
+
+				lseek(fd, 0, SEEK_SET);
 			}
 
-			lseek(fd, 0, SEEK_SET);
+			use_key(f, key, 0);
+			raw_attach(f, fd, mem);
 
-			if (!clone_password(f)) {
-				free_packfile(f);
+			if ((key) && (key->cipher == KEY_CHACHA20) && (read_chacha20_header(f))) {
+				pack_fclose(f);
+				errno = EDOM;
+				return NULL;
+			}
+
+			if (toc_trim(f)) {
+				c = errno;
+				pack_fclose(f);
+				errno = c;
 				return NULL;
 			}
 
-			f->normal.hndl = fd;
+			raw_setup_io(f, io);
 		}
 	}
 
+	start_tell(f);
 	return f;
 }
 
 
+
+/* _pack_fdopen:
+ *  Converts the given file descriptor into a PACKFILE, see _pack_open_raw().
+ */
+static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode, PACKFILE_KEY *key)
+{
+	return _pack_open_raw(fd, NULL, mode, key);
+}
+
+
 /** Opens a file according to mode, which may contain any of the flags:
  *
  * - r: open file for reading.
@@ -450,11 +1014,50 @@ static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
  *      value ::F_NOPACK_MAGIC to the start of the file, so that it can later
  *      be opened in packed mode and Allegro will automatically detect
  *      that the data does not need to be decompressed.
+ * - s: the file will be read sequentially. The operating system is told
+ *      to read ahead of the current position, so the data is usually in
+ *      memory by the time the buffer needs to be refilled.
+ * - d: like s, but a background thread also reads the next ::F_AHEAD_SIZE
+ *      bytes of the file into a second buffer while the current one is
+ *      being consumed, hiding the latency of slow devices. When writing,
+ *      full buffers are queued for a thread which encrypts, compresses
+ *      and writes them while the next one is being filled. Errors of the
+ *      thread are reported by a later write or pack_fclose().
+ * - u: transfer data with io_uring on Linux, keeping several windows of
+ *      ::F_AHEAD_SIZE bytes in flight for both reading and writing. Where
+ *      io_uring is not available the flag is ignored. Write errors may be
+ *      reported by a later write or pack_fclose().
+ * - i: when writing an uncompressed file, append a table listing the
+ *      position and size of every chunk at the top level of the file, so
+ *      that pack_fopen_chunk_index() can later jump straight to any of
+ *      them. Ignored for compressed files. When the file is read the
+ *      table is not part of its data, so reading the chunks one after the
+ *      other with pack_fopen_chunk() still ends with ENOENT after the
+ *      last one.
+ * - c: like i, but the table also keeps the CRC-32C of every chunk, so
+ *      that pack_verify_chunks() can check them.
+ * - l: when writing, give every chunk a header with 64-bit sizes. Chunks
+ *      which are copied into their parent when closed get one anyway if
+ *      they need it, but chunks written straight into an uncompressed
+ *      file must know in advance if they may grow past 2GB. Without
+ *      this flag they fail with EFBIG as soon as they do.
  *
  * Instead of these flags, one of the constants ::F_READ, ::F_WRITE,
  * ::F_READ_PACKED, ::F_WRITE_PACKED or ::F_WRITE_NOPACK may be used as the
  * mode parameter.
  *
+ * Other characters are ignored, so the stdio flags of modes like "rb" or
+ * "wt" have no effect: b doesn't start the background thread of the d
+ * flag, and t doesn't add a table like the i flag.
+ *
+ * All the state of a file lives in its PACKFILE and in the chunks and
+ * keys it uses, so different threads can work on different files at the
+ * same time without locking. A file and the chunks opened in it form a
+ * single unit which must only be used by one thread at a time, except as
+ * described for pack_fdup_reader() and pack_fopen_chunk_concurrent(). The
+ * process-wide settings of packfile_password() and packfile_chunk_memory()
+ * may be changed at any time, and are picked up by files opened later.
+ *
  * Example:
  * \code
  *	PACKFILE *input_file;
@@ -471,19 +1074,39 @@ static PACKFILE *_pack_fdopen(int fd, AL_CONST char *mode)
  */
 PACKFILE *pack_fopen(const char *filename, const char *mode)
 {
-	int fd;
-	AL_ASSERT(filename);
+	PACKFILE_KEY *key;
+	PACKFILE *f;
 
-	_packfile_type = 0;
+	if (!default_key_get(&key))
+		return NULL;
 
-#ifndef ALLEGRO_MPW
-	if (strpbrk(mode, "wW"))  /* write mode? */
-		fd = _al_open(filename, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC, OPEN_PERMS);
-	else
-		fd = _al_open(filename, O_RDONLY | O_BINARY, OPEN_PERMS);
-#else
-	if (strpbrk(mode, "wW"))  /* write mode? */
-		fd = _al_open(filename, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC);
+	f = pack_fopen_key(filename, mode, key);
+	packfile_key_destroy(key);
+
+	return f;
+}
+
+
+
+/** Like pack_fopen(), but files are encrypted with `key' instead of the
+ * password set with packfile_password(). Pass NULL for no encryption.
+ * Several threads can open files with different keys at the same time.
+ *
+ * \return Returns the file, or NULL on error storing the code in `errno'.
+ */
+PACKFILE *pack_fopen_key(const char *filename, const char *mode, PACKFILE_KEY *key)
+{
+	int fd;
+	AL_ASSERT(filename);
+
+#ifndef ALLEGRO_MPW
+	if (strpbrk(mode, "wW"))  /* write mode? */
+		fd = _al_open(filename, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC, OPEN_PERMS);
+	else
+		fd = _al_open(filename, O_RDONLY | O_BINARY, OPEN_PERMS);
+#else
+	if (strpbrk(mode, "wW"))  /* write mode? */
+		fd = _al_open(filename, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC);
 	else
 		fd = _al_open(filename, O_RDONLY | O_BINARY);
 #endif
@@ -492,7 +1115,7 @@ PACKFILE *pack_fopen(const char *filename, const char *mode)
 		return NULL;
 	}
 
-	return _pack_fdopen(fd, mode);
+	return _pack_fdopen(fd, mode, key);
 }
 
 
@@ -536,1070 +1159,5767 @@ PACKFILE *pack_fopen_vtable(const PACKFILE_VTABLE *vtable, void *userdata)
 }
 
 
-/** Closes a stream previously opened with pack_fopen() or
- * pack_fopen_vtable(). After you have closed the stream, performing
- * operations on it will yield errors in your application (e.g. crash
- * it) or even block your OS.
+/** Opens a PACKFILE which reads from or writes to the len bytes of memory
+ * at buf instead of a file on disk. The mode accepts the same flags as
+ * pack_fopen(), so memory files can be packed, encrypted with
+ * packfile_password() and contain chunks just like normal files.
  *
- * \return Returns zero on success. On error, returns an error code
- * which is also stored in `errno'. This function can fail only when
- * writing to files: if the file was opened in read mode, it will
- * always succeed.
+ * In read mode the whole block is considered to be the file contents. In
+ * write mode writing more than len bytes fails with errno set to ENOSPC,
+ * use pack_fopen_memstream() if you don't know the size of the output in
+ * advance. The memory is never freed by the library and has to remain
+ * available until the file is closed.
+ *
+ * Example:
+ * \code
+ *	PACKFILE *f = pack_fopen_memory(network_data, network_len, F_READ_PACKED);
+ *	if (!f)
+ *		abort_on_error("Received data is corrupt!");
+ *	f = pack_fopen_chunk(f, 0);
+ *	...
+ * \endcode
+ *
+ * \return On success returns a pointer to a PACKFILE structure, and on
+ * error returns NULL and stores an error code in errno.
  */
-int pack_fclose(PACKFILE *f)
+PACKFILE *pack_fopen_memory(void *buf, long len, const char *mode)
 {
-	int ret;
+	PACKFILE_KEY *key;
+	PACKFILE *f;
 
-	if (!f)
-		return 0;
+	if (!default_key_get(&key))
+		return NULL;
 
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_fclose);
+	f = pack_fopen_memory_key(buf, len, mode, key);
+	packfile_key_destroy(key);
 
-	ret = f->vtable->pf_fclose(f->userdata);
-	free_packfile(f);
+	return f;
+}
 
-	return ret;
+
+
+/** Like pack_fopen_memory(), but the data is encrypted with `key' instead
+ * of the password set with packfile_password(), see pack_fopen_key().
+ */
+PACKFILE *pack_fopen_memory_key(void *buf, long len, const char *mode, PACKFILE_KEY *key)
+{
+	struct _al_packfile_memory mem;
+	AL_ASSERT(buf || !len);
+	AL_ASSERT(len >= 0);
+	AL_ASSERT(mode);
+
+	memset(&mem, 0, sizeof(mem));
+	mem.data = buf;
+	mem.capacity = len;
+	if (!strpbrk(mode, "wW"))
+		mem.size = len;
+
+	return _pack_open_raw(-1, &mem, mode, key);
 }
 
 
-/** Opens a sub-chunk of a file. A chunk provides a logical view of
- * part of a file, which can be compressed as an individual entity
- * and will automatically insert and check length counts to prevent
- * reading past the end of the chunk. The PACKFILE parameter is a
- * previously opened file, and `pack' is a boolean parameter which
- * will turn compression on for the sub-chunk if it is non-zero.
- *
- * Example:
- * \code
- *	PACKFILE *output = pack_fopen("out.raw", "w!");
- *	...
- *	// Create a sub-chunk with compression.
- *	output = pack_fopen(chunk(output, 1);
- *	if (!output)
- *	   abort_on_error("Error saving data!");
- *	// Write some data to the sub-chunk.
- *	...
- *	// Close the sub-chunk, recovering parent file.
- *	output = pack_fclose_chunk(output);
- * \endcode
- *
- * The data written to the chunk will be prefixed with two length
- * counts (32-bit, a.k.a. big-endian). For uncompressed chunks these
- * will both be set to the size of the data in the chunk. For compressed
- * chunks (created by setting the `pack' flag), the first length will
- * be the raw size of the chunk, and the second will be the negative
- * size of the uncompressed data.
- *
- * To read the chunk, use the following code:
- * \code
- *	PACKFILE *input = pack_fopen("out.raw", "rp");
- *	...
- *	input = pack_fopen_chunk(input, 1);
- *	// Read data from the sub-chunk and close it.
- *	...
- *	input = pack_fclose_chunk(input);
- * \endcode
- *
- * This sequence will read the length counts created when the chunk
- * was written, and automatically decompress the contents of the chunk
- * if it was compressed. The length will also be used to prevent
- * reading past the end of the chunk (Allegro will return EOF if you
- * attempt this), and to automatically skip past any unread chunk
- * data when you call pack_fclose_chunk(). This means that you can skip
- * a whole chunk by calling pack_fopen_chunk() and pack_fclose_chunk() in
- * sucession, though it is faster to call pack_skip_chunks().
+
+/** Opens a PACKFILE for writing into a memory block which grows as needed,
+ * similar to the POSIX open_memstream(). The mode has to be a write mode,
+ * see pack_fopen() for the available flags.
  *
- * Chunks can be nested inside each other by making repeated calls
- * to pack_fopen_chunk(). When writing a file, the compression status
- * is inherited from the parent file, so you only need to set the
- * pack flag if the parent is not compressed but you want to pack the
- * chunk data. If the parent file is already open in packed mode,
- * setting the pack flag will result in data being compressed twice:
- * once as it is written to the chunk, and again as the chunk passes
- * it on to the parent file.
+ * The block is allocated with _AL_REALLOC(), realloc() by default. Every
+ * time the block changes its address or size, *bufp and *sizep are
+ * updated, and they are also updated when the file is closed with
+ * pack_fclose(). After that the block belongs to the caller, who has to
+ * release it with _AL_FREE(), free() by default. The data can be read
+ * back passing it to pack_fopen_memory() with the equivalent read mode.
  *
- * \return Returns a pointer to the sub-chunked PACKFILE, or NULL
- * if there was some error (eg. you are using a custom PACKFILE
- * vtable).
+ * \return On success returns a pointer to a PACKFILE structure, and on
+ * error returns NULL and stores an error code in errno.
  */
-PACKFILE *pack_fopen_chunk(PACKFILE *f, int pack)
+PACKFILE *pack_fopen_memstream(void **bufp, long *sizep, const char *mode)
 {
-	PACKFILE *chunk;
-	char *name;
-	AL_ASSERT(f);
+	PACKFILE_KEY *key;
+	PACKFILE *f;
 
-	/* unsupported */
-	if (!f->is_normal_packfile) {
-		errno = EINVAL;
+	if (!default_key_get(&key))
 		return NULL;
-	}
 
-	if (f->normal.flags & PACKFILE_FLAG_WRITE) {
+	f = pack_fopen_memstream_key(bufp, sizep, mode, key);
+	packfile_key_destroy(key);
 
-		/* write a sub-chunk */
-		int tmp_fd = -1;
-		char *tmp_dir = NULL;
-		char *tmp_name = NULL;
+	return f;
+}
 
-		/* Get the path of the temporary directory */
 
-		/* Try various possible locations to store the temporary file */
-		if (getenv("TEMP")) {
-			tmp_dir = strdup(getenv("TEMP"));
-		}
-		else if (getenv("TMP")) {
-			tmp_dir = strdup(getenv("TMP"));
-		}
-		else if (_exists_dir("/tmp")) {
-			tmp_dir = strdup("/tmp");
-		}
-		else if (getenv("HOME")) {
-			tmp_dir = strdup(getenv("HOME"));
-		}
-		else {
-			/* Give up - try current directory */
-			tmp_dir = strdup(".");
-		}
 
-		/* the file is open in read/write mode, even if the pack file
-		 * seems to be in write only mode
-		 */
-		tmp_name = _AL_MALLOC_ATOMIC(strlen(tmp_dir) + 16);
-		sprintf(tmp_name, "%s/XXXXXX", tmp_dir);
-		tmp_fd = mkstemp(tmp_name);
+/** Like pack_fopen_memstream(), but the data is encrypted with `key'
+ * instead of the password set with packfile_password(), see
+ * pack_fopen_key().
+ */
+PACKFILE *pack_fopen_memstream_key(void **bufp, long *sizep, const char *mode,
+	PACKFILE_KEY *key)
+{
+	struct _al_packfile_memory mem;
+	AL_ASSERT(bufp);
+	AL_ASSERT(sizep);
+	AL_ASSERT(mode);
 
-		if (tmp_fd < 0) {
-			_AL_FREE(tmp_dir);
-			_AL_FREE(tmp_name);
+	if (!strpbrk(mode, "wW")) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-			return NULL;
-		}
+	*bufp = NULL;
+	*sizep = 0;
 
-		name = tmp_name;
-		chunk = _pack_fdopen(tmp_fd, (pack ? F_WRITE_PACKED : F_WRITE_NOPACK));
+	memset(&mem, 0, sizeof(mem));
+	mem.out = bufp;
+	mem.out_size = sizep;
 
-		if (chunk) {
-			chunk->normal.filename = strdup(name);
+	return _pack_open_raw(-1, &mem, mode, key);
+}
 
-			if (pack)
-				chunk->normal.parent->normal.parent = f;
-			else
-				chunk->normal.parent = f;
 
-			chunk->normal.flags |= PACKFILE_FLAG_CHUNK;
-		}
 
-		_AL_FREE(tmp_dir);
-		_AL_FREE(tmp_name);
+/** Opens another handle on a file opened for reading with pack_fopen() or
+ * pack_fopen_memory(), starting at the position f has reached. Each handle
+ * has its own position and buffer, but they share the file descriptor,
+ * which the new handle only reads with positional reads, and the chunk
+ * table if f has one. The descriptor is closed along with the last handle,
+ * in any order.
+ *
+ * A handle must only be used by one thread at a time, but different
+ * handles on the same file can be used by different threads at once. A
+ * server can open an archive once, give a duplicate to every worker and
+ * let them open chunks with pack_fopen_chunk_index() or
+ * pack_fopen_chunk_by_name().
+ *
+ * Example:
+ * \code
+ *	PACKFILE *archive = pack_fopen("assets.dat", F_READ_PACKED);
+ *	...
+ *	for (i = 0; i < num_workers; i++)
+ *	   worker[i].input = pack_fdup_reader(archive);
+ * \endcode
+ *
+ * f must not be a chunk, and the file must not be compressed as a whole or
+ * use the old encryption scheme.
+ *
+ * \return Returns the new handle, or NULL on error storing the code in
+ * `errno'.
+ */
+PACKFILE *pack_fdup_reader(PACKFILE *f)
+{
+	PACKFILE *dup;
+	long pos, buffered;
+	int err;
+	AL_ASSERT(f);
+
+	if ((!f->is_normal_packfile) || (f->normal.parent) ||
+		 (f->normal.flags & (PACKFILE_FLAG_WRITE | PACKFILE_FLAG_PACK |
+		 PACKFILE_FLAG_OLD_CRYPT | PACKFILE_FLAG_CHUNK))) {
+		errno = EINVAL;
+		return NULL;
 	}
-	else {
-		/* read a sub-chunk */
-		_packfile_filesize = pack_mgetl(f);
-		_packfile_datasize = pack_mgetl(f);
 
-		if ((chunk = create_packfile(TRUE)) == NULL)
-			return NULL;
+	/* load the chunk table now, so that all the handles share it */
+	err = errno;
+	toc_get(f);
+	errno = err;
 
-		chunk->normal.flags = PACKFILE_FLAG_CHUNK;
-		chunk->normal.parent = f;
+	/* the bytes left in the buffer of f haven't been read yet */
+	buffered = AL_MAX(f->normal.buf_size, 0);
+	if ((pos = raw_tell(f)) < 0)
+		return NULL;
+	pos -= buffered;
 
-		if (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT) {
-			/* backward compatibility mode */
-			if (f->normal.passdata) {
-				if ((chunk->normal.passdata = _AL_MALLOC_ATOMIC(strlen(f->normal.passdata)+1)) == NULL) {
-					errno = ENOMEM;
-					_AL_FREE(chunk);
-					return NULL;
-				}
-				_al_sane_strncpy(chunk->normal.passdata, f->normal.passdata, strlen(f->normal.passdata)+1);
-				chunk->normal.passpos = chunk->normal.passdata + (long)f->normal.passpos - (long)f->normal.passdata;
-				f->normal.passpos = f->normal.passdata;
-			}
-			chunk->normal.flags |= PACKFILE_FLAG_OLD_CRYPT;
-		}
+	if ((dup = create_packfile(TRUE)) == NULL)
+		return NULL;
 
-		if (_packfile_datasize < 0) {
-			/* read a packed chunk */
-			chunk->normal.unpack_data = create_lzss_unpack_data();
-			AL_ASSERT(!chunk->normal.pack_data);
+	use_key(dup, f->normal.key, pos);
+	memcpy(dup->normal.nonce, f->normal.nonce, sizeof(dup->normal.nonce));
 
-			if (!chunk->normal.unpack_data) {
-				free_packfile(chunk);
-				return NULL;
-			}
+	dup->normal.flags = f->normal.flags & ~(PACKFILE_FLAG_EOF | PACKFILE_FLAG_ERROR |
+		PACKFILE_FLAG_MEMORY);
+	dup->normal.todo = f->normal.todo + buffered;
+	dup->normal.pos = f->normal.pos - buffered;
+	dup->normal.origin = f->normal.origin;
 
-			_packfile_datasize = -_packfile_datasize;
-			chunk->normal.todo = _packfile_datasize;
-			chunk->normal.flags |= PACKFILE_FLAG_PACK;
-		}
-		else {
-			/* read an uncompressed chunk */
-			chunk->normal.todo = _packfile_datasize;
-		}
+	if ((raw_dup(dup, f, pos)) || (share_packfile(f, dup))) {
+		if (dup->normal.ahead)
+			destroy_read_ahead(dup->normal.ahead);
+		drop_key(dup);
+		free_packfile(dup);
+		return NULL;
 	}
 
-	return chunk;
+	return dup;
 }
 
 
-/** Closes a sub-chunk of a file, previously obtained by calling
- * pack_fopen_chunk().
+
+/** Closes a stream previously opened with pack_fopen() or
+ * pack_fopen_vtable(). After you have closed the stream, performing
+ * operations on it will yield errors in your application (e.g. crash
+ * it) or even block your OS.
  *
- * \return Returns a pointer to the parent of the sub-chunk you
- * just closed. Returns NULL if there was some error (eg. you tried
- * to close a PACKFILE which wasn't sub-chunked).
+ * \return Returns zero on success. On error, returns an error code
+ * which is also stored in `errno'. This function can fail only when
+ * writing to files: if the file was opened in read mode, it will
+ * always succeed.
  */
-PACKFILE *pack_fclose_chunk(PACKFILE *f)
+int pack_fclose(PACKFILE *f)
 {
-	PACKFILE *parent;
-	PACKFILE *tmp;
-	char *name;
-	int header, c;
-	AL_ASSERT(f);
+	int ret;
 
-	/* unsupported */
-	if (!f->is_normal_packfile) {
-		errno = EINVAL;
-		return NULL;
-	}
+	if (!f)
+		return 0;
 
-	parent = f->normal.parent;
-	AL_ASSERT(parent);
-	name = f->normal.filename;
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_fclose);
 
-	if (f->normal.flags & PACKFILE_FLAG_WRITE) {
-		/* finish writing a chunk */
-		int hndl;
+	ret = f->vtable->pf_fclose(f->userdata);
+	free_packfile(f);
 
-		/* duplicate the file descriptor to create a readable pack file,
-		 * the file descriptor must have been opened in read/write mode
-		 */
+	return ret;
+}
+
+
+/* chunk_compressed:
+ *  Tells whether the data written to f ends up compressed, by f itself or
+ *  any of the files it is nested in.
+ */
+static int chunk_compressed(PACKFILE *f)
+{
+	for (; f; f = f->normal.parent)
 		if (f->normal.flags & PACKFILE_FLAG_PACK)
-			hndl = dup(f->normal.parent->normal.hndl);
-		else
-			hndl = dup(f->normal.hndl);
+			return TRUE;
 
-		if (hndl<0) {
-			return NULL;
-		}
+	return FALSE;
+}
 
-		_packfile_datasize = f->normal.todo + f->normal.buf_size - 4;
 
-		if (f->normal.flags & PACKFILE_FLAG_PACK) {
-			parent = parent->normal.parent;
-			f->normal.parent->normal.parent = NULL;
-		}
-		else
-			f->normal.parent = NULL;
 
-		/* close the writeable temp file, it isn't physically closed
-		 * because the descriptor has been duplicated
-		 */
-		f->normal.flags &= ~PACKFILE_FLAG_CHUNK;
-		pack_fclose(f);
+/* chunk_patchable:
+ *  Tells whether chunks can be written directly into f, which requires
+ *  their header to be patched once their size is known. That is possible
+ *  if the data reaches a seekable file or a memory block without being
+ *  compressed on the way.
+ */
+static int chunk_patchable(PACKFILE *f)
+{
+	/* checksums are computed as the data goes by, too early for patches */
+	for (; f->normal.flags & PACKFILE_FLAG_INPLACE; f = f->normal.parent)
+		if (f->normal.flags & PACKFILE_FLAG_CHECKSUM)
+			return FALSE;
 
-		lseek(hndl, 0, SEEK_SET);
+	if (f->normal.flags & (PACKFILE_FLAG_PACK | PACKFILE_FLAG_OLD_CRYPT |
+		 PACKFILE_FLAG_CHECKSUM))
+		return FALSE;
 
-		/* create a readable pack file */
-		tmp = _pack_fdopen(hndl, F_READ);
-		if (!tmp)
-			return NULL;
+	return raw_seekable(f);
+}
 
-		_packfile_filesize = tmp->normal.todo - 4;
 
-		header = pack_mgetl(tmp);
 
-		pack_mputl(_packfile_filesize, parent);
+/* chunk_outgrown:
+ *  Tells whether flushing the buffer of f would make an in-place chunk too
+ *  big for the header it reserved, which only has 32-bit sizes unless the
+ *  file was opened with the l flag. Packed chunks count the bytes before
+ *  compression.
+ */
+static int chunk_outgrown(PACKFILE *f)
+{
+	PACKFILE *carrier = (f->normal.flags & PACKFILE_FLAG_PACK) ? f->normal.parent : f;
 
-		if (header == encrypt_id(F_PACK_MAGIC, TRUE))
-			pack_mputl(-_packfile_datasize, parent);
-		else
-			pack_mputl(_packfile_datasize, parent);
+	if ((!(carrier->normal.flags & PACKFILE_FLAG_INPLACE)) ||
+		 (carrier->normal.flags & PACKFILE_FLAG_LARGE))
+		return FALSE;
 
-		while ((c = pack_getc(tmp)) != EOF)
-			pack_putc(c, parent);
+	return ((int64_t)f->normal.todo + f->normal.buf_size > INT32_MAX);
+}
 
-		pack_fclose(tmp);
 
-		unlink(name);
-		_AL_FREE(name);
-	}
-	else {
-		/* finish reading a chunk */
-		while (f->normal.todo > 0)
-			pack_getc(f);
 
-		if (f->normal.unpack_data) {
-			free_lzss_unpack_data(f->normal.unpack_data);
-			f->normal.unpack_data = NULL;
+/* chunk_header:
+ *  Encodes the header of a chunk at p and returns its size. Sizes which
+ *  don't fit in 32 bits, or the large flag, give the 64-bit variant:
+ *  F_CHUNK64_MAGIC in place of the size, then both sizes in 64 bits.
+ */
+static int chunk_header(unsigned char *p, int64_t filesize, int64_t datasize, int large)
+{
+	int i;
+
+	if ((filesize > INT32_MAX) || (datasize > INT32_MAX) || (datasize < -INT32_MAX))
+		large = TRUE;
+
+	if (!large) {
+		for (i=0; i<4; i++) {
+			p[i] = (filesize >> (24 - i*8)) & 0xFF;
+			p[i+4] = (datasize >> (24 - i*8)) & 0xFF;
 		}
+		return CHUNK_HEADER;
+	}
 
-		if ((f->normal.passpos) && (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
-			parent->normal.passpos = parent->normal.passdata + (long)f->normal.passpos - (long)f->normal.passdata;
+	for (i=0; i<4; i++)
+		p[i] = (F_CHUNK64_MAGIC >> (24 - i*8)) & 0xFF;
 
-		free_packfile(f);
+	for (i=0; i<8; i++) {
+		p[i+4] = (filesize >> (56 - i*8)) & 0xFF;
+		p[i+12] = (datasize >> (56 - i*8)) & 0xFF;
 	}
 
-	return parent;
+	return CHUNK64_HEADER;
 }
 
 
 
-/** Seeks inside a stream.
- * Unlike the standard fseek() function, this only supports forward movements
- * relative to the current position and in read-only streams, so don't
- * use negative offsets. Note that seeking is very slow when reading
- * compressed files, and so should be avoided unless you are sure
- * that the file is not compressed.
+/* chunk_long:
+ *  Decodes a big-endian number of n bytes of a chunk header, with sign.
+ */
+static int64_t chunk_long(AL_CONST unsigned char *p, int n)
+{
+	uint64_t x = 0;
+	int i;
+
+	for (i=0; i<n; i++)
+		x = (x << 8) | p[i];
+
+	if (n == 4)
+		return (int32_t)x;
+
+	return (int64_t)x;
+}
+
+
+
+/* fits_long:
+ *  Tells whether a 64-bit size or position can be kept in a long, which
+ *  has only 32 bits on some platforms.
+ */
+static int fits_long(int64_t x)
+{
+	return ((long)x == x);
+}
+
+
+
+/* read_chunk_header:
+ *  Reads the header of the next chunk of f, in either variant. Returns its
+ *  size, zero if the file ends first, or -1 with EFBIG in errno if the
+ *  sizes don't fit in a long.
+ */
+static int read_chunk_header(PACKFILE *f, long *filesize, long *datasize)
+{
+	unsigned char header[CHUNK64_HEADER];
+	int64_t filesize64, datasize64;
+
+	if (pack_fread(header, CHUNK_HEADER, f) < CHUNK_HEADER)
+		return 0;
+
+	if (chunk_long(header, 4) != (int32_t)F_CHUNK64_MAGIC) {
+		*filesize = chunk_long(header, 4);
+		*datasize = chunk_long(header + 4, 4);
+		return CHUNK_HEADER;
+	}
+
+	if (pack_fread(header + CHUNK_HEADER, CHUNK64_HEADER - CHUNK_HEADER, f) <
+		 CHUNK64_HEADER - CHUNK_HEADER)
+		return 0;
+
+	filesize64 = chunk_long(header + 4, 8);
+	datasize64 = chunk_long(header + 12, 8);
+	if ((!fits_long(filesize64)) || (!fits_long(datasize64))) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	*filesize = filesize64;
+	*datasize = datasize64;
+	return CHUNK64_HEADER;
+}
+
+
+
+/* open_inplace_chunk:
+ *  Starts a chunk which writes directly into f, leaving room for its header.
+ *  Packed chunks compress into a plain in-place chunk which counts the
+ *  compressed bytes.
+ */
+static PACKFILE *open_inplace_chunk(PACKFILE *f, int pack)
+{
+	static AL_CONST unsigned char placeholder[CHUNK64_HEADER];
+	PACKFILE *chunk, *carrier;
+	long header = f->normal.todo + f->normal.buf_size;
+	int large = f->normal.flags & PACKFILE_FLAG_LARGE;
+
+	if ((carrier = create_packfile(TRUE)) == NULL)
+		return NULL;
+
+	carrier->normal.flags = PACKFILE_FLAG_WRITE | PACKFILE_FLAG_INPLACE | large;
+	carrier->normal.parent = f;
+	carrier->normal.chunk_header = header;
+	carrier->normal.chunk_memory = f->normal.chunk_memory;
+
+	if (pack) {
+		if ((chunk = create_packfile(TRUE)) == NULL) {
+			free_packfile(carrier);
+			return NULL;
+		}
+
+		if ((chunk->normal.pack_data = create_lzss_pack_data()) == NULL) {
+			free_packfile(chunk);
+			free_packfile(carrier);
+			return NULL;
+		}
+
+		chunk->normal.flags = PACKFILE_FLAG_WRITE | PACKFILE_FLAG_PACK | PACKFILE_FLAG_CHUNK | large;
+		chunk->normal.parent = carrier;
+		chunk->normal.chunk_memory = f->normal.chunk_memory;
+	}
+	else {
+		chunk = carrier;
+		chunk->normal.flags |= PACKFILE_FLAG_CHUNK;
+	}
+
+	/* placeholder for the sizes, see close_inplace_chunk() */
+	pack_fwrite(placeholder, large ? CHUNK64_HEADER : CHUNK_HEADER, f);
+
+	return chunk;
+}
+
+
+
+/* close_inplace_chunk:
+ *  Flushes a chunk opened by open_inplace_chunk() into its parent and
+ *  patches the header. Returns the parent, or NULL on error.
+ */
+static PACKFILE *close_inplace_chunk(PACKFILE *f)
+{
+	PACKFILE *carrier = (f->normal.flags & PACKFILE_FLAG_PACK) ? f->normal.parent : f;
+	PACKFILE *parent = carrier->normal.parent;
+	unsigned char header[CHUNK64_HEADER];
+	long filesize, datasize;
+	int size, ret = 0;
+
+	if (f != carrier) {
+		if (normal_flush_buffer(f, TRUE))
+			ret = EOF;
+
+		datasize = -f->normal.todo;
+
+		free_lzss_pack_data(f->normal.pack_data);
+		f->normal.pack_data = NULL;
+		free_packfile(f);
+	}
+
+	if (normal_flush_buffer(carrier, TRUE))
+		ret = EOF;
+
+	filesize = carrier->normal.todo;
+	if (f == carrier)
+		datasize = filesize;
+
+	/* the placeholder can't grow into a large header */
+	size = chunk_header(header, filesize, datasize, carrier->normal.flags & PACKFILE_FLAG_LARGE);
+	if ((size == CHUNK64_HEADER) && !(carrier->normal.flags & PACKFILE_FLAG_LARGE)) {
+		errno = EFBIG;
+		ret = EOF;
+	}
+
+	if (!ret)
+		ret = normal_patch(parent, carrier->normal.chunk_header, header, size);
+
+	if ((!ret) && (parent->normal.toc))
+		toc_finish(parent, -1, carrier->normal.chunk_header, filesize, datasize,
+			carrier->normal.checksum);
+
+	free_packfile(carrier);
+
+	if (ret) {
+		parent->normal.flags |= PACKFILE_FLAG_ERROR;
+		return NULL;
+	}
+
+	return parent;
+}
+
+
+
+/* open_temp_file:
+ *  Creates a temporary file open for reading and writing. It is unlinked
+ *  right away, so it disappears as soon as it is closed. Returns the file
+ *  descriptor, or a negative number on error.
+ */
+static int open_temp_file(void)
+{
+	char *tmp_dir = NULL;
+	char *tmp_name = NULL;
+	int tmp_fd;
+
+	/* Try various possible locations to store the temporary file */
+	if (getenv("TEMP")) {
+		tmp_dir = strdup(getenv("TEMP"));
+	}
+	else if (getenv("TMP")) {
+		tmp_dir = strdup(getenv("TMP"));
+	}
+	else if (_exists_dir("/tmp")) {
+		tmp_dir = strdup("/tmp");
+	}
+	else if (getenv("HOME")) {
+		tmp_dir = strdup(getenv("HOME"));
+	}
+	else {
+		/* Give up - try current directory */
+		tmp_dir = strdup(".");
+	}
+
+	if (!tmp_dir) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	tmp_name = _AL_MALLOC_ATOMIC(strlen(tmp_dir) + 16);
+	if (!tmp_name) {
+		_AL_FREE(tmp_dir);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	sprintf(tmp_name, "%s/XXXXXX", tmp_dir);
+	tmp_fd = mkstemp(tmp_name);
+
+	if (tmp_fd >= 0)
+		unlink(tmp_name);
+
+	_AL_FREE(tmp_dir);
+	_AL_FREE(tmp_name);
+
+	return tmp_fd;
+}
+
+
+
+/* open_staged_chunk:
+ *  Starts a chunk which is collected in a growable memory block, moved to
+ *  a temporary file by raw_spill() if it gets bigger than the limit set
+ *  with packfile_chunk_memory(). The staging area holds the bytes exactly
+ *  as they go into the parent, compressed for packed chunks.
+ */
+static PACKFILE *open_staged_chunk(PACKFILE *f, int pack)
+{
+	PACKFILE *chunk, *stage;
+	struct _al_packfile_memory mem;
+	int fd = -1;
+
+	memset(&mem, 0, sizeof(mem));
+	mem.limit = f->normal.chunk_memory;
+
+	if (!mem.limit && (fd = open_temp_file()) < 0)
+		return NULL;
+
+	if ((stage = create_packfile(TRUE)) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	/* the password is only used once the data reaches the disk */
+	use_key(stage, file_key(f), 0);
+
+	if ((stage->normal.key) && (stage->normal.key->cipher == KEY_CHACHA20) &&
+		 (chacha20_nonce(stage->normal.nonce))) {
+		if (fd >= 0)
+			close(fd);
+		drop_key(stage);
+		free_packfile(stage);
+		return NULL;
+	}
+
+	stage->normal.flags = PACKFILE_FLAG_WRITE | (f->normal.flags & PACKFILE_FLAG_LARGE);
+	stage->normal.parent = f;
+	stage->normal.chunk_memory = f->normal.chunk_memory;
+
+	if (fd >= 0) {
+		raw_attach(stage, fd, NULL);
+	}
+	else {
+		raw_attach(stage, -1, &mem);
+		stage->normal.passpos = NULL;
+	}
+
+	if (pack) {
+		if ((chunk = create_packfile(TRUE)) == NULL) {
+			raw_discard(stage);
+			return NULL;
+		}
+
+		if ((chunk->normal.pack_data = create_lzss_pack_data()) == NULL) {
+			free_packfile(chunk);
+			raw_discard(stage);
+			return NULL;
+		}
+
+		chunk->normal.flags = PACKFILE_FLAG_WRITE | PACKFILE_FLAG_PACK | PACKFILE_FLAG_CHUNK |
+			(f->normal.flags & PACKFILE_FLAG_LARGE);
+		chunk->normal.parent = stage;
+		chunk->normal.chunk_memory = f->normal.chunk_memory;
+	}
+	else {
+		chunk = stage;
+		chunk->normal.flags |= PACKFILE_FLAG_CHUNK;
+	}
+
+	return chunk;
+}
+
+
+
+/* flush_staged_chunk:
+ *  Flushes a chunk opened by open_staged_chunk() to its staging area and
+ *  frees the compressor, storing the sizes for the header. Returns zero on
+ *  success.
+ */
+static int flush_staged_chunk(PACKFILE *f, long *filesize, long *datasize)
+{
+	PACKFILE *stage = (f->normal.flags & PACKFILE_FLAG_PACK) ? f->normal.parent : f;
+	int ret = 0;
+
+	if (f != stage) {
+		if (normal_flush_buffer(f, TRUE))
+			ret = EOF;
+
+		*datasize = -f->normal.todo;
+
+		free_lzss_pack_data(f->normal.pack_data);
+		f->normal.pack_data = NULL;
+		free_packfile(f);
+	}
+
+	if (normal_flush_buffer(stage, TRUE))
+		ret = EOF;
+
+	*filesize = stage->normal.todo;
+	if (f == stage)
+		*datasize = *filesize;
+
+	return ret;
+}
+
+
+
+/* commit_staged_chunk:
+ *  Copies a flushed staging area with its header into the parent, filling
+ *  in the entry number index of the parent's table if it has one. Returns
+ *  zero on success.
+ */
+static int commit_staged_chunk(PACKFILE *stage, long filesize, long datasize, long index)
+{
+	PACKFILE *parent = stage->normal.parent;
+	long offset = parent->normal.todo + parent->normal.buf_size;
+	unsigned char header[CHUNK64_HEADER];
+	long done, sz;
+	int ret = 0;
+
+	pack_fwrite(header, chunk_header(header, filesize, datasize,
+		stage->normal.flags & PACKFILE_FLAG_LARGE), parent);
+
+	if (stage->normal.flags & PACKFILE_FLAG_MEMORY) {
+		pack_fwrite(stage->normal.mem.data, filesize, parent);
+	}
+	else {
+		/* read the spilled data back, reusing the empty buffer */
+		for (done = 0; done < filesize; done += sz) {
+			sz = pread(stage->normal.hndl, stage->normal.buf,
+				AL_MIN(filesize - done, F_BUF_SIZE), done);
+
+			if (sz <= 0) {
+				if ((sz < 0) && ((errno == EINTR) || (errno == EAGAIN))) {
+					sz = 0;
+					continue;
+				}
+				errno = sz ? errno : EIO;
+				ret = EOF;
+				break;
+			}
+
+			if (stage->normal.passdata)
+				xor_password(stage, done, stage->normal.buf, sz);
+
+			pack_fwrite(stage->normal.buf, sz, parent);
+		}
+	}
+
+	if (pack_ferror(parent))
+		ret = EOF;
+
+	if ((!ret) && (parent->normal.toc))
+		toc_finish(parent, index, offset, filesize, datasize, stage->normal.checksum);
+
+	return ret;
+}
+
+
+
+/* close_staged_chunk:
+ *  Flushes a chunk opened by open_staged_chunk() and copies it with its
+ *  header into the parent. Returns the parent, or NULL on error.
+ */
+static PACKFILE *close_staged_chunk(PACKFILE *f)
+{
+	PACKFILE *stage = (f->normal.flags & PACKFILE_FLAG_PACK) ? f->normal.parent : f;
+	PACKFILE *parent = stage->normal.parent;
+	long filesize, datasize;
+	int ret;
+
+	if (stage->normal.sibling)
+		return close_concurrent_chunk(f);
+
+	ret = flush_staged_chunk(f, &filesize, &datasize);
+
+	if (!ret)
+		ret = commit_staged_chunk(stage, filesize, datasize, -1);
+
+	raw_discard(stage);
+
+	if (ret) {
+		parent->normal.flags |= PACKFILE_FLAG_ERROR;
+		return NULL;
+	}
+
+	return parent;
+}
+
+
+
+/* open_write_chunk:
+ *  Starts a chunk in f, which is open for writing, recording it in the
+ *  table of f if there is one.
+ */
+static PACKFILE *open_write_chunk(PACKFILE *f, int pack, AL_CONST char *name)
+{
+	PACKFILE *chunk;
+
+	/* the parent compresses the chunk anyway, doing it twice only wastes time */
+	if ((pack) && (chunk_compressed(f)))
+		pack = FALSE;
+
+	if ((f->normal.toc) && (toc_add(f, name) < 0))
+		return NULL;
+
+	if (chunk_patchable(f)) {
+		/* write a sub-chunk straight into the parent */
+		chunk = open_inplace_chunk(f, pack);
+	}
+	else {
+		/* write a sub-chunk to a staging area */
+		chunk = open_staged_chunk(f, pack);
+	}
+
+	if (chunk)
+		checksum_chunk(f, chunk);
+	else if (f->normal.toc)
+		toc_drop(f);
+
+	return chunk;
+}
+
+
+
+/** Opens a sub-chunk of a file. A chunk provides a logical view of
+ * part of a file, which can be compressed as an individual entity
+ * and will automatically insert and check length counts to prevent
+ * reading past the end of the chunk. The PACKFILE parameter is a
+ * previously opened file, and `pack' is a boolean parameter which
+ * will turn compression on for the sub-chunk if it is non-zero.
  *
  * Example:
  * \code
- *	input_file = pack_fopen("data.bin", "r");
- *	if (!input_file)
- *		abort_on_error("Couldn't open binary data!");
- *	// Skip some useless header before reading data.
- *	pack_fseek(input_file, 32);
+ *	PACKFILE *output = pack_fopen("out.raw", "w!");
+ *	...
+ *	// Create a sub-chunk with compression.
+ *	output = pack_fopen(chunk(output, 1);
+ *	if (!output)
+ *	   abort_on_error("Error saving data!");
+ *	// Write some data to the sub-chunk.
+ *	...
+ *	// Close the sub-chunk, recovering parent file.
+ *	output = pack_fclose_chunk(output);
  * \endcode
  *
- * \return Returns zero on success or a negative number on error,
- * storing the error code in `errno'.
+ * The data written to the chunk will be prefixed with two length
+ * counts (32-bit, a.k.a. big-endian). For uncompressed chunks these
+ * will both be set to the size of the data in the chunk. For compressed
+ * chunks (created by setting the `pack' flag), the first length will
+ * be the raw size of the chunk, and the second will be the negative
+ * size of the uncompressed data.
+ *
+ * When the parent is an uncompressed file on a seekable device or in
+ * memory, the chunk is written straight into it and the length counts
+ * are filled in by pack_fclose_chunk(). Otherwise the chunk is kept in a
+ * temporary file until it is closed, and then copied into the parent.
+ *
+ * Compression is not applied twice: a chunk opened with `pack' inside a
+ * compressed file or chunk is stored uncompressed, since its data will be
+ * compressed by the parent anyway. This is transparent when reading it
+ * back, which always follows the sign of the stored length counts.
+ *
+ * To read the chunk, use the following code:
+ * \code
+ *	PACKFILE *input = pack_fopen("out.raw", "rp");
+ *	...
+ *	input = pack_fopen_chunk(input, 1);
+ *	// Read data from the sub-chunk and close it.
+ *	...
+ *	input = pack_fclose_chunk(input);
+ * \endcode
+ *
+ * This sequence will read the length counts created when the chunk
+ * was written, and automatically decompress the contents of the chunk
+ * if it was compressed. The length will also be used to prevent
+ * reading past the end of the chunk (Allegro will return EOF if you
+ * attempt this), and to automatically skip past any unread chunk
+ * data when you call pack_fclose_chunk(). The rest of a compressed chunk
+ * is skipped without decompressing it, with a real seek when the parent
+ * allows it. This means that you can skip a whole chunk by calling
+ * pack_fopen_chunk() and pack_fclose_chunk() in sucession, though it is
+ * faster to call pack_skip_chunks().
+ *
+ * Chunks can be nested inside each other by making repeated calls
+ * to pack_fopen_chunk(). When writing a file, the compression status
+ * is inherited from the parent file, so you only need to set the
+ * pack flag if the parent is not compressed but you want to pack the
+ * chunk data.
+ *
+ * \return Returns a pointer to the sub-chunked PACKFILE, or NULL
+ * if there was some error (eg. you are using a custom PACKFILE
+ * vtable).
+ */
+PACKFILE *pack_fopen_chunk(PACKFILE *f, int pack)
+{
+	PACKFILE *chunk;
+	long filesize, datasize;
+	int header;
+	AL_ASSERT(f);
+
+	/* unsupported */
+	if (!f->is_normal_packfile) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (f->normal.flags & PACKFILE_FLAG_WRITE) {
+		/* write a sub-chunk */
+		chunk = open_write_chunk(f, pack, NULL);
+	}
+	else {
+		/* read a sub-chunk */
+		if ((header = read_chunk_header(f, &filesize, &datasize)) <= 0) {
+			if (!header)
+				errno = ENOENT;
+			return NULL;
+		}
+
+		if ((chunk = create_packfile(TRUE)) == NULL)
+			return NULL;
+
+		chunk->normal.flags = PACKFILE_FLAG_CHUNK;
+		chunk->normal.parent = f;
+		chunk->normal.chunk_end = pack_ftell64(f) + filesize;
+
+		if (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT) {
+			/* backward compatibility mode */
+			if (f->normal.key) {
+				use_key(chunk, f->normal.key, f->normal.passpos - f->normal.passdata);
+				f->normal.passpos = f->normal.passdata;
+			}
+			chunk->normal.flags |= PACKFILE_FLAG_OLD_CRYPT;
+		}
+
+		if (datasize < 0) {
+			/* read a packed chunk */
+			chunk->normal.unpack_data = create_lzss_unpack_data();
+			AL_ASSERT(!chunk->normal.pack_data);
+
+			if (!chunk->normal.unpack_data) {
+				free_packfile(chunk);
+				return NULL;
+			}
+
+			chunk->normal.todo = -datasize;
+			chunk->normal.flags |= PACKFILE_FLAG_PACK;
+		}
+		else {
+			/* read an uncompressed chunk */
+			chunk->normal.todo = datasize;
+		}
+	}
+
+	return chunk;
+}
+
+
+/** Closes a sub-chunk of a file, previously obtained by calling
+ * pack_fopen_chunk().
+ *
+ * \return Returns a pointer to the parent of the sub-chunk you
+ * just closed. Returns NULL if there was some error (eg. you tried
+ * to close a PACKFILE which wasn't sub-chunked).
+ */
+PACKFILE *pack_fclose_chunk(PACKFILE *f)
+{
+	PACKFILE *parent;
+	int64_t skip;
+	AL_ASSERT(f);
+
+	/* unsupported */
+	if (!f->is_normal_packfile) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	parent = f->normal.parent;
+	AL_ASSERT(parent);
+
+	if (f->normal.flags & PACKFILE_FLAG_WRITE) {
+		/* finish writing a chunk */
+		if ((f->normal.flags & PACKFILE_FLAG_INPLACE) ||
+			 ((f->normal.flags & PACKFILE_FLAG_PACK) && (parent->normal.flags & PACKFILE_FLAG_INPLACE)))
+			return close_inplace_chunk(f);
+		else
+			return close_staged_chunk(f);
+	}
+	else {
+		/* finish reading a chunk */
+		if (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT) {
+			/* the key position depends on every byte of the chunk */
+			while (f->normal.todo > 0)
+				pack_getc(f);
+		}
+		else {
+			/* skip what is left of the chunk in the parent, packed or not,
+			 * measured by position since the todo count of a compressed file
+			 * says nothing about the output lzss_read() still has pending
+			 */
+			skip = f->normal.chunk_end - pack_ftell64(parent);
+			if (skip > 0)
+				pack_fseek64(parent, skip);
+		}
+
+		if (f->normal.unpack_data) {
+			free_lzss_unpack_data(f->normal.unpack_data);
+			f->normal.unpack_data = NULL;
+		}
+
+		if ((f->normal.passpos) && (f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
+			parent->normal.passpos = parent->normal.passdata + (long)f->normal.passpos - (long)f->normal.passdata;
+
+		drop_key(f);
+		free_packfile(f);
+	}
+
+	return parent;
+}
+
+
+
+/** Seeks inside a stream.
+ * Unlike the standard fseek() function, this only supports forward movements
+ * relative to the current position and in read-only streams, so don't
+ * use negative offsets. Note that seeking is very slow when reading
+ * compressed files, and so should be avoided unless you are sure
+ * that the file is not compressed.
+ *
+ * Example:
+ * \code
+ *	input_file = pack_fopen("data.bin", "r");
+ *	if (!input_file)
+ *		abort_on_error("Couldn't open binary data!");
+ *	// Skip some useless header before reading data.
+ *	pack_fseek(input_file, 32);
+ * \endcode
+ *
+ * \return Returns zero on success or a negative number on error,
+ * storing the error code in `errno'.
+ */
+int pack_fseek(PACKFILE *f, int offset)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(offset >= 0);
+
+	return f->vtable->pf_fseek(f->userdata, offset);
+}
+
+
+
+/** Like pack_fseek(), but the offset may be larger than 2GB. Custom
+ * packfiles are moved along in steps which fit the vtable.
+ *
+ * \return Returns zero on success or a negative number on error,
+ * storing the error code in `errno'.
+ */
+int pack_fseek64(PACKFILE *f, int64_t offset)
+{
+	int n;
+	AL_ASSERT(f);
+	AL_ASSERT(offset >= 0);
+
+	if (f->is_normal_packfile)
+		return normal_fseek64(f, offset);
+
+	do {
+		n = (int)AL_MIN(offset, INT_MAX);
+		if (f->vtable->pf_fseek(f->userdata, n))
+			return -1;
+		offset -= n;
+	} while (offset > 0);
+
+	return 0;
+}
+
+
+
+/** Tells how far into the data of f the current position is: the number
+ * of bytes read, skipped or written since the file or chunk was opened, not
+ * counting the headers of the file. After pack_fopen_chunk_index() the
+ * count includes everything up to the chunk, as if the file had been read
+ * through. Compressed data is counted before compression.
+ *
+ * \return Returns the position, or -1 storing EINVAL in `errno' for custom
+ * packfiles created with pack_fopen_vtable().
+ */
+int64_t pack_ftell64(PACKFILE *f)
+{
+	AL_ASSERT(f);
+
+	if (!f->is_normal_packfile) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (f->normal.flags & PACKFILE_FLAG_WRITE)
+		return f->normal.pos + f->normal.buf_size - f->normal.origin;
+
+	return f->normal.pos - AL_MAX(f->normal.buf_size, 0) - f->normal.origin;
+}
+
+
+/** Skips a number of subchunks inside the file.
+ * This is faster than opening and closing a subchunk as you find it on disk.
+ * The function reads the hidden chunk size data and uses that to call
+ * pack_fseek instead. Pass how many chunks you want to skip, usually one.
+ * See pack_skip_chunks_ex() to find out how many were skipped on error.
+ *
+ * \return Returns non zero on error, storing the code in errno.
+ */
+int pack_skip_chunks(PACKFILE *f, unsigned int num_chunks)
+{
+	return (pack_skip_chunks_ex(f, num_chunks) < num_chunks);
+}
+
+
+
+/** Like pack_skip_chunks(), but tells how many chunks were skipped. This
+ * is less than num_chunks if the end of the file or an error was reached
+ * first, in which case f is left after the last complete chunk or at its
+ * end. Only the header of each chunk is read. The data is skipped
+ * with real seeks on uncompressed files, encrypted or not, and decoded a
+ * buffer at a time otherwise.
+ *
+ * \return Returns the number of chunks skipped, storing the error code in
+ * `errno' if it is less than num_chunks.
+ */
+unsigned int pack_skip_chunks_ex(PACKFILE *f, unsigned int num_chunks)
+{
+	unsigned int done;
+	long filesize, datasize;
+	int header;
+	AL_ASSERT(f);
+
+	for (done = 0; done < num_chunks; done++) {
+		if ((header = read_chunk_header(f, &filesize, &datasize)) <= 0) {
+			if ((!header) && (!pack_ferror(f)))
+				errno = ENOENT;
+			break;
+		}
+
+		if (filesize < 0) {
+			errno = EFAULT;
+			break;
+		}
+
+		if (pack_fseek64(f, filesize))
+			break;
+	}
+
+	return done;
+}
+
+
+
+/** Returns the number of chunks at the top level of a file written with
+ * the `i' mode flag. f must be the file returned by pack_fopen() for
+ * reading, and must not be compressed. The table is read from the end of
+ * the file when it is opened, and kept until the file is closed.
+ *
+ * \return Returns the number of chunks, or -1 on error storing the code in
+ * `errno'. ENOENT means that the file has no table.
+ */
+long pack_chunk_count(PACKFILE *f)
+{
+	AL_ASSERT(f);
+
+	return toc_count(f);
+}
+
+
+
+/** Opens the chunk number `index' at the top level of a file written with
+ * the `i' mode flag, counting from zero. Unlike pack_skip_chunks() the
+ * chunks before it aren't read at all, and chunks may be opened in any
+ * order. Once the chunk is closed with pack_fclose_chunk() the parent is
+ * positioned right after it. See pack_chunk_count() for the requirements
+ * on f.
+ *
+ * Example:
+ * \code
+ *	PACKFILE *input = pack_fopen("out.raw", "rp");
+ *	...
+ *	input = pack_fopen_chunk_index(input, pack_chunk_count(input) - 1);
+ *	// Read data from the last chunk and close it.
+ *	...
+ *	input = pack_fclose_chunk(input);
+ * \endcode
+ *
+ * \return Returns the chunk, or NULL on error storing the code in `errno'.
+ */
+PACKFILE *pack_fopen_chunk_index(PACKFILE *f, long index)
+{
+	int pack;
+	AL_ASSERT(f);
+
+	if (toc_seek(f, index, &pack))
+		return NULL;
+
+	return pack_fopen_chunk(f, pack);
+}
+
+
+
+/** Opens a chunk for writing like pack_fopen_chunk(), giving it a name
+ * which can be used to find it with pack_fopen_chunk_by_name(). f must be
+ * the file returned by pack_fopen() for writing with the `i' or `c' mode
+ * flag, and must not be compressed. The names are stored in the table at
+ * the end of the file. Without a table this fails with EINVAL.
+ *
+ * When the file is closed the names are indexed with a minimal perfect
+ * hash, so that finding a chunk never takes more than one string
+ * comparison. Closing it fails with EEXIST if two chunks have the same
+ * name. Chunks without names can be mixed freely with named ones.
+ *
+ * \return Returns the chunk, or NULL on error storing the code in `errno'.
+ */
+PACKFILE *pack_fopen_chunk_named(PACKFILE *f, AL_CONST char *name, int pack)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(name);
+
+	if (toc_names(f))
+		return NULL;
+
+	return open_write_chunk(f, pack, name);
+}
+
+
+
+/** Opens the chunk called `name' at the top level of a file, written with
+ * pack_fopen_chunk_named(). Only the table at the end of the file and the
+ * header of the chunk are read. See pack_chunk_count() for the
+ * requirements on f.
+ *
+ * Example:
+ * \code
+ *	PACKFILE *input = pack_fopen("assets.dat", "rp");
+ *	...
+ *	input = pack_fopen_chunk_by_name(input, "textures/sky.dds");
+ *	if (!input)
+ *	   abort_on_error("Missing texture!");
+ *	...
+ *	input = pack_fclose_chunk(input);
+ * \endcode
+ *
+ * \return Returns the chunk, or NULL on error storing the code in `errno'.
+ * ENOENT means that there is no such chunk.
+ */
+PACKFILE *pack_fopen_chunk_by_name(PACKFILE *f, AL_CONST char *name)
+{
+	long index;
+	AL_ASSERT(f);
+	AL_ASSERT(name);
+
+	if ((index = toc_find(f, name)) < 0)
+		return NULL;
+
+	return pack_fopen_chunk_index(f, index);
+}
+
+
+
+/** Opens a chunk for writing which can be filled by another thread while
+ * more chunks are opened next to it. Each of them is kept in memory, or
+ * in a temporary file past the limit set with packfile_chunk_memory(),
+ * until it is closed with pack_fclose_chunk() by the thread writing it.
+ * The chunks are written to f in the order they were opened, regardless
+ * of the order they are closed in, so the file looks exactly as if they
+ * had been written one after the other with pack_fopen_chunk().
+ *
+ * Only the thread owning f may open the chunks, and it must not use f in
+ * any other way until all of them are closed. Chunks nested inside them
+ * are opened with pack_fopen_chunk() as usual. If `name' is not NULL the
+ * chunk is named as with pack_fopen_chunk_named(), which has the same
+ * requirements on f.
+ *
+ * Example:
+ * \code
+ *	PACKFILE *output = pack_fopen("assets.dat", "w!i");
+ *	...
+ *	for (i = 0; i < num_assets; i++)
+ *	   job[i].output = pack_fopen_chunk_concurrent(output, job[i].name, 1);
+ *	// Each worker writes its asset and closes its chunk.
+ *	...
+ *	pack_fclose(output);
+ * \endcode
+ *
+ * \return Returns the chunk, or NULL on error storing the code in `errno'.
+ */
+PACKFILE *pack_fopen_chunk_concurrent(PACKFILE *f, AL_CONST char *name, int pack)
+{
+	AL_ASSERT(f);
+
+	if ((!f->is_normal_packfile) || (!(f->normal.flags & PACKFILE_FLAG_WRITE))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((name) && (toc_names(f)))
+		return NULL;
+
+	return open_concurrent_chunk(f, name, pack);
+}
+
+
+
+/** Checks the chunks at the top level of a file written with the `c' mode
+ * flag, which works like `i' and also stores the CRC-32C of every chunk in
+ * the table. The chunks are read back with up to `threads' threads at
+ * once, without disturbing the position of f. See pack_chunk_count() for
+ * the requirements on f.
+ *
+ * Example:
+ * \code
+ *	PACKFILE *input = pack_fopen("assets.dat", "r");
+ *	...
+ *	if (pack_verify_chunks(input, 8) != 0)
+ *	   abort_on_error("Damaged archive!");
+ * \endcode
+ *
+ * \return Returns the number of damaged chunks, or -1 on error storing the
+ * code in `errno'. ENOENT means that the file has no table with checksums.
+ */
+long pack_verify_chunks(PACKFILE *f, int threads)
+{
+	AL_ASSERT(f);
+
+	return toc_verify(f, threads);
+}
+
+/**
+ * Returns the next character from the stream f, or EOF if the end of the
+ * file has been reached.
+ */
+int pack_getc(PACKFILE *f)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_getc);
+
+	return f->vtable->pf_getc(f->userdata);
+}
+
+
+
+/**
+ * Puts a character in the stream f.
+ */
+int pack_putc(int c, PACKFILE *f)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_putc);
+
+	return f->vtable->pf_putc(c, f->userdata);
+}
+
+
+
+/** Returns nonzero as soon as you reach the end of the file.
+ * It does not wait for you to attempt to read beyond the end of
+ * the file, contrary to the ISO C feof() function. The only way to
+ * know whether you have read beyond the end of the file is to check
+ * the return value of the read operation you use (and be wary of
+ * pack_*getl() as EOF is also a valid return value with these functions).
+ *
+ * \return Returns non-zero if you are at the end of the file, zero otherwise.
+ */
+int pack_feof(PACKFILE *f)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_feof);
+
+	return f->vtable->pf_feof(f->userdata);
+}
+
+
+
+/**Tells if an error occurred during an operation on the stream.
+ * Since EOF is used to report errors by some functions, it's often
+ * better to use the pack_feof() function to check explicitly for end
+ * of file and pack_ferror() to check for errors. Both functions check
+ * indicators that are part of the internal state of the stream to
+ * detect correctly the different situations.
+ *
+ * \return Returns nonzero if the error indicator for the stream
+ * is set, meaning that an error has occurred during a previous
+ * operation on the stream.
+ */
+int pack_ferror(PACKFILE *f)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_ferror);
+
+	return f->vtable->pf_ferror(f->userdata);
+}
+
+
+
+/**
+ * Reads a 16 bit word from a file, using intel byte ordering.
+ */
+int pack_igetw(PACKFILE *f)
+{
+	int b1, b2;
+	AL_ASSERT(f);
+
+	if ((b1 = pack_getc_fast(f)) != EOF)
+		if ((b2 = pack_getc_fast(f)) != EOF)
+			return ((b2 << 8) | b1);
+
+	return EOF;
+}
+
+
+
+/**
+ *  Reads a 32 bit long from a file, using intel byte ordering.
+ */
+long pack_igetl(PACKFILE *f)
+{
+	int b1, b2, b3, b4;
+	AL_ASSERT(f);
+
+	if ((b1 = pack_getc_fast(f)) != EOF)
+		if ((b2 = pack_getc_fast(f)) != EOF)
+			if ((b3 = pack_getc_fast(f)) != EOF)
+				if ((b4 = pack_getc_fast(f)) != EOF)
+					return (((long)b4 << 24) | ((long)b3 << 16) |
+							  ((long)b2 << 8) | (long)b1);
+
+	return EOF;
+}
+
+
+
+/**
+ *  Writes a 16 bit int to a file, using intel byte ordering.
+ */
+int pack_iputw(int w, PACKFILE *f)
+{
+	int b1, b2;
+	AL_ASSERT(f);
+
+	b1 = (w & 0xFF00) >> 8;
+	b2 = w & 0x00FF;
+
+	if (pack_putc_fast(b2,f)==b2)
+		if (pack_putc_fast(b1,f)==b1)
+			return w;
+
+	return EOF;
+}
+
+
+
+/**
+ *  Writes a 32 bit long to a file, using intel byte ordering.
+ */
+long pack_iputl(long l, PACKFILE *f)
+{
+	int b1, b2, b3, b4;
+	AL_ASSERT(f);
+
+	b1 = (int)((l & 0xFF000000L) >> 24);
+	b2 = (int)((l & 0x00FF0000L) >> 16);
+	b3 = (int)((l & 0x0000FF00L) >> 8);
+	b4 = (int)l & 0x00FF;
+
+	if (pack_putc_fast(b4,f)==b4)
+		if (pack_putc_fast(b3,f)==b3)
+			if (pack_putc_fast(b2,f)==b2)
+				if (pack_putc_fast(b1,f)==b1)
+					return l;
+
+	return EOF;
+}
+
+
+
+/**
+ *  Reads a 16 bit int from a file, using motorola byte-ordering.
+ */
+int pack_mgetw(PACKFILE *f)
+{
+	int b1, b2;
+	AL_ASSERT(f);
+
+	if ((b1 = pack_getc_fast(f)) != EOF)
+		if ((b2 = pack_getc_fast(f)) != EOF)
+			return ((b1 << 8) | b2);
+
+	return EOF;
+}
+
+
+
+/**
+ * Reads a 32 bit long from a file, using motorola byte-ordering.
+ */
+long pack_mgetl(PACKFILE *f)
+{
+	int b1, b2, b3, b4;
+	AL_ASSERT(f);
+
+	if ((b1 = pack_getc_fast(f)) != EOF)
+		if ((b2 = pack_getc_fast(f)) != EOF)
+			if ((b3 = pack_getc_fast(f)) != EOF)
+				if ((b4 = pack_getc_fast(f)) != EOF)
+					return (((long)b1 << 24) | ((long)b2 << 16) |
+							  ((long)b3 << 8) | (long)b4);
+
+	return EOF;
+}
+
+
+
+/**
+ *  Writes a 16 bit int to a file, using motorola byte-ordering.
+ */
+int pack_mputw(int w, PACKFILE *f)
+{
+	int b1, b2;
+	AL_ASSERT(f);
+
+	b1 = (w & 0xFF00) >> 8;
+	b2 = w & 0x00FF;
+
+	if (pack_putc_fast(b1,f)==b1)
+		if (pack_putc_fast(b2,f)==b2)
+			return w;
+
+	return EOF;
+}
+
+
+
+/**
+ *  Writes a 32 bit long to a file, using motorola byte-ordering.
+ */
+long pack_mputl(long l, PACKFILE *f)
+{
+	int b1, b2, b3, b4;
+	AL_ASSERT(f);
+
+	b1 = (int)((l & 0xFF000000L) >> 24);
+	b2 = (int)((l & 0x00FF0000L) >> 16);
+	b3 = (int)((l & 0x0000FF00L) >> 8);
+	b4 = (int)l & 0x00FF;
+
+	if (pack_putc_fast(b1,f)==b1)
+		if (pack_putc_fast(b2,f)==b2)
+			if (pack_putc_fast(b3,f)==b3)
+				if (pack_putc_fast(b4,f)==b4)
+					return l;
+
+	return EOF;
+}
+
+
+
+/* swap16:
+ *  Reverses the byte order of n 16 bit values in place.
+ */
+static void swap16(uint16_t *p, long n)
+{
+#ifdef __SSE2__
+	for (; n >= 8; p+=8, n-=8) {
+		__m128i v = _mm_loadu_si128((AL_CONST __m128i *)p);
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)p, v);
+	}
+#endif
+
+	for (; n > 0; p++, n--)
+		*p = (uint16_t)((*p << 8) | (*p >> 8));
+}
+
+
+
+/* swap32:
+ *  Reverses the byte order of n 32 bit values in place.
+ */
+static void swap32(uint32_t *p, long n)
+{
+#ifdef __SSE2__
+	for (; n >= 4; p+=4, n-=4) {
+		__m128i v = _mm_loadu_si128((AL_CONST __m128i *)p);
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)p, v);
+	}
+#endif
+
+	for (; n > 0; p++, n--)
+		*p = ((*p << 24) | ((*p & 0xFF00) << 8) |
+				((*p >> 8) & 0xFF00) | (*p >> 24));
+}
+
+
+
+/* read_array:
+ *  Reads count values of size bytes in the given byte order into dst.
+ *  Only whole values count, the bytes of a truncated last one are left
+ *  in dst unconverted.
+ */
+static long read_array(PACKFILE *f, void *dst, long count, int size, int intel)
+{
+	long n;
+	AL_ASSERT(f);
+	AL_ASSERT(dst || (count == 0));
+	AL_ASSERT(count >= 0);
+
+	n = pack_fread(dst, count * size, f) / size;
+
+	if (intel != NATIVE_INTEL) {
+		if (size == 2)
+			swap16(dst, n);
+		else
+			swap32(dst, n);
+	}
+
+	return n;
+}
+
+
+
+/* write_array:
+ *  Writes count values of size bytes from src in the given byte order.
+ *  Values which need swapping are converted through a buffer on the stack,
+ *  so src is never modified.
+ */
+static long write_array(PACKFILE *f, AL_CONST void *src, long count, int size, int intel)
+{
+	uint32_t tmp[SWAP_ITEMS];
+	AL_CONST unsigned char *p = src;
+	long done = 0;
+	long n, c;
+	AL_ASSERT(f);
+	AL_ASSERT(src || (count == 0));
+	AL_ASSERT(count >= 0);
+
+	if (intel == NATIVE_INTEL)
+		return pack_fwrite(src, count * size, f) / size;
+
+	while (done < count) {
+		c = AL_MIN(count - done, (long)sizeof(tmp) / size);
+		memcpy(tmp, p + done * size, c * size);
+
+		if (size == 2)
+			swap16((uint16_t *)tmp, c);
+		else
+			swap32(tmp, c);
+
+		n = pack_fwrite(tmp, c * size, f) / size;
+		done += n;
+		if (n < c)
+			break;
+	}
+
+	return done;
+}
+
+
+
+/**
+ *  Reads count 16 bit values stored with intel byte ordering into dst.
+ *  This is the array version of pack_igetw(), but with a single bulk read
+ *  in place of two pack_getc() calls per value.
+ *
+ *  \return Returns the number of whole values read, which will be less
+ *  than `count' if EOF is reached or an error occurs.
+ */
+long pack_iread_u16(PACKFILE *f, uint16_t *dst, long count)
+{
+	return read_array(f, dst, count, 2, TRUE);
+}
+
+
+
+/**
+ *  Reads count 32 bit values stored with intel byte ordering into dst.
+ *  \sa pack_iread_u16()
+ */
+long pack_iread_u32(PACKFILE *f, uint32_t *dst, long count)
+{
+	return read_array(f, dst, count, 4, TRUE);
+}
+
+
+
+/**
+ *  Reads count 16 bit values stored with motorola byte ordering into dst.
+ *  \sa pack_iread_u16()
+ */
+long pack_mread_u16(PACKFILE *f, uint16_t *dst, long count)
+{
+	return read_array(f, dst, count, 2, FALSE);
+}
+
+
+
+/**
+ *  Reads count 32 bit values stored with motorola byte ordering into dst.
+ *  \sa pack_iread_u16()
+ */
+long pack_mread_u32(PACKFILE *f, uint32_t *dst, long count)
+{
+	return read_array(f, dst, count, 4, FALSE);
+}
+
+
+
+/**
+ *  Writes count 16 bit values from src, using intel byte ordering.
+ *  This is the array version of pack_iputw(). The values are converted
+ *  a few thousand at a time and go to the file with one pack_fwrite()
+ *  call per batch; src itself is left untouched.
+ *
+ *  \return Returns the number of whole values written, which will be
+ *  less than `count' if an error occurs.
+ */
+long pack_iwrite_u16(PACKFILE *f, AL_CONST uint16_t *src, long count)
+{
+	return write_array(f, src, count, 2, TRUE);
+}
+
+
+
+/**
+ *  Writes count 32 bit values from src, using intel byte ordering.
+ *  \sa pack_iwrite_u16()
+ */
+long pack_iwrite_u32(PACKFILE *f, AL_CONST uint32_t *src, long count)
+{
+	return write_array(f, src, count, 4, TRUE);
+}
+
+
+
+/**
+ *  Writes count 16 bit values from src, using motorola byte ordering.
+ *  \sa pack_iwrite_u16()
+ */
+long pack_mwrite_u16(PACKFILE *f, AL_CONST uint16_t *src, long count)
+{
+	return write_array(f, src, count, 2, FALSE);
+}
+
+
+
+/**
+ *  Writes count 32 bit values from src, using motorola byte ordering.
+ *  \sa pack_iwrite_u16()
+ */
+long pack_mwrite_u32(PACKFILE *f, AL_CONST uint32_t *src, long count)
+{
+	return write_array(f, src, count, 4, FALSE);
+}
+
+
+
+/* longest LEB128 encoding of a 64 bit value */
+#define VARINT_MAX		10
+
+
+
+/**
+ *  Writes v as an unsigned LEB128 varint: seven bits per byte, lowest
+ *  first, with the top bit set on every byte but the last. Values below
+ *  128 take one byte, and no value takes more than ten.
+ *
+ *  \return Returns the number of bytes written, or EOF on error.
+ */
+int pack_vputl(uint64_t v, PACKFILE *f)
+{
+	unsigned char tmp[VARINT_MAX];
+	int n = 0;
+	AL_ASSERT(f);
+
+	while (v >= 0x80) {
+		tmp[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	tmp[n++] = (unsigned char)v;
+
+	if (pack_fwrite(tmp, n, f) != n)
+		return EOF;
+
+	return n;
+}
+
+
+
+/**
+ *  Reads an unsigned LEB128 varint written by pack_vputl() into *v. When
+ *  enough bytes are buffered they are decoded in place, without a call per
+ *  byte.
+ *
+ *  \return Returns the number of bytes read, or EOF if the file ends in the
+ *  middle of the value or it doesn't fit in 64 bits. The latter also sets
+ *  errno to EOVERFLOW.
+ */
+int pack_vgetl(PACKFILE *f, uint64_t *v)
+{
+	AL_CONST unsigned char *p;
+	uint64_t x = 0;
+	int n, c;
+	AL_ASSERT(f);
+	AL_ASSERT(v);
+
+	if (f->is_normal_packfile && !(f->normal.flags & PACKFILE_FLAG_WRITE) &&
+		 (f->normal.buf_size >= VARINT_MAX))
+	{
+		p = f->normal.buf_pos;
+		for (n = 0; n < VARINT_MAX; n++) {
+			x |= (uint64_t)(p[n] & 0x7F) << (7 * n);
+			if (!(p[n] & 0x80))
+				break;
+		}
+		if ((n == VARINT_MAX) || ((n == VARINT_MAX - 1) && (p[n] > 1))) {
+			errno = EOVERFLOW;
+			return EOF;
+		}
+		pack_fconsume(f, ++n);
+		*v = x;
+		return n;
+	}
+
+	for (n = 0; n < VARINT_MAX; n++) {
+		if ((c = pack_getc_fast(f)) == EOF)
+			return EOF;
+		x |= (uint64_t)(c & 0x7F) << (7 * n);
+		if (!(c & 0x80)) {
+			if ((n == VARINT_MAX - 1) && (c > 1))
+				break;
+			*v = x;
+			return n + 1;
+		}
+	}
+
+	errno = EOVERFLOW;
+	return EOF;
+}
+
+
+
+/**
+ *  Writes a signed value as a varint after zigzag encoding, which maps
+ *  0, -1, 1, -2, ... to 0, 1, 2, 3, ... so small negative numbers stay
+ *  short too.
+ *
+ *  \return Returns the number of bytes written, or EOF on error.
+ */
+int pack_zputl(int64_t v, PACKFILE *f)
+{
+	return pack_vputl(((uint64_t)v << 1) ^ (uint64_t)(v >> 63), f);
+}
+
+
+
+/**
+ *  Reads a signed value written by pack_zputl() into *v.
+ *  \return Returns the number of bytes read, or EOF like pack_vgetl().
+ */
+int pack_zgetl(PACKFILE *f, int64_t *v)
+{
+	uint64_t x;
+	int n;
+
+	if ((n = pack_vgetl(f, &x)) == EOF)
+		return EOF;
+
+	*v = (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+	return n;
+}
+
+
+
+/**
+ *  Writes n bytes from p preceded by their length as a varint, so
+ *  pack_getblob() can read them back without knowing the size in advance.
+ *
+ *  \return Returns n, or EOF on error.
+ */
+long pack_putblob(AL_CONST void *p, long n, PACKFILE *f)
+{
+	AL_ASSERT(p || (n == 0));
+	AL_ASSERT(n >= 0);
+
+	if (pack_vputl(n, f) == EOF)
+		return EOF;
+
+	if (n && (pack_fwrite(p, n, f) != n))
+		return EOF;
+
+	return n;
+}
+
+
+
+/**
+ *  Reads a block written by pack_putblob(), storing at most max bytes at p.
+ *  The rest of a longer block is skipped, so the stream always ends up
+ *  after the whole block.
+ *
+ *  \return Returns the length of the block, which is bigger than max if it
+ *  was truncated, or EOF if the file ends before the block does.
+ */
+long pack_getblob(void *p, long max, PACKFILE *f)
+{
+	uint64_t len;
+	long n;
+	AL_ASSERT(p || (max == 0));
+	AL_ASSERT(max >= 0);
+
+	if (pack_vgetl(f, &len) == EOF)
+		return EOF;
+
+	if (len > LONG_MAX) {
+		errno = EOVERFLOW;
+		return EOF;
+	}
+
+	n = AL_MIN((long)len, max);
+	if (n && (pack_fread(p, n, f) != n))
+		return EOF;
+
+	if (((long)len > n) && pack_fseek64(f, (long)len - n))
+		return EOF;
+
+	return (long)len;
+}
+
+
+
+/** Reads n bytes from f and stores them at memory location p.
+ * Example:
+ * \code
+ *	unsigned char buf[256];
+ *	...
+ *	if (256 != pack_fread(buf, 256, input_file))
+ *		abort_on_error("Truncated input file!");
+ * \endcode
+ *
+ * \return Returns the number of bytes read, which will be less
+ * than `n' if EOF is reached or an error occurs. Error codes are
+ * stored in errno.
+ */
+long pack_fread(void *p, long n, PACKFILE *f)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_fread);
+	AL_ASSERT(p);
+	AL_ASSERT(n >= 0);
+
+	return f->vtable->pf_fread(p, n, f->userdata);
+}
+
+
+
+/**
+ *  Writes n bytes to the file f from memory location p.
+ *
+ *  \return Returns the number
+ *  of items written, which will be less than n if an error occurs. Error
+ *  codes are stored in errno.
+ */
+long pack_fwrite(const void *p, long n, PACKFILE *f)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_fwrite);
+	AL_ASSERT(p);
+	AL_ASSERT(n >= 0);
+
+	return f->vtable->pf_fwrite(p, n, f->userdata);
+}
+
+
+
+
+/** Reads into several separate blocks of memory in one call, filling each
+ * of the iovcnt entries of iov in turn as if pack_fread() was called for
+ * them. Uncompressed and unencrypted files read their remaining data with
+ * readv() once a buffer's worth of it is requested, straight into the
+ * blocks; other files are read through their buffer as usual.
+ *
+ * \return Returns the total number of bytes read, which will be less than
+ * the size of all the blocks if EOF is reached or an error occurs. Error
+ * codes are stored in errno.
+ */
+long pack_freadv(PACKFILE *f, AL_CONST struct iovec *iov, int iovcnt)
+{
+	long done = 0, n, left = 0;
+	int i;
+	AL_ASSERT(f);
+	AL_ASSERT(iov || !iovcnt);
+
+	for (i=0; i<iovcnt; i++)
+		left += iov[i].iov_len;
+
+	for (i=0; i<iovcnt; i++) {
+		/* empty the buffer first, then maybe hand the rest to the OS */
+		n = iov[i].iov_len;
+		if (raw_vectored(f) && (left - AL_MAX(f->normal.buf_size, 0) >= F_BUF_SIZE))
+			n = AL_MIN(n, AL_MAX(f->normal.buf_size, 0));
+
+		if (n > 0) {
+			n = pack_fread(iov[i].iov_base, n, f);
+			done += n;
+			left -= n;
+			if (n < (long)iov[i].iov_len) {
+				if (pack_feof(f) || pack_ferror(f) || !raw_vectored(f))
+					break;
+				return done + raw_iov(f, iov + i, iovcnt - i, n, FALSE);
+			}
+		}
+		else if (iov[i].iov_len > 0) {
+			return done + raw_iov(f, iov + i, iovcnt - i, 0, FALSE);
+		}
+	}
+
+	return done;
+}
+
+
+
+/** Writes several separate blocks of memory in one call, as if pack_fwrite()
+ * was called for each of the iovcnt entries of iov in turn. Uncompressed
+ * and unencrypted files write a buffer's worth of data or more with a
+ * single writev(). Otherwise the blocks go through the file's buffer, so
+ * for compressed files they are compressed as one continuous stream.
+ *
+ * \return Returns the total number of bytes written, which will be less
+ * than the size of all the blocks if an error occurs. Error codes are
+ * stored in errno.
+ */
+long pack_fwritev(PACKFILE *f, AL_CONST struct iovec *iov, int iovcnt)
+{
+	long done = 0, n, total = 0;
+	int i;
+	AL_ASSERT(f);
+	AL_ASSERT(iov || !iovcnt);
+
+	for (i=0; i<iovcnt; i++)
+		total += iov[i].iov_len;
+
+	if (raw_vectored(f) && (total >= F_BUF_SIZE)) {
+		if (normal_flush_buffer(f, FALSE))
+			return 0;
+		return raw_iov(f, iov, iovcnt, 0, TRUE);
+	}
+
+	for (i=0; i<iovcnt; i++) {
+		if (iov[i].iov_len == 0)
+			continue;
+		n = pack_fwrite(iov[i].iov_base, iov[i].iov_len, f);
+		done += n;
+		if (n < (long)iov[i].iov_len)
+			break;
+	}
+
+	return done;
+}
+
+
+
+/** Moves one single character back to the input buffer.
+ * Like with ungetc from libc, only a single push back is guaranteed.
+ *
+ * Note: pack_fgets internally uses pack_ungetc(), so never use
+ * pack_ungetc() directly after using pack_fgets() on a PACKFILE.
+ *
+ * \return Returns c on success, or EOF on error.
+ */
+int pack_ungetc(int c, PACKFILE *f)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->vtable);
+	AL_ASSERT(f->vtable->pf_ungetc);
+
+	return f->vtable->pf_ungetc(c, f->userdata);
+}
+
+
+
+/** Gives read only access to the next bytes of the stream without copying
+ * them. On return *ptr points to the data, which stays valid until the next
+ * operation on the file. The position in the stream doesn't change, call
+ * pack_fconsume() to move past the bytes you have used.
+ *
+ * The function tries to make at least min_len bytes available, refilling
+ * the internal buffer if needed, so min_len can't be bigger than
+ * ::F_BUF_SIZE. More bytes than requested may be returned. Unencrypted
+ * memory files opened with pack_fopen_memory() are not limited by the size
+ * of the buffer and usually return all the remaining data at once.
+ *
+ * Example:
+ * \code
+ *	const unsigned char *p;
+ *	while (pack_fpeek(input_file, &p, 8) >= 8) {
+ *		parse_record(p);
+ *		pack_fconsume(input_file, 8);
+ *	}
+ * \endcode
+ *
+ * \return Returns the number of bytes available at *ptr, which is less than
+ * min_len only if the end of the file is near, and zero at the end of the
+ * file. Returns a negative number on error, storing the code in errno.
+ * Custom packfiles created with pack_fopen_vtable() and files open for
+ * writing are not supported and fail with EINVAL.
+ */
+long pack_fpeek(PACKFILE *f, AL_CONST unsigned char **ptr, long min_len)
+{
+	int n;
+	AL_ASSERT(f);
+	AL_ASSERT(ptr);
+	AL_ASSERT(min_len >= 0 && min_len <= F_BUF_SIZE);
+
+	if (!f->is_normal_packfile || (f->normal.flags & PACKFILE_FLAG_WRITE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (f->normal.buf_size < 0)
+		f->normal.buf_size = 0;
+
+	/* unencrypted memory blocks can be handed out directly */
+	if ((f->normal.flags & PACKFILE_FLAG_MEMORY) && (!f->normal.passpos) &&
+		 (f->normal.buf_size == 0))
+	{
+		*ptr = f->normal.mem.data + f->normal.mem.pos;
+		return AL_MIN(f->normal.todo, f->normal.mem.size - f->normal.mem.pos);
+	}
+
+	/* move the unread bytes to the front and fill the rest of the buffer */
+	if (f->normal.buf_size < AL_MAX(min_len, 1)) {
+		memmove(f->normal.buf, f->normal.buf_pos, f->normal.buf_size);
+		f->normal.buf_pos = f->normal.buf;
+
+		while ((f->normal.buf_size < AL_MAX(min_len, 1)) && !normal_no_more_input(f)) {
+			n = normal_fill_buffer(f, f->normal.buf + f->normal.buf_size,
+				AL_MIN(F_BUF_SIZE - f->normal.buf_size, f->normal.todo));
+			if (n < 0)
+				return -1;
+			if (n == 0)
+				break;
+			f->normal.buf_size += n;
+		}
+
+		if ((f->normal.buf_size == 0) && normal_no_more_input(f))
+			f->normal.flags |= PACKFILE_FLAG_EOF;
+	}
+
+	*ptr = f->normal.buf_pos;
+	return f->normal.buf_size;
+}
+
+
+
+/** Moves the stream n bytes forward, usually after looking at them with
+ * pack_fpeek(). Consuming bytes which are already buffered is as cheap as
+ * moving a pointer, larger values work like pack_fseek().
+ *
+ * \return Returns zero on success or a negative number on error, storing
+ * the error code in errno.
+ */
+int pack_fconsume(PACKFILE *f, long n)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(n >= 0);
+
+	if (f->is_normal_packfile && (n <= f->normal.buf_size)) {
+		f->normal.buf_pos += n;
+		f->normal.buf_size -= n;
+		if ((f->normal.buf_size <= 0) && normal_no_more_input(f))
+			f->normal.flags |= PACKFILE_FLAG_EOF;
+		return 0;
+	}
+
+	return pack_fseek64(f, n);
+}
+
+
+
+
+/***************************************************
+ ************ "Normal" packfile vtable *************
+ ***************************************************
+
+	Ideally this would be the only section which knows about the details
+	of "normal" packfiles. However, this ideal is still being violated in
+	many places (partly due to the API, and partly because it would be
+	quite a lot of work to move the _al_normal_packfile_details field
+	into the userdata field of the PACKFILE structure.
+*/
+
+
+static int normal_fclose(void *_f);
+static int normal_getc(void *_f);
+static int normal_ungetc(int ch, void *_f);
+static int normal_putc(int c, void *_f);
+static long normal_fread(void *p, long n, void *_f);
+static long normal_fwrite(AL_CONST void *p, long n, void *_f);
+static int normal_fseek(void *_f, int offset);
+static int normal_feof(void *_f);
+static int normal_ferror(void *_f);
+
+static int normal_refill_buffer(PACKFILE *f);
+static int normal_flush_buffer(PACKFILE *f, int last);
+static int normal_write_buffer(PACKFILE *f, unsigned char *buf, int size, int last);
+
+static int queue_write_behind(struct _al_packfile_behind *b, AL_CONST unsigned char *buf, int size);
+static int drain_write_behind(struct _al_packfile_behind *b);
+static int stop_write_behind(PACKFILE *f);
+
+
+
+static PACKFILE_VTABLE normal_vtable =
+{
+	normal_fclose,
+	normal_getc,
+	normal_ungetc,
+	normal_fread,
+	normal_putc,
+	normal_fwrite,
+	normal_fseek,
+	normal_feof,
+	normal_ferror
+};
+
+
+
+static int normal_fclose(void *_f)
+{
+	PACKFILE *f = _f;
+	int ret, flushed = 0;
+
+	if (f->normal.flags & PACKFILE_FLAG_WRITE) {
+		if (f->normal.flags & PACKFILE_FLAG_CHUNK) {
+			f = pack_fclose_chunk(_f);
+			if (!f)
+				return -1;
+
+			return pack_fclose(f);
+		}
+
+		if (f->normal.toc)
+			flushed = toc_write(f);
+
+		if (normal_flush_buffer(f, TRUE))
+			flushed = EOF;
+	}
+
+	/* the table may be shared with other readers, see raw_close() */
+	if (f->normal.toc) {
+		if (!toc_shared(f))
+			destroy_toc(f->normal.toc);
+		f->normal.toc = NULL;
+	}
+
+	if (f->normal.parent) {
+		ret = pack_fclose(f->normal.parent);
+	}
+	else {
+		ret = raw_close(f);
+	}
+
+	if (flushed && !ret)
+		ret = flushed;
+
+	if (f->normal.pack_data) {
+		free_lzss_pack_data(f->normal.pack_data);
+		f->normal.pack_data = NULL;
+	}
+
+	if (f->normal.unpack_data) {
+		free_lzss_unpack_data(f->normal.unpack_data);
+		f->normal.unpack_data = NULL;
+	}
+
+	drop_key(f);
+
+	return ret;
+}
+
+
+
+/* normal_no_more_input:
+ *  Return non-zero if the number of bytes remaining in the file (todo) is
+ *  less than or equal to zero.
+ *
+ *  However, there is a special case.	If we are reading from a LZSS
+ *  compressed file, the latest call to lzss_read() may have suspended while
+ *  writing out a sequence of bytes due to the output buffer being too small.
+ *  In that case the `todo' count would be decremented (possibly to zero),
+ *  but the output isn't yet completely written out.
+ */
+static INLINE int normal_no_more_input(PACKFILE *f)
+{
+	/* see normal_refill_buffer() to see when lzss_read() is called, chunks
+	 * know their exact size and must not read past it
+	 */
+	if (f->normal.parent && (f->normal.flags & PACKFILE_FLAG_PACK) &&
+		 !(f->normal.flags & PACKFILE_FLAG_CHUNK) &&
+		 _al_lzss_incomplete_state(f->normal.unpack_data))
+		return 0;
+
+	return (f->normal.todo <= 0);
+}
+
+
+
+static int normal_getc(void *_f)
+{
+	PACKFILE *f = _f;
+
+	f->normal.buf_size--;
+	if (f->normal.buf_size > 0)
+		return *(f->normal.buf_pos++);
+
+	if (f->normal.buf_size == 0) {
+		if (normal_no_more_input(f))
+			f->normal.flags |= PACKFILE_FLAG_EOF;
+		return *(f->normal.buf_pos++);
+	}
+
+	return normal_refill_buffer(f);
+}
+
+
+
+static int normal_ungetc(int c, void *_f)
+{
+	PACKFILE *f = _f;
+
+	if (f->normal.buf_pos == f->normal.buf) {
+		return EOF;
+	}
+	else {
+		*(--f->normal.buf_pos) = (unsigned char)c;
+		f->normal.buf_size++;
+		f->normal.flags &= ~PACKFILE_FLAG_EOF;
+		return (unsigned char)c;
+	}
+}
+
+
+
+static long normal_fread(void *p, long n, void *_f)
+{
+	PACKFILE *f = _f;
+	unsigned char *cp = (unsigned char *)p;
+	long i = 0, c;
+
+	while (i < n) {
+		/* the last byte of the buffer is left to normal_getc(), which
+		 * knows about end of file and refilling
+		 */
+		if (f->normal.buf_size > 1) {
+			c = AL_MIN(n - i, f->normal.buf_size - 1);
+			memcpy(cp + i, f->normal.buf_pos, c);
+			f->normal.buf_pos += c;
+			f->normal.buf_size -= c;
+			i += c;
+		}
+		else {
+			if ((c = normal_getc(f)) == EOF)
+				break;
+			cp[i++] = c;
+		}
+	}
+
+	return i;
+}
+
+
+
+static int normal_putc(int c, void *_f)
+{
+	PACKFILE *f = _f;
+
+	if (f->normal.buf_size + 1 >= F_BUF_SIZE) {
+		if (normal_flush_buffer(f, FALSE))
+			return EOF;
+	}
+
+	f->normal.buf_size++;
+	return (*(f->normal.buf_pos++) = c);
+}
+
+
+
+static long normal_fwrite(AL_CONST void *p, long n, void *_f)
+{
+	PACKFILE *f = _f;
+	AL_CONST unsigned char *cp = (AL_CONST unsigned char *)p;
+	long i = 0, c;
+
+	while (i < n) {
+		/* fill the buffer as far as normal_putc() would */
+		if (f->normal.buf_size + 1 < F_BUF_SIZE) {
+			c = AL_MIN(n - i, F_BUF_SIZE - 1 - f->normal.buf_size);
+			memcpy(f->normal.buf_pos, cp + i, c);
+			f->normal.buf_pos += c;
+			f->normal.buf_size += c;
+			i += c;
+		}
+		else {
+			if (normal_putc(cp[i], f) == EOF)
+				break;
+			i++;
+		}
+	}
+
+	return i;
+}
+
+
+
+static int normal_fseek(void *_f, int offset)
+{
+	return normal_fseek64(_f, offset);
+}
+
+
+
+/* normal_fseek64:
+ *  Moves forward offset bytes in a file open for reading. Returns zero on
+ *  success.
+ */
+static int normal_fseek64(PACKFILE *f, int64_t offset)
+{
+	int64_t i;
+	int len;
+
+	if (f->normal.flags & PACKFILE_FLAG_WRITE)
+		return -1;
+
+	errno = 0;
+
+	/* skip forward through the buffer */
+	if (f->normal.buf_size > 0) {
+		i = AL_MIN(offset, f->normal.buf_size);
+		f->normal.buf_size -= i;
+		f->normal.buf_pos += i;
+		offset -= i;
+		if ((f->normal.buf_size <= 0) && normal_no_more_input(f))
+			f->normal.flags |= PACKFILE_FLAG_EOF;
+	}
+
+	/* need to seek some more? */
+	if (offset > 0) {
+		if (f->normal.flags & PACKFILE_FLAG_PACK) {
+			/* for compressed files, we just have to read through the data,
+			 * until normal_refill_buffer() finds the end: todo may run out
+			 * while lzss_read() still has output pending
+			 */
+			i = offset;
+			while ((i > 0) && (normal_refill_buffer(f) != EOF)) {
+				i--;
+				len = AL_MIN(i, f->normal.buf_size);
+				f->normal.buf_size -= len;
+				f->normal.buf_pos += len;
+				i -= len;
+				if ((f->normal.buf_size <= 0) && normal_no_more_input(f))
+					f->normal.flags |= PACKFILE_FLAG_EOF;
+			}
+		}
+		else {
+			i = AL_MIN(offset, f->normal.todo);
+
+			if (f->normal.parent) {
+				/* pass the seek request on to the parent file */
+				pack_fseek64(f->normal.parent, i);
+			}
+			else {
+				/* do a real seek, moving along the key for encrypted files */
+				raw_seek(f, i);
+				if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))) {
+					key_seek(f, key_tell(f) + i);
+				}
+			}
+			f->normal.todo -= i;
+			f->normal.pos += i;
+			if (normal_no_more_input(f))
+				f->normal.flags |= PACKFILE_FLAG_EOF;
+		}
+	}
+
+	if (errno)
+		return -1;
+	else
+		return 0;
+}
+
+
+
+static int normal_feof(void *_f)
+{
+	PACKFILE *f = _f;
+
+	return (f->normal.flags & PACKFILE_FLAG_EOF);
+}
+
+
+
+static int normal_ferror(void *_f)
+{
+	PACKFILE *f = _f;
+
+	return (f->normal.flags & PACKFILE_FLAG_ERROR);
+}
+
+
+
+/* normal_refill_buffer:
+ *  Refills the read buffer. The file must have been opened in read mode,
+ *  and the buffer must be empty.
+ */
+static int normal_refill_buffer(PACKFILE *f)
+{
+	if (f->normal.flags & PACKFILE_FLAG_EOF)
+		return EOF;
+
+	if (normal_no_more_input(f)) {
+		f->normal.flags |= PACKFILE_FLAG_EOF;
+		return EOF;
+	}
+
+	f->normal.buf_size = normal_fill_buffer(f, f->normal.buf,
+		AL_MIN(F_BUF_SIZE, f->normal.todo));
+	if (f->normal.buf_size < 0)
+		return EOF;
+
+	f->normal.buf_pos = f->normal.buf;
+	f->normal.buf_size--;
+	if (f->normal.buf_size <= 0)
+		if (normal_no_more_input(f))
+			f->normal.flags |= PACKFILE_FLAG_EOF;
+
+	if (f->normal.buf_size < 0)
+		return EOF;
+	else
+		return *(f->normal.buf_pos++);
+}
+
+
+
+/* normal_fill_buffer:
+ *  Reads up to n bytes of the file into dst, which is usually part of the
+ *  read buffer, decrypting them if needed, and accounts for them in todo.
+ *  Returns the number of bytes read, or -1 if an error occurred.
+ */
+static int normal_fill_buffer(PACKFILE *f, unsigned char *dst, int n)
+{
+	int size;
+
+	if (f->normal.parent) {
+		if (f->normal.flags & PACKFILE_FLAG_PACK)
+			size = lzss_read(f->normal.parent, f->normal.unpack_data, n, dst);
+		else
+			size = pack_fread(dst, n, f->normal.parent);
+
+		if (f->normal.parent->normal.flags & PACKFILE_FLAG_EOF)
+			f->normal.todo = 0;
+		if (f->normal.parent->normal.flags & PACKFILE_FLAG_ERROR)
+			goto Error;
+	}
+	else {
+		size = n;
+
+		/* stop at the end of the key stream, and fail once there */
+		if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT)) &&
+			 (key_exhausted(f, key_tell(f), size))) {
+			if (key_exhausted(f, key_tell(f), 1))
+				goto TooBig;
+			size = CHACHA_LIMIT - key_tell(f);
+		}
+
+		if (raw_read(f, dst, size) < size)
+			goto Error;
+
+		if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT)))
+			xor_stream(f, dst, size);
+	}
+
+	f->normal.todo -= size;
+	f->normal.pos += size;
+	return size;
+
+Error:
+	errno = EFAULT;
+	f->normal.flags |= PACKFILE_FLAG_ERROR;
+	return -1;
+
+TooBig:
+	errno = EFBIG;
+	f->normal.flags |= PACKFILE_FLAG_ERROR;
+	return -1;
+}
+
+
+
+/* normal_flush_buffer:
+ *  Flushes a file buffer to the disk. The file must be open in write mode.
+ *  With write-behind the buffer is handed to the writer thread instead,
+ *  unless it is the last one.
+ */
+static int normal_flush_buffer(PACKFILE *f, int last)
+{
+	/* fail now rather than when the chunk is closed */
+	if (chunk_outgrown(f)) {
+		errno = EFBIG;
+		goto Error;
+	}
+
+	if (f->normal.behind) {
+		if (last) {
+			if (stop_write_behind(f))
+				goto Error;
+		}
+		else {
+			if (queue_write_behind(f->normal.behind, f->normal.buf, f->normal.buf_size))
+				goto Error;
+			f->normal.todo += f->normal.buf_size;
+			f->normal.pos += f->normal.buf_size;
+			f->normal.buf_pos = f->normal.buf;
+			f->normal.buf_size = 0;
+			return 0;
+		}
+	}
+
+	if (f->normal.buf_size > 0) {
+		if (normal_write_buffer(f, f->normal.buf, f->normal.buf_size, last))
+			goto Error;
+		f->normal.todo += f->normal.buf_size;
+		f->normal.pos += f->normal.buf_size;
+	}
+
+	f->normal.buf_pos = f->normal.buf;
+	f->normal.buf_size = 0;
+	return 0;
+
+Error:
+	if ((errno != ENOSPC) && (errno != EFBIG))
+		errno = EFAULT;
+	f->normal.flags |= PACKFILE_FLAG_ERROR;
+	return EOF;
+}
+
+
+
+/* normal_write_buffer:
+ *  Compresses or encrypts size bytes of buf, which are modified, and sends
+ *  them to the parent or the disk. Doesn't touch the buffer or the flags of
+ *  f, so it is safe to call from the write-behind thread. Returns zero on
+ *  success.
+ */
+static int normal_write_buffer(PACKFILE *f, unsigned char *buf, int size, int last)
+{
+	if (f->normal.flags & PACKFILE_FLAG_PACK)
+		return lzss_write(f->normal.parent, f->normal.pack_data, size, buf, last);
+
+	if (f->normal.flags & PACKFILE_FLAG_CHECKSUM)
+		f->normal.checksum = crc32c(f->normal.checksum, buf, size);
+
+	if (f->normal.flags & PACKFILE_FLAG_INPLACE)
+		return (pack_fwrite(buf, size, f->normal.parent) < size) ? EOF : 0;
+
+	/* staged chunks which grow too big move to the disk */
+	if ((f->normal.flags & PACKFILE_FLAG_MEMORY) && (f->normal.mem.limit) &&
+		 (f->normal.mem.pos + size > f->normal.mem.limit) && (raw_spill(f)))
+		return EOF;
+
+	if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))) {
+		if (key_exhausted(f, key_tell(f), size)) {
+			errno = EFBIG;
+			return EOF;
+		}
+		xor_stream(f, buf, size);
+	}
+
+	return (raw_write(f, buf, size) < size) ? EOF : 0;
+}
+
+
+
+/* normal_patch:
+ *  Overwrites n bytes at position pos of a file open in write mode, which
+ *  may still be in its buffer, in the parent of an in-place chunk, or
+ *  already on the disk. Compressed files can't be patched. Returns zero
+ *  on success.
+ */
+static int normal_patch(PACKFILE *f, long pos, AL_CONST unsigned char *p, int n)
+{
+	unsigned char tmp[16];
+	int c;
+
+	AL_ASSERT(f->normal.flags & PACKFILE_FLAG_WRITE);
+	AL_ASSERT(!(f->normal.flags & PACKFILE_FLAG_PACK));
+
+	while (n > 0) {
+		if (pos >= f->normal.todo) {
+			/* still in the buffer */
+			AL_ASSERT(pos + n <= f->normal.todo + f->normal.buf_size);
+			memcpy(f->normal.buf + (pos - f->normal.todo), p, n);
+			return 0;
+		}
+
+		c = AL_MIN(n, f->normal.todo - pos);
+
+		if (f->normal.flags & PACKFILE_FLAG_INPLACE) {
+			if (normal_patch(f->normal.parent, f->normal.chunk_header + pos +
+				 ((f->normal.flags & PACKFILE_FLAG_LARGE) ? CHUNK64_HEADER : CHUNK_HEADER), p, c))
+				return EOF;
+		}
+		else {
+			/* the queued buffers must reach the disk before they are patched */
+			if ((f->normal.behind) && (drain_write_behind(f->normal.behind)))
+				return EOF;
+
+			c = AL_MIN(c, (int)sizeof(tmp));
+			memcpy(tmp, p, c);
+
+			if (f->normal.passpos) {
+				if (key_exhausted(f, pos, c)) {
+					errno = EFBIG;
+					return EOF;
+				}
+				xor_password(f, pos, tmp, c);
+			}
+
+			if (raw_patch(f, pos, tmp, c))
+				return EOF;
+		}
+
+		pos += c;
+		p += c;
+		n -= c;
+	}
+
+	return 0;
+}
+
+
+
+/***************************************************
+ ******************* Chunk table *******************
+ ***************************************************
+
+	Files written with the 'i' mode flag end with a table of their top
+	level chunks. Each entry has the position of the chunk header, the
+	number of bytes stored after the header and the size of the data,
+	negative for packed chunks. The number of entries and F_TOC_MAGIC
+	follow. All of them are 32-bit big-endian numbers written through the
+	file, so they are encrypted like the rest of it.
+
+	If some chunks have names the table ends with F_TOC_NAMES_MAGIC
+	instead. Every entry then also has the position of its name in a pool
+	of NUL terminated strings, or -1. After the pool comes a minimal
+	perfect hash of the names built with the hash and displace method:
+	the names are spread over buckets, and each bucket stores the seed
+	which sends all of its names to free slots of a table with one slot
+	per name. A lookup hashes the name twice and compares it once. The
+	sizes of the pool and both tables come before the number of entries.
+
+	Files written with the 'c' flag use the same layout ending with
+	F_TOC_CRC_MAGIC, and every entry ends with the CRC-32C of the chunk
+	bytes stored after its header, before encryption. The pool and the
+	hash are empty when no chunk has a name.
+
+	Files with the 'l' flag, or with a chunk beyond the reach of 32 bits,
+	end with F_TOC64_MAGIC or F_TOC64_CRC_MAGIC instead of the last two.
+	The position and sizes of the entries then take 64 bits each.
+*/
+
+
+#define TOC_ENTRY_SIZE			12
+#define TOC_NAMED_ENTRY_SIZE	16
+#define TOC_CRC_ENTRY_SIZE		20
+#define TOC64_ENTRY_SIZE		28
+#define TOC64_CRC_ENTRY_SIZE	32
+#define TOC_BUCKET_LOAD			4			/* names per bucket */
+#define TOC_MAX_SEED			(1 << 20)	/* then grow the slot table */
+
+
+struct _al_toc_entry
+{
+	long offset;						/* position of the chunk header */
+	long filesize;						/* bytes after the header */
+	long datasize;						/* data bytes, negative if packed */
+	long name;							/* position in the pool, or -1 */
+	unsigned long crc;					/* CRC-32C of the stored chunk */
+};
+
+
+struct _al_packfile_toc
+{
+	long count, capacity;
+	long size;							/* reads: where the table starts */
+	struct _al_toc_entry *entry;
+	char *names;						/* pool of names */
+	long names_size, names_capacity;
+	long buckets;						/* number of buckets */
+	long slots;							/* number of slots */
+	long *seed;							/* per bucket */
+	long *slot;							/* entry of each slot, or -1 */
+	int checksums;						/* entries have a CRC */
+};
+
+
+
+/* create_toc:
+ *  Creates an empty table, with checksums if asked to.
+ */
+static struct _al_packfile_toc *create_toc(int checksums)
+{
+	struct _al_packfile_toc *toc;
+
+	if ((toc = _AL_MALLOC(sizeof(*toc))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(toc, 0, sizeof(*toc));
+	toc->checksums = checksums;
+
+	return toc;
+}
+
+
+
+/* destroy_toc:
+ *  Frees a table.
+ */
+static void destroy_toc(struct _al_packfile_toc *toc)
+{
+	if (toc->entry)
+		_AL_FREE(toc->entry);
+	if (toc->names)
+		_AL_FREE(toc->names);
+	if (toc->seed)
+		_AL_FREE(toc->seed);
+	if (toc->slot)
+		_AL_FREE(toc->slot);
+	_AL_FREE(toc);
+}
+
+
+
+/* toc_add:
+ *  Records a chunk which is about to be written into f, with an optional
+ *  name. Its position and sizes are filled in by toc_finish(). Returns the
+ *  number of the entry, or -1 on error.
+ */
+static long toc_add(PACKFILE *f, AL_CONST char *name)
+{
+	struct _al_packfile_toc *toc = f->normal.toc;
+	struct _al_toc_entry *entry;
+	long len;
+
+	if (toc->count == toc->capacity) {
+		long capacity = toc->capacity ? toc->capacity * 2 : 64;
+
+		if ((entry = _AL_REALLOC(toc->entry, capacity * sizeof(*entry))) == NULL)
+			goto Error;
+
+		toc->entry = entry;
+		toc->capacity = capacity;
+	}
+
+	entry = &toc->entry[toc->count];
+	entry->offset = 0;
+	entry->filesize = 0;
+	entry->datasize = 0;
+	entry->name = -1;
+	entry->crc = 0;
+
+	if (name) {
+		len = strlen(name) + 1;
+
+		if (toc->names_size + len > toc->names_capacity) {
+			long capacity = AL_MAX(toc->names_capacity * 2, toc->names_size + len);
+			char *names;
+
+			if ((names = _AL_REALLOC(toc->names, capacity)) == NULL)
+				goto Error;
+
+			toc->names = names;
+			toc->names_capacity = capacity;
+		}
+
+		memcpy(toc->names + toc->names_size, name, len);
+		entry->name = toc->names_size;
+		toc->names_size += len;
+	}
+
+	return toc->count++;
+
+Error:
+	errno = ENOMEM;
+	return -1;
+}
+
+
+
+/* toc_names:
+ *  Makes sure that f can have named chunks, which requires an uncompressed
+ *  file open for writing with a table. Returns zero on success.
+ */
+static int toc_names(PACKFILE *f)
+{
+	if ((!f->is_normal_packfile) || (f->normal.parent) || (!f->normal.toc) ||
+		 ((f->normal.flags & (PACKFILE_FLAG_WRITE | PACKFILE_FLAG_PACK |
+		 PACKFILE_FLAG_CHUNK)) != PACKFILE_FLAG_WRITE)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/* toc_drop:
+ *  Forgets the chunk recorded last, which could not be opened.
+ */
+static void toc_drop(PACKFILE *f)
+{
+	struct _al_packfile_toc *toc = f->normal.toc;
+
+	AL_ASSERT(toc->count > 0);
+
+	toc->count--;
+	if (toc->entry[toc->count].name >= 0)
+		toc->names_size = toc->entry[toc->count].name;
+}
+
+
+
+/* toc_finish:
+ *  Stores where the chunk number index ended up, its sizes and checksum. A
+ *  negative index stands for the chunk recorded last.
+ */
+static void toc_finish(PACKFILE *f, long index, long offset, long filesize, long datasize,
+	unsigned long crc)
+{
+	struct _al_packfile_toc *toc = f->normal.toc;
+
+	if (index < 0)
+		index = toc->count - 1;
+
+	AL_ASSERT(index < toc->count);
+
+	toc->entry[index].offset = offset;
+	toc->entry[index].filesize = filesize;
+	toc->entry[index].datasize = datasize;
+	toc->entry[index].crc = crc;
+}
+
+
+
+/* toc_hash:
+ *  Hashes a name with the given seed.
+ */
+static unsigned long toc_hash(AL_CONST char *name, unsigned long seed)
+{
+	unsigned long h = seed * 0x9E3779B9UL;
+
+	h = (h ^ (h >> 16)) * 0x85EBCA6BUL;
+	h = (2166136261UL ^ h ^ (h >> 13)) & 0xFFFFFFFFUL;
+
+	while (*name) {
+		h ^= (unsigned char)*(name++);
+		h = (h * 16777619UL) & 0xFFFFFFFFUL;
+	}
+
+	/* FNV-1a mixes the last characters poorly */
+	h ^= h >> 16;
+	h = (h * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+	h ^= h >> 13;
+	h = (h * 0xC2B2AE35UL) & 0xFFFFFFFFUL;
+	h ^= h >> 16;
+
+	return h;
+}
+
+
+
+/* toc_bucket_size:
+ *  qsort() helper sorting buckets from the biggest to the smallest.
+ */
+static int toc_bucket_size(AL_CONST void *a, AL_CONST void *b)
+{
+	return ((AL_CONST long *)b)[1] - ((AL_CONST long *)a)[1];
+}
+
+
+
+/* toc_build_hash:
+ *  Builds the perfect hash of the named entries. Returns zero on success,
+ *  storing the error code in errno otherwise: EEXIST means that two chunks
+ *  have the same name.
+ */
+static int toc_build_hash(struct _al_packfile_toc *toc)
+{
+	long *first = NULL, *next = NULL, *order = NULL, *pos = NULL;
+	long named = 0, i, j, k, b, n, seed;
+	AL_CONST char *name;
+	int ret = -1;
+
+	for (i=0; i<toc->count; i++)
+		if (toc->entry[i].name >= 0)
+			named++;
+
+	toc->buckets = (named + TOC_BUCKET_LOAD - 1) / TOC_BUCKET_LOAD + 1;
+	toc->slots = AL_MAX(named, 1);
+
+	first = _AL_MALLOC(toc->buckets * sizeof(long));
+	next = _AL_MALLOC(toc->count * sizeof(long));
+	order = _AL_MALLOC(toc->buckets * 2 * sizeof(long));
+	pos = _AL_MALLOC(TOC_BUCKET_LOAD * 8 * sizeof(long));
+	toc->seed = _AL_MALLOC(toc->buckets * sizeof(long));
+	if (!first || !next || !order || !pos || !toc->seed) {
+		errno = ENOMEM;
+		goto Done;
+	}
+
+	/* chain the names of every bucket, biggest buckets are placed first */
+	for (b=0; b<toc->buckets; b++) {
+		first[b] = -1;
+		order[b*2] = b;
+		order[b*2+1] = 0;
+		toc->seed[b] = 0;
+	}
+
+	for (i=0; i<toc->count; i++) {
+		if (toc->entry[i].name >= 0) {
+			b = toc_hash(toc->names + toc->entry[i].name, 0) % toc->buckets;
+			next[i] = first[b];
+			first[b] = i;
+			order[b*2+1]++;
+		}
+	}
+
+	qsort(order, toc->buckets, 2 * sizeof(long), toc_bucket_size);
+
+	for (;;) {
+		if (toc->slot)
+			_AL_FREE(toc->slot);
+		if ((toc->slot = _AL_MALLOC(toc->slots * sizeof(long))) == NULL) {
+			errno = ENOMEM;
+			goto Done;
+		}
+
+		for (k=0; k<toc->slots; k++)
+			toc->slot[k] = -1;
+
+		for (j=0; j<toc->buckets; j++) {
+			b = order[j*2];
+			if (order[j*2+1] == 0)
+				break;
+
+			if (order[j*2+1] > TOC_BUCKET_LOAD * 8) {
+				/* hopelessly bad luck, or the same name many times */
+				errno = EEXIST;
+				goto Done;
+			}
+
+			for (seed=1; seed<TOC_MAX_SEED; seed++) {
+				for (i=first[b], n=0; i>=0; i=next[i], n++) {
+					name = toc->names + toc->entry[i].name;
+					pos[n] = toc_hash(name, seed) % toc->slots;
+					if (toc->slot[pos[n]] >= 0)
+						break;
+					for (k=0; k<n; k++)
+						if (pos[k] == pos[n])
+							break;
+					if (k < n)
+						break;
+				}
+				if (i < 0)
+					break;
+			}
+
+			if (seed == TOC_MAX_SEED)
+				break;
+
+			for (i=first[b], n=0; i>=0; i=next[i], n++)
+				toc->slot[pos[n]] = i;
+			toc->seed[b] = seed;
+		}
+
+		if (j == toc->buckets || order[j*2+1] == 0)
+			break;
+
+		/* look for duplicates before trying with more room */
+		for (i=first[b]; i>=0; i=next[i]) {
+			for (k=next[i]; k>=0; k=next[k]) {
+				if (!strcmp(toc->names + toc->entry[i].name, toc->names + toc->entry[k].name)) {
+					errno = EEXIST;
+					goto Done;
+				}
+			}
+		}
+
+		toc->slots += toc->slots / 8 + 1;
+	}
+
+	ret = 0;
+
+Done:
+	if (first)
+		_AL_FREE(first);
+	if (next)
+		_AL_FREE(next);
+	if (order)
+		_AL_FREE(order);
+	if (pos)
+		_AL_FREE(pos);
+	return ret;
+}
+
+
+
+/* toc_put64:
+ *  Writes a 64-bit big-endian number of the table.
+ */
+static void toc_put64(int64_t x, PACKFILE *f)
+{
+	pack_mputl((long)(x >> 32), f);
+	pack_mputl((long)(x & 0xFFFFFFFF), f);
+}
+
+
+
+/* toc_write:
+ *  Appends the table to f, which is about to be closed. Returns zero on
+ *  success.
+ */
+static int toc_write(PACKFILE *f)
+{
+	struct _al_packfile_toc *toc = f->normal.toc;
+	int large = f->normal.flags & PACKFILE_FLAG_LARGE;
+	long i;
+
+	if (toc->names_size && toc_build_hash(toc)) {
+		f->normal.flags |= PACKFILE_FLAG_ERROR;
+		return EOF;
+	}
+
+	for (i=0; i<toc->count; i++) {
+		if ((toc->entry[i].offset > INT32_MAX) || (toc->entry[i].filesize > INT32_MAX) ||
+			 (toc->entry[i].datasize > INT32_MAX) || (toc->entry[i].datasize < -INT32_MAX))
+			large = TRUE;
+	}
+
+	for (i=0; i<toc->count; i++) {
+		if (large) {
+			toc_put64(toc->entry[i].offset, f);
+			toc_put64(toc->entry[i].filesize, f);
+			toc_put64(toc->entry[i].datasize, f);
+		}
+		else {
+			pack_mputl(toc->entry[i].offset, f);
+			pack_mputl(toc->entry[i].filesize, f);
+			pack_mputl(toc->entry[i].datasize, f);
+		}
+		if (toc->names_size || toc->checksums || large)
+			pack_mputl(toc->entry[i].name, f);
+		if (toc->checksums)
+			pack_mputl((int32_t)toc->entry[i].crc, f);
+	}
+
+	if (toc->names_size || toc->checksums || large) {
+		if (toc->names_size)
+			pack_fwrite(toc->names, toc->names_size, f);
+		for (i=0; i<toc->buckets; i++)
+			pack_mputl(toc->seed[i], f);
+		for (i=0; i<toc->slots; i++)
+			pack_mputl(toc->slot[i], f);
+
+		pack_mputl(toc->names_size, f);
+		pack_mputl(toc->buckets, f);
+		pack_mputl(toc->slots, f);
+		pack_mputl(toc->count, f);
+		if (large)
+			pack_mputl(toc->checksums ? F_TOC64_CRC_MAGIC : F_TOC64_MAGIC, f);
+		else
+			pack_mputl(toc->checksums ? F_TOC_CRC_MAGIC : F_TOC_NAMES_MAGIC, f);
+	}
+	else {
+		pack_mputl(toc->count, f);
+		pack_mputl(F_TOC_MAGIC, f);
+	}
+
+	return pack_ferror(f) ? EOF : 0;
+}
+
+
+
+/* toc_pread:
+ *  Reads and decrypts n bytes at the given offset of f, without touching
+ *  its position. Returns zero on success.
+ */
+static int toc_pread(PACKFILE *f, long offset, unsigned char *p, long n)
+{
+	if (raw_pread(f, offset, p, n) < n)
+		return -1;
+
+	if (f->normal.passpos) {
+		if (key_exhausted(f, offset, n)) {
+			errno = EFBIG;
+			return -1;
+		}
+		xor_password(f, offset, p, n);
+	}
+
+	return 0;
+}
+
+
+
+/* toc_long:
+ *  Decodes a 32-bit big-endian number of the table.
+ */
+static long toc_long(AL_CONST unsigned char *p)
+{
+	return (int32_t)(((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+		((unsigned long)p[2] << 8) | (unsigned long)p[3]);
+}
+
+
+
+/* toc_read:
+ *  Loads the table at the end of f. Returns NULL if there is none.
+ */
+static struct _al_packfile_toc *toc_read(PACKFILE *f)
+{
+	struct _al_packfile_toc *toc = NULL;
+	unsigned char tail[20], *data = NULL, *p, *q;
+	long size, count, magic, entry_size, tail_size, table, i;
+	long names_size = 0, buckets = 0, slots = 0;
+	int checksums;
+
+	if ((size = raw_size(f)) < 8 || toc_pread(f, size - 8, tail + 12, 8))
+		goto NoTable;
+
+	count = toc_long(tail + 12);
+	magic = toc_long(tail + 16);
+
+	if (magic == F_TOC_MAGIC) {
+		entry_size = TOC_ENTRY_SIZE;
+		tail_size = 8;
+	}
+	else if ((magic == F_TOC_NAMES_MAGIC) || (magic == F_TOC_CRC_MAGIC) ||
+		 (magic == F_TOC64_MAGIC) || (magic == F_TOC64_CRC_MAGIC)) {
+		if (magic == F_TOC_NAMES_MAGIC)
+			entry_size = TOC_NAMED_ENTRY_SIZE;
+		else if (magic == F_TOC_CRC_MAGIC)
+			entry_size = TOC_CRC_ENTRY_SIZE;
+		else if (magic == F_TOC64_MAGIC)
+			entry_size = TOC64_ENTRY_SIZE;
+		else
+			entry_size = TOC64_CRC_ENTRY_SIZE;
+		tail_size = 20;
+		if (size < 20 || toc_pread(f, size - 20, tail, 12))
+			goto NoTable;
+		names_size = toc_long(tail);
+		buckets = toc_long(tail + 4);
+		slots = toc_long(tail + 8);
+	}
+	else {
+		goto NoTable;
+	}
+
+	/* everything has to fit in the file, checked without overflowing */
+	table = size - tail_size;
+	if ((count < 0) || (names_size < 0) || (buckets < 0) || (slots < 0) ||
+		 (count > table / entry_size) || (names_size > table - count * entry_size) ||
+		 (buckets > (table - count * entry_size - names_size) / 4) ||
+		 (slots > (table - count * entry_size - names_size) / 4 - buckets) ||
+		 ((names_size > 0) && (buckets == 0 || slots == 0)))
+		goto NoTable;
+
+	table = count * entry_size + names_size + (buckets + slots) * 4;
+
+	checksums = (entry_size == TOC_CRC_ENTRY_SIZE) || (entry_size == TOC64_CRC_ENTRY_SIZE);
+
+	if ((toc = create_toc(checksums)) == NULL)
+		return NULL;
+
+	toc->size = size - tail_size - table;
+	toc->buckets = buckets;
+	toc->slots = slots;
+
+	if ((table > 0) && ((data = _AL_MALLOC_ATOMIC(table)) == NULL))
+		goto NoMemory;
+	if ((count > 0) && ((toc->entry = _AL_MALLOC(count * sizeof(*toc->entry))) == NULL))
+		goto NoMemory;
+	if ((names_size > 0) && ((toc->names = _AL_MALLOC_ATOMIC(names_size + 1)) == NULL))
+		goto NoMemory;
+	if ((buckets > 0) && ((toc->seed = _AL_MALLOC(buckets * sizeof(long))) == NULL))
+		goto NoMemory;
+	if ((slots > 0) && ((toc->slot = _AL_MALLOC(slots * sizeof(long))) == NULL))
+		goto NoMemory;
+
+	if ((table > 0) && (toc_pread(f, size - tail_size - table, data, table)))
+		goto Corrupt;
+
+	for (i=0, p=data; i<count; i++, p+=entry_size) {
+		if (entry_size >= TOC64_ENTRY_SIZE) {
+			if ((!fits_long(chunk_long(p, 8))) || (!fits_long(chunk_long(p + 8, 8))) ||
+				 (!fits_long(chunk_long(p + 16, 8))))
+				goto TooBig;
+			toc->entry[i].offset = chunk_long(p, 8);
+			toc->entry[i].filesize = chunk_long(p + 8, 8);
+			toc->entry[i].datasize = chunk_long(p + 16, 8);
+			q = p + 24;
+		}
+		else {
+			toc->entry[i].offset = toc_long(p);
+			toc->entry[i].filesize = toc_long(p + 4);
+			toc->entry[i].datasize = toc_long(p + 8);
+			q = p + 12;
+		}
+		toc->entry[i].name = (entry_size > TOC_ENTRY_SIZE) ? toc_long(q) : -1;
+		toc->entry[i].crc = checksums ? (uint32_t)toc_long(q + 4) : 0;
+		if ((toc->entry[i].name >= names_size) || (toc->entry[i].offset < 0) ||
+			 (toc->entry[i].offset > toc->size))
+			goto Corrupt;
+	}
+
+	if (names_size > 0) {
+		memcpy(toc->names, p, names_size);
+		toc->names[names_size] = 0;
+		p += names_size;
+	}
+
+	for (i=0; i<buckets; i++, p+=4)
+		toc->seed[i] = toc_long(p);
+
+	for (i=0; i<slots; i++, p+=4) {
+		toc->slot[i] = toc_long(p);
+		if (toc->slot[i] >= count)
+			goto Corrupt;
+	}
+
+	if (data)
+		_AL_FREE(data);
+
+	toc->count = toc->capacity = count;
+	toc->names_size = toc->names_capacity = names_size;
+
+	return toc;
+
+NoMemory:
+	if (data)
+		_AL_FREE(data);
+	destroy_toc(toc);
+	errno = ENOMEM;
+	return NULL;
+
+TooBig:
+	_AL_FREE(data);
+	destroy_toc(toc);
+	errno = EFBIG;
+	return NULL;
+
+Corrupt:
+	if (data)
+		_AL_FREE(data);
+	destroy_toc(toc);
+
+NoTable:
+	errno = ENOENT;
+	return NULL;
+}
+
+
+
+/* toc_trim:
+ *  Leaves the table at the end of f, which has just been opened for
+ *  reading, out of its data, so that reading chunks one after the other
+ *  stops at the last one. Returns zero on success, or if there is no table.
+ */
+static int toc_trim(PACKFILE *f)
+{
+	struct _al_packfile_toc *toc;
+
+	if ((toc = toc_get(f)) == NULL)
+		return (errno == ENOENT) ? 0 : -1;
+
+	f->normal.todo = toc->size - f->normal.pos;
+	return 0;
+}
+
+
+
+/* toc_get:
+ *  Returns the table of a file open for reading, loading it if needed.
+ */
+static struct _al_packfile_toc *toc_get(PACKFILE *f)
+{
+	if ((!f->is_normal_packfile) || (f->normal.parent) ||
+		 (f->normal.flags & (PACKFILE_FLAG_WRITE | PACKFILE_FLAG_PACK |
+		 PACKFILE_FLAG_OLD_CRYPT | PACKFILE_FLAG_CHUNK))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!f->normal.toc)
+		f->normal.toc = toc_read(f);
+
+	return f->normal.toc;
+}
+
+
+
+/* toc_count:
+ *  Returns the number of entries in the table of f, or -1 on error.
+ */
+static long toc_count(PACKFILE *f)
+{
+	struct _al_packfile_toc *toc;
+
+	if ((toc = toc_get(f)) == NULL)
+		return -1;
+
+	return toc->count;
+}
+
+
+
+/* toc_find:
+ *  Returns the index of the chunk called name in the table of f, or -1 on
+ *  error.
+ */
+static long toc_find(PACKFILE *f, AL_CONST char *name)
+{
+	struct _al_packfile_toc *toc;
+	unsigned long b;
+	long i;
+
+	if ((toc = toc_get(f)) == NULL)
+		return -1;
+
+	if (toc->names_size > 0) {
+		b = toc_hash(name, 0) % toc->buckets;
+		i = toc->slot[toc_hash(name, toc->seed[b]) % toc->slots];
+
+		if ((i >= 0) && (toc->entry[i].name >= 0) &&
+			 (!strcmp(toc->names + toc->entry[i].name, name)))
+			return i;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+
+
+/* toc_seek:
+ *  Moves f to the header of the chunk number index, dropping its buffer,
+ *  and tells whether the chunk is packed. Returns zero on success.
+ */
+static int toc_seek(PACKFILE *f, long index, int *pack)
+{
+	struct _al_packfile_toc *toc;
+	struct _al_toc_entry *e;
+
+	if ((toc = toc_get(f)) == NULL)
+		return -1;
+
+	if ((index < 0) || (index >= toc->count)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	e = &toc->entry[index];
+
+	/* everything read from the disk so far is size - todo bytes */
+	if (raw_seek(f, e->offset - (toc->size - f->normal.todo)))
+		return -1;
+
+	f->normal.todo = toc->size - e->offset;
+	f->normal.pos = e->offset;
+	f->normal.buf_pos = f->normal.buf;
+	f->normal.buf_size = 0;
+	f->normal.flags &= ~PACKFILE_FLAG_EOF;
+
+	if (f->normal.passpos)
+		key_seek(f, e->offset);
+
+	*pack = (e->datasize < 0);
+	return 0;
+}
+
+
+
+/***************************************************
+ **************** Concurrent chunks ****************
+ ***************************************************
+
+	Chunks opened with pack_fopen_chunk_concurrent() are staged like the
+	chunks of unseekable files, see open_staged_chunk(). Their parent keeps
+	them in a queue in the order they were opened. Whenever one is closed
+	the finished chunks at the head of the queue are copied into the
+	parent, so the file gets the same layout as with nested writes. The
+	queue lock also protects the parent and its table while that happens.
+*/
+
+
+struct _al_packfile_sibling
+{
+	PACKFILE *stage;					/* where the chunk is collected */
+	long index;							/* its entry in the parent's table */
+	long filesize, datasize;			/* for the header */
+	int closed;
+	int error;
+	struct _al_packfile_sibling *next;	/* opened after this one */
+};
+
+
+struct _al_packfile_siblings
+{
+	pthread_mutex_t lock;
+	struct _al_packfile_sibling *head, *tail;
+};
+
+
+
+/* open_concurrent_chunk:
+ *  Starts a staged chunk of f which is queued until it can be copied.
+ */
+static PACKFILE *open_concurrent_chunk(PACKFILE *f, AL_CONST char *name, int pack)
+{
+	struct _al_packfile_siblings *s = f->normal.siblings;
+	struct _al_packfile_sibling *node;
+	PACKFILE *chunk = NULL;
+
+	if (!s) {
+		if ((s = _AL_MALLOC(sizeof(*s))) == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		if (pthread_mutex_init(&s->lock, NULL)) {
+			_AL_FREE(s);
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		s->head = s->tail = NULL;
+		f->normal.siblings = s;
+	}
+
+	if ((node = _AL_MALLOC(sizeof(*node))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	node->index = -1;
+	node->closed = FALSE;
+	node->error = 0;
+	node->next = NULL;
+
+	/* other chunks may be copied into f meanwhile */
+	pthread_mutex_lock(&s->lock);
+
+	if ((pack) && (chunk_compressed(f)))
+		pack = FALSE;
+
+	if ((f->normal.toc) && ((node->index = toc_add(f, name)) < 0))
+		goto Done;
+
+	if ((chunk = open_staged_chunk(f, pack)) == NULL) {
+		if (f->normal.toc)
+			toc_drop(f);
+		goto Done;
+	}
+
+	node->stage = (chunk->normal.flags & PACKFILE_FLAG_PACK) ? chunk->normal.parent : chunk;
+	node->stage->normal.sibling = node;
+	checksum_chunk(f, chunk);
+
+	if (s->tail)
+		s->tail->next = node;
+	else
+		s->head = node;
+	s->tail = node;
+
+Done:
+	pthread_mutex_unlock(&s->lock);
+
+	if (!chunk)
+		_AL_FREE(node);
+
+	return chunk;
+}
+
+
+
+/* close_concurrent_chunk:
+ *  Flushes a chunk opened by open_concurrent_chunk(), and copies it into
+ *  the parent along with the chunks following it which are closed too, if
+ *  the chunks before it have been copied already. Returns the parent, or
+ *  NULL on error.
+ */
+static PACKFILE *close_concurrent_chunk(PACKFILE *f)
+{
+	PACKFILE *stage = (f->normal.flags & PACKFILE_FLAG_PACK) ? f->normal.parent : f;
+	PACKFILE *parent = stage->normal.parent;
+	struct _al_packfile_siblings *s = parent->normal.siblings;
+	struct _al_packfile_sibling *node = stage->normal.sibling;
+	int ret;
+
+	ret = flush_staged_chunk(f, &node->filesize, &node->datasize);
+
+	pthread_mutex_lock(&s->lock);
+
+	node->closed = TRUE;
+	node->error = ret;
+
+	while ((s->head) && (s->head->closed)) {
+		node = s->head;
+
+		if ((!node->error) && (!(parent->normal.flags & PACKFILE_FLAG_ERROR)))
+			node->error = commit_staged_chunk(node->stage, node->filesize,
+				node->datasize, node->index);
+
+		if (node->error) {
+			parent->normal.flags |= PACKFILE_FLAG_ERROR;
+			if (node->stage == stage)
+				ret = EOF;
+		}
+
+		if (!(s->head = node->next))
+			s->tail = NULL;
+
+		node->stage->normal.sibling = NULL;
+		raw_discard(node->stage);
+		_AL_FREE(node);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return ret ? NULL : parent;
+}
+
+
+
+/* destroy_siblings:
+ *  Frees the queue of a file once it is closed.
+ */
+static void destroy_siblings(struct _al_packfile_siblings *s)
+{
+	AL_ASSERT(!s->head);
+
+	pthread_mutex_destroy(&s->lock);
+	_AL_FREE(s);
+}
+
+
+
+/***************************************************
+ ******************** Checksums ********************
+ ***************************************************
+
+	Top level chunks of files written with the 'c' mode flag compute the
+	CRC-32C of the bytes they store while their buffers are written out,
+	and the chunk table keeps it. pack_verify_chunks() reads the chunks
+	back with positional reads, so several threads can check one file.
+	The SSE4.2 or ARMv8 CRC instructions are used when the CPU has them.
+*/
+
+
+#define CRC32C_POLY		0x82F63B78UL	/* reversed Castagnoli polynomial */
+
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_update)(uint32_t crc, AL_CONST unsigned char *p, long n);
+
+
+
+/* crc32c_soft:
+ *  Updates crc eight bytes at a time with the tables.
+ */
+static uint32_t crc32c_soft(uint32_t crc, AL_CONST unsigned char *p, long n)
+{
+	while ((n > 0) && ((uintptr_t)p & 3)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		n--;
+	}
+
+	while (n >= 8) {
+		uint32_t lo = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+			((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+		uint32_t hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) |
+			((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+
+		crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+			crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+			crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+
+		p += 8;
+		n -= 8;
+	}
+
+	while (n-- > 0)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+
+
+#ifdef ALLEGRO_HAVE_SSE42_CRC32C
+
+/* crc32c_sse42:
+ *  Updates crc with the SSE4.2 crc32 instruction.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, AL_CONST unsigned char *p, long n)
+{
+#ifdef __x86_64__
+	uint64_t c = crc, w;
+
+	while (n >= 8) {
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+		p += 8;
+		n -= 8;
+	}
+
+	crc = (uint32_t)c;
+#else
+	uint32_t w;
+
+	while (n >= 4) {
+		memcpy(&w, p, 4);
+		crc = _mm_crc32_u32(crc, w);
+		p += 4;
+		n -= 4;
+	}
+#endif
+
+	while (n-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+#endif
+
+
+
+#ifdef ALLEGRO_HAVE_ARM_CRC32C
+
+/* crc32c_arm:
+ *  Updates crc with the ARMv8 CRC32 instructions.
+ */
+static uint32_t crc32c_arm(uint32_t crc, AL_CONST unsigned char *p, long n)
+{
+	uint64_t w;
+
+	while (n >= 8) {
+		memcpy(&w, p, 8);
+		crc = __crc32cd(crc, w);
+		p += 8;
+		n -= 8;
+	}
+
+	while (n-- > 0)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+#endif
+
+
+
+/* crc32c_init:
+ *  Builds the tables and picks the fastest update function.
+ */
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i=0; i<256; i++) {
+		crc = i;
+		for (j=0; j<8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i=0; i<256; i++)
+		for (j=1; j<8; j++)
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j-1][i] & 0xFF] ^
+				(crc32c_table[j-1][i] >> 8);
+
+	crc32c_update = crc32c_soft;
+
+#if defined(ALLEGRO_HAVE_SSE42_CRC32C)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_update = crc32c_sse42;
+#elif defined(ALLEGRO_HAVE_ARM_CRC32C)
+	crc32c_update = crc32c_arm;
+#endif
+}
+
+
+
+/* crc32c:
+ *  Returns the CRC-32C of n more bytes after the ones crc was computed
+ *  for. Start with zero.
+ */
+static unsigned long crc32c(unsigned long crc, AL_CONST unsigned char *p, long n)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return crc32c_update((uint32_t)crc ^ 0xFFFFFFFFUL, p, n) ^ 0xFFFFFFFFUL;
+}
+
+
+
+/* checksum_chunk:
+ *  Makes the chunk just opened in f compute the checksum of the bytes it
+ *  stores, if the table of f keeps them.
+ */
+static void checksum_chunk(PACKFILE *f, PACKFILE *chunk)
+{
+	if ((!f->normal.toc) || (!f->normal.toc->checksums))
+		return;
+
+	if (chunk->normal.flags & PACKFILE_FLAG_PACK)
+		chunk = chunk->normal.parent;
+
+	chunk->normal.flags |= PACKFILE_FLAG_CHECKSUM;
+}
+
+
+
+struct verify_job
+{
+	PACKFILE *f;
+	struct _al_packfile_toc *toc;
+	long first;							/* entries first, first+step... */
+	long step;
+	long bad;							/* number of bad chunks found */
+	int error;							/* errno if the check failed */
+};
+
+
+
+/* verify_thread:
+ *  Checks every step-th chunk of the table.
+ */
+static void *verify_thread(void *arg)
+{
+	struct verify_job *job = arg;
+	struct _al_toc_entry *entry;
+	unsigned char *buf;
+	unsigned long crc;
+	long i, pos, left, n;
+
+	if ((buf = _AL_MALLOC_ATOMIC(F_AHEAD_SIZE)) == NULL) {
+		job->error = ENOMEM;
+		return NULL;
+	}
+
+	for (i=job->first; i<job->toc->count; i+=job->step) {
+		entry = &job->toc->entry[i];
+		pos = entry->offset + CHUNK_HEADER;
+		left = entry->filesize;
+		crc = 0;
+
+		/* the first word tells which kind of header the chunk has */
+		if ((pos <= job->toc->size) && (!toc_pread(job->f, entry->offset, buf, 4)) &&
+			 (chunk_long(buf, 4) == (int32_t)F_CHUNK64_MAGIC))
+			pos = entry->offset + CHUNK64_HEADER;
+
+		if ((left < 0) || (left > job->toc->size - pos)) {
+			job->bad++;
+			continue;
+		}
+
+		while (left > 0) {
+			n = AL_MIN(left, F_AHEAD_SIZE);
+			if (toc_pread(job->f, pos, buf, n))
+				break;
+			crc = crc32c(crc, buf, n);
+			pos += n;
+			left -= n;
+		}
+
+		if ((left > 0) || (crc != entry->crc))
+			job->bad++;
+	}
+
+	_AL_FREE(buf);
+
+	return NULL;
+}
+
+
+
+/* toc_verify:
+ *  Checks the chunks of f with up to the given number of threads, and
+ *  returns how many of them are damaged, or -1 on error.
+ */
+static long toc_verify(PACKFILE *f, int threads)
+{
+	struct _al_packfile_toc *toc;
+	struct verify_job *job;
+	pthread_t *thread;
+	int *started;
+	long bad = 0;
+	int i, error = 0;
+
+	if ((toc = toc_get(f)) == NULL)
+		return -1;
+
+	if (!toc->checksums) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	threads = AL_MAX(1, AL_MIN(threads, toc->count));
+
+	job = _AL_MALLOC(threads * sizeof(*job));
+	thread = _AL_MALLOC(threads * sizeof(*thread));
+	started = _AL_MALLOC(threads * sizeof(*started));
+
+	if ((!job) || (!thread) || (!started)) {
+		if (job)
+			_AL_FREE(job);
+		if (thread)
+			_AL_FREE(thread);
+		if (started)
+			_AL_FREE(started);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i=0; i<threads; i++) {
+		job[i].f = f;
+		job[i].toc = toc;
+		job[i].first = i;
+		job[i].step = threads;
+		job[i].bad = 0;
+		job[i].error = 0;
+	}
+
+	/* the calling thread takes the first share, and any that fail to start */
+	for (i=1; i<threads; i++)
+		started[i] = (pthread_create(&thread[i], NULL, verify_thread, &job[i]) == 0);
+
+	verify_thread(&job[0]);
+
+	for (i=1; i<threads; i++) {
+		if (started[i])
+			pthread_join(thread[i], NULL);
+		else
+			verify_thread(&job[i]);
+	}
+
+	for (i=0; i<threads; i++) {
+		bad += job[i].bad;
+		if (job[i].error)
+			error = job[i].error;
+	}
+
+	_AL_FREE(job);
+	_AL_FREE(thread);
+	_AL_FREE(started);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return bad;
+}
+
+
+
+/***************************************************
+ ********************* ChaCha20 ********************
+ ***************************************************
+
+	Files opened with a key from packfile_key_create_chacha20() start
+	with F_CHACHA_MAGIC and a random 96-bit nonce, stored in the clear.
+	Every byte of the file is XORed with the ChaCha20 key stream at the
+	same position, block pos / 64 with the RFC 8439 32-bit block counter,
+	so the cipher works on whole buffers and any position can be reached
+	directly. The header is encrypted twice on the way out, leaving it
+	readable, so that positions in the file and in the key stream stay
+	the same everywhere. Four blocks are generated at once with SSE2.
+
+	The block counter wraps after CHACHA_LIMIT bytes, 256GB, which would
+	repeat the key stream under the same nonce. Reading, writing or
+	patching a file past that point fails with EFBIG instead.
+*/
+
+
+#define CHACHA_ROTL(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA_QUARTER(a, b, c, d)										\
+	a += b; d ^= a; d = CHACHA_ROTL(d, 16);								\
+	c += d; b ^= c; b = CHACHA_ROTL(b, 12);								\
+	a += b; d ^= a; d = CHACHA_ROTL(d, 8);								\
+	c += d; b ^= c; b = CHACHA_ROTL(b, 7)
+
+
+
+/* chacha20_setup:
+ *  Fills the initial state for a key, a nonce and a block counter.
+ */
+static void chacha20_setup(uint32_t *state, AL_CONST uint32_t *key,
+	AL_CONST unsigned char *nonce, uint32_t counter)
+{
+	int i;
+
+	state[0] = 0x61707865;				/* "expand 32-byte k" */
+	state[1] = 0x3320646E;
+	state[2] = 0x79622D32;
+	state[3] = 0x6B206574;
+
+	for (i=0; i<8; i++)
+		state[4 + i] = key[i];
+
+	state[12] = counter;
+
+	for (i=0; i<3; i++)
+		state[13 + i] = (uint32_t)nonce[i*4] | ((uint32_t)nonce[i*4+1] << 8) |
+			((uint32_t)nonce[i*4+2] << 16) | ((uint32_t)nonce[i*4+3] << 24);
+}
+
+
+
+/* chacha20_block:
+ *  Generates the 64 bytes of key stream for one block.
+ */
+static void chacha20_block(AL_CONST uint32_t *state, unsigned char *out)
+{
+	uint32_t x[16];
+	int i;
+
+	memcpy(x, state, sizeof(x));
+
+	for (i=0; i<10; i++) {
+		CHACHA_QUARTER(x[0], x[4], x[8], x[12]);
+		CHACHA_QUARTER(x[1], x[5], x[9], x[13]);
+		CHACHA_QUARTER(x[2], x[6], x[10], x[14]);
+		CHACHA_QUARTER(x[3], x[7], x[11], x[15]);
+		CHACHA_QUARTER(x[0], x[5], x[10], x[15]);
+		CHACHA_QUARTER(x[1], x[6], x[11], x[12]);
+		CHACHA_QUARTER(x[2], x[7], x[8], x[13]);
+		CHACHA_QUARTER(x[3], x[4], x[9], x[14]);
+	}
+
+	for (i=0; i<16; i++) {
+		x[i] += state[i];
+		out[i*4] = x[i];
+		out[i*4+1] = x[i] >> 8;
+		out[i*4+2] = x[i] >> 16;
+		out[i*4+3] = x[i] >> 24;
+	}
+}
+
+
+
+#ifdef __SSE2__
+
+#define CHACHA_ROTL4(v, n)	_mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define CHACHA_QUARTER4(a, b, c, d)										\
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL4(d, 16);	\
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL4(b, 12);	\
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL4(d, 8);	\
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL4(b, 7)
+
+
+
+/* chacha20_block4:
+ *  Generates the key stream for four consecutive blocks, 256 bytes, with
+ *  every SSE2 register holding the same word of the four blocks.
+ */
+static void chacha20_block4(AL_CONST uint32_t *state, unsigned char *out)
+{
+	__m128i x[16], s[16], t0, t1, t2, t3;
+	int i;
+
+	for (i=0; i<16; i++)
+		s[i] = _mm_set1_epi32(state[i]);
+	s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+
+	memcpy(x, s, sizeof(x));
+
+	for (i=0; i<10; i++) {
+		CHACHA_QUARTER4(x[0], x[4], x[8], x[12]);
+		CHACHA_QUARTER4(x[1], x[5], x[9], x[13]);
+		CHACHA_QUARTER4(x[2], x[6], x[10], x[14]);
+		CHACHA_QUARTER4(x[3], x[7], x[11], x[15]);
+		CHACHA_QUARTER4(x[0], x[5], x[10], x[15]);
+		CHACHA_QUARTER4(x[1], x[6], x[11], x[12]);
+		CHACHA_QUARTER4(x[2], x[7], x[8], x[13]);
+		CHACHA_QUARTER4(x[3], x[4], x[9], x[14]);
+	}
+
+	/* transpose groups of four words back into blocks */
+	for (i=0; i<16; i+=4) {
+		x[i] = _mm_add_epi32(x[i], s[i]);
+		x[i+1] = _mm_add_epi32(x[i+1], s[i+1]);
+		x[i+2] = _mm_add_epi32(x[i+2], s[i+2]);
+		x[i+3] = _mm_add_epi32(x[i+3], s[i+3]);
+
+		t0 = _mm_unpacklo_epi32(x[i], x[i+1]);
+		t1 = _mm_unpacklo_epi32(x[i+2], x[i+3]);
+		t2 = _mm_unpackhi_epi32(x[i], x[i+1]);
+		t3 = _mm_unpackhi_epi32(x[i+2], x[i+3]);
+
+		_mm_storeu_si128((__m128i *)(out + i*4), _mm_unpacklo_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)(out + 64 + i*4), _mm_unpackhi_epi64(t0, t1));
+		_mm_storeu_si128((__m128i *)(out + 128 + i*4), _mm_unpacklo_epi64(t2, t3));
+		_mm_storeu_si128((__m128i *)(out + 192 + i*4), _mm_unpackhi_epi64(t2, t3));
+	}
+}
+
+#endif
+
+
+
+/* chacha20_xor:
+ *  Encrypts or decrypts n bytes at p, found at position pos of the file.
+ */
+static void chacha20_xor(AL_CONST uint32_t *key, AL_CONST unsigned char *nonce, long pos,
+	unsigned char *p, long n)
+{
+	unsigned char stream[256];
+	uint32_t state[16];
+	long skip, c;
+	AL_ASSERT((int64_t)pos + n <= CHACHA_LIMIT);
+
+	chacha20_setup(state, key, nonce, (uint32_t)(pos / 64));
+	skip = pos % 64;
+
+	while (n > 0) {
+#ifdef __SSE2__
+		if (n + skip >= 256) {
+			chacha20_block4(state, stream);
+			state[12] += 4;
+			c = 256 - skip;
+		}
+		else
+#endif
+		{
+			chacha20_block(state, stream);
+			state[12]++;
+			c = 64 - skip;
+		}
+
+		c = AL_MIN(c, n);
+		xor_bytes(p, stream + skip, c);
+		p += c;
+		n -= c;
+		skip = 0;
+	}
+}
+
+
+
+/* chacha20_nonce:
+ *  Picks a random nonce. Returns zero on success.
+ */
+static int chacha20_nonce(unsigned char *nonce)
+{
+	return getentropy(nonce, 12) ? -1 : 0;
+}
+
+
+
+/* write_chacha20_header:
+ *  Writes the magic number and the nonce of f, which must be at its start.
+ */
+static void write_chacha20_header(PACKFILE *f)
+{
+	unsigned char header[CHACHA_HEADER];
+
+	header[0] = (F_CHACHA_MAGIC >> 24) & 0xFF;
+	header[1] = (F_CHACHA_MAGIC >> 16) & 0xFF;
+	header[2] = (F_CHACHA_MAGIC >> 8) & 0xFF;
+	header[3] = F_CHACHA_MAGIC & 0xFF;
+	memcpy(header + 4, f->normal.nonce, 12);
+
+	/* undo the encryption which is about to happen */
+	xor_password(f, 0, header, CHACHA_HEADER);
+	pack_fwrite(header, CHACHA_HEADER, f);
+}
+
+
+
+/* read_chacha20_header:
+ *  Reads the nonce of f, which must be at its start, and skips the header
+ *  without filling the buffer. Returns zero on success.
+ */
+static int read_chacha20_header(PACKFILE *f)
+{
+	unsigned char header[CHACHA_HEADER];
+
+	if ((raw_pread(f, 0, header, CHACHA_HEADER) < CHACHA_HEADER) ||
+		 (header[0] != ((F_CHACHA_MAGIC >> 24) & 0xFF)) ||
+		 (header[1] != ((F_CHACHA_MAGIC >> 16) & 0xFF)) ||
+		 (header[2] != ((F_CHACHA_MAGIC >> 8) & 0xFF)) ||
+		 (header[3] != (F_CHACHA_MAGIC & 0xFF)))
+		return -1;
+
+	memcpy(f->normal.nonce, header + 4, 12);
+
+	return pack_fseek(f, CHACHA_HEADER);
+}
+
+
+
+/***************************************************
+ ******************* Write-behind ******************
+ ***************************************************
+
+	Files opened for writing with the 'd' mode flag copy every full buffer
+	into a queue of WB_DEPTH slots. A thread takes them in order and does
+	the encryption, compression and writing with normal_write_buffer(),
+	which from then on is only called by that thread. When all the slots
+	are taken the producer waits. The last buffer is written synchronously
+	by pack_fclose() after the queue has been drained, so the errors of the
+	thread are always reported by a later flush or the close.
+*/
+
+
+#define WB_DEPTH		4
+
+
+struct _al_packfile_behind
+{
+	PACKFILE *f;
+	int head, count;					/* queued slots, in order */
+	int quit;
+	int error;							/* first errno of the thread */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int size[WB_DEPTH];
+	unsigned char data[WB_DEPTH][F_BUF_SIZE];
+};
+
+
+
+/* write_behind_thread:
+ *  Writes the queued slots until told to quit.
+ */
+static void *write_behind_thread(void *_b)
+{
+	struct _al_packfile_behind *b = _b;
+	int slot;
+
+	pthread_mutex_lock(&b->lock);
+
+	for (;;) {
+		while (!b->count && !b->quit)
+			pthread_cond_wait(&b->cond, &b->lock);
+
+		if (!b->count)
+			break;
+
+		slot = b->head;
+		pthread_mutex_unlock(&b->lock);
+
+		/* once something failed the rest of the stream is useless */
+		if (!b->error && normal_write_buffer(b->f, b->data[slot], b->size[slot], FALSE)) {
+			pthread_mutex_lock(&b->lock);
+			b->error = errno ? errno : EFAULT;
+		}
+		else {
+			pthread_mutex_lock(&b->lock);
+		}
+
+		b->head = (b->head + 1) % WB_DEPTH;
+		b->count--;
+		pthread_cond_broadcast(&b->cond);
+	}
+
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+
+
+/* start_write_behind:
+ *  Starts the writer thread of f. If that isn't possible the file simply
+ *  keeps writing synchronously.
  */
-int pack_fseek(PACKFILE *f, int offset)
+static void start_write_behind(PACKFILE *f)
 {
+	struct _al_packfile_behind *b;
 	AL_ASSERT(f);
-	AL_ASSERT(offset >= 0);
+	AL_ASSERT(f->is_normal_packfile);
+	AL_ASSERT(f->normal.flags & PACKFILE_FLAG_WRITE);
 
-	return f->vtable->pf_fseek(f->userdata, offset);
+	if ((b = _AL_MALLOC(sizeof(*b))) == NULL)
+		return;
+
+	b->f = f;
+	b->head = b->count = 0;
+	b->quit = FALSE;
+	b->error = 0;
+
+	if (pthread_mutex_init(&b->lock, NULL)) {
+		_AL_FREE(b);
+		return;
+	}
+
+	if (pthread_cond_init(&b->cond, NULL)) {
+		pthread_mutex_destroy(&b->lock);
+		_AL_FREE(b);
+		return;
+	}
+
+	if (pthread_create(&b->thread, NULL, write_behind_thread, b)) {
+		pthread_cond_destroy(&b->cond);
+		pthread_mutex_destroy(&b->lock);
+		_AL_FREE(b);
+		return;
+	}
+
+	f->normal.behind = b;
 }
 
 
-/** Skips a number of subchunks inside the file.
- * This is faster than opening and closing a subchunk as you find it on disk.
- * The function reads the hidden chunk size data and uses that to call
- * pack_fseek instead. Pass how many chunks you want to skip, usually one.
- *
- * \return Returns non zero on error, storing the code in errno.
+
+/* queue_write_behind:
+ *  Copies size bytes of buf into a free slot, waiting for one if needed.
+ *  Returns non zero if the thread has failed.
  */
-int pack_skip_chunks(PACKFILE *f, unsigned int num_chunks)
+static int queue_write_behind(struct _al_packfile_behind *b, AL_CONST unsigned char *buf, int size)
 {
-	if (!num_chunks)
-		return 0;
+	int slot, error;
+
+	pthread_mutex_lock(&b->lock);
+
+	while (b->count == WB_DEPTH && !b->error)
+		pthread_cond_wait(&b->cond, &b->lock);
+
+	if ((error = b->error) == 0 && size > 0) {
+		slot = (b->head + b->count) % WB_DEPTH;
+		memcpy(b->data[slot], buf, size);
+		b->size[slot] = size;
+		b->count++;
+		pthread_cond_broadcast(&b->cond);
+	}
+
+	pthread_mutex_unlock(&b->lock);
+
+	if (error) {
+		errno = error;
+		return EOF;
+	}
+
+	return 0;
+}
+
+
+
+/* drain_write_behind:
+ *  Waits for the queued slots to be written, leaving the thread running.
+ *  Returns non zero if the thread has failed.
+ */
+static int drain_write_behind(struct _al_packfile_behind *b)
+{
+	int error;
+
+	pthread_mutex_lock(&b->lock);
+
+	while (b->count && !b->error)
+		pthread_cond_wait(&b->cond, &b->lock);
+
+	error = b->error;
+	pthread_mutex_unlock(&b->lock);
+
+	if (error) {
+		errno = error;
+		return EOF;
+	}
+
+	return 0;
+}
+
+
+
+/* stop_write_behind:
+ *  Waits for the queued slots to be written and stops the thread, after
+ *  which the file writes synchronously again. Returns non zero if the
+ *  thread failed, storing its error in errno.
+ */
+static int stop_write_behind(PACKFILE *f)
+{
+	struct _al_packfile_behind *b = f->normal.behind;
+	int error;
+
+	pthread_mutex_lock(&b->lock);
+	b->quit = TRUE;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+
+	pthread_join(b->thread, NULL);
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->lock);
+
+	error = b->error;
+	_AL_FREE(b);
+	f->normal.behind = NULL;
+
+	if (error) {
+		errno = error;
+		return EOF;
+	}
+
+	return 0;
+}
+
+
+
+/***************************************************
+ ******************** Read-ahead *******************
+ ***************************************************
+
+	Files opened with the 's' or 'd' mode flags tell the operating system
+	that they are going to be read sequentially. With 'd' a thread also
+	reads the file in windows of F_AHEAD_SIZE bytes using pread(): while
+	the caller copies data out of the front window the thread fills the
+	back one, and both are swapped when the front one is exhausted.
+*/
+
+
+struct _al_ahead_window
+{
+	off_t offset;						/* file position of the data */
+	long size;							/* valid bytes, 0 at end of file */
+	unsigned char data[F_AHEAD_SIZE];
+};
+
+
+struct _al_packfile_readahead
+{
+	int hndl;
+	off_t pos;							/* position of the next raw_read() */
+	off_t hinted;						/* end of the last advised range */
+	int background;						/* is the thread running? */
+	int pending;						/* back window requested */
+	int quit;
+	int error;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct _al_ahead_window *front;
+	struct _al_ahead_window *back;
+	struct _al_ahead_window *windows;	/* both windows, one allocation */
+};
+
+
+
+/* advise_sequential:
+ *  Tells the system that hndl is going to be read from start to end.
+ */
+static void advise_sequential(int hndl)
+{
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(hndl, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(F_RDAHEAD)
+	fcntl(hndl, F_RDAHEAD, 1);
+#endif
+}
+
 
-	const int filesize = pack_mgetl(f);
-#ifdef DEBUG
-	const int datasize = pack_mgetl(f);
+
+/* advise_willneed:
+ *  Asks the system to start reading size bytes at offset into its cache.
+ */
+static void advise_willneed(int hndl, off_t offset, long size)
+{
+#if defined(POSIX_FADV_WILLNEED)
+	posix_fadvise(hndl, offset, size, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+	struct radvisory ra;
+	ra.ra_offset = offset;
+	ra.ra_count = size;
+	fcntl(hndl, F_RDADVISE, &ra);
 #else
-	pack_mgetl(f);
+	(void)hndl;
+	(void)offset;
+	(void)size;
 #endif
-	AL_ASSERT(filesize >= 0 && (datasize || !datasize));
+}
 
-	if (pack_fseek(f, filesize))
-		return 1;
 
-	if (num_chunks)
-		pack_skip_chunks(f, num_chunks - 1);
 
-	return 0;
+/* read_ahead_thread:
+ *  Reads back windows as they are requested by read_ahead_read().
+ */
+static void *read_ahead_thread(void *_a)
+{
+	struct _al_packfile_readahead *a = _a;
+	struct _al_ahead_window *w;
+	long sz, done;
+
+	pthread_mutex_lock(&a->lock);
+
+	for (;;) {
+		while (!a->pending && !a->quit)
+			pthread_cond_wait(&a->cond, &a->lock);
+
+		if (a->quit)
+			break;
+
+		w = a->back;
+		pthread_mutex_unlock(&a->lock);
+
+		done = 0;
+		do {
+			sz = pread(a->hndl, w->data + done, F_AHEAD_SIZE - done, w->offset + done);
+			if (sz > 0)
+				done += sz;
+		} while ((sz > 0 && done < F_AHEAD_SIZE) || (sz < 0 && errno == EINTR));
+
+		pthread_mutex_lock(&a->lock);
+		w->size = done;
+		if (sz < 0)
+			a->error = errno;
+		a->pending = FALSE;
+		pthread_cond_broadcast(&a->cond);
+	}
+
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
 }
 
-/**
- * Returns the next character from the stream f, or EOF if the end of the
- * file has been reached.
+
+
+/* raw_read_ahead:
+ *  Enables read-ahead for the file descriptor of f. If background is set
+ *  a thread is started to prefetch the data, if that fails the file still
+ *  gets the sequential access hints.
  */
-int pack_getc(PACKFILE *f)
+static void raw_read_ahead(PACKFILE *f, int background)
 {
+	struct _al_packfile_readahead *a;
 	AL_ASSERT(f);
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_getc);
+	AL_ASSERT(f->is_normal_packfile);
+	AL_ASSERT(!f->normal.parent);
+
+	if ((f->normal.flags & PACKFILE_FLAG_MEMORY) || f->normal.ahead)
+		return;
+
+	if ((a = _AL_MALLOC(sizeof(*a))) == NULL)
+		return;
+
+	a->hndl = f->normal.hndl;
+	a->pos = lseek(a->hndl, 0, SEEK_CUR);
+	a->hinted = a->pos;
+	a->background = FALSE;
+	a->windows = NULL;
+
+	advise_sequential(a->hndl);
+
+	if (background && (a->windows = _AL_MALLOC_ATOMIC(2 * sizeof(*a->windows))) != NULL) {
+		a->pending = TRUE;
+		a->quit = FALSE;
+		a->error = 0;
+		a->front = &a->windows[0];
+		a->back = &a->windows[1];
+		a->front->offset = a->pos;
+		a->front->size = 0;
+		a->back->offset = a->pos;
+		a->back->size = 0;
+
+		if (!pthread_mutex_init(&a->lock, NULL)) {
+			if (!pthread_cond_init(&a->cond, NULL)) {
+				if (!pthread_create(&a->thread, NULL, read_ahead_thread, a))
+					a->background = TRUE;
+				else
+					pthread_cond_destroy(&a->cond);
+			}
+			if (!a->background)
+				pthread_mutex_destroy(&a->lock);
+		}
 
-	return f->vtable->pf_getc(f->userdata);
+		if (!a->background) {
+			_AL_FREE(a->windows);
+			a->windows = NULL;
+		}
+	}
+
+	f->normal.ahead = a;
 }
 
 
 
-/**
- * Puts a character in the stream f.
+/* raw_read_at:
+ *  Makes f read its descriptor with pread() from pos on, like read-ahead
+ *  without the thread, so that the file position is left alone for other
+ *  handles sharing the descriptor. Returns zero on success.
  */
-int pack_putc(int c, PACKFILE *f)
+static int raw_read_at(PACKFILE *f, off_t pos)
 {
-	AL_ASSERT(f);
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_putc);
+	struct _al_packfile_readahead *a;
+	AL_ASSERT(!f->normal.ahead);
 
-	return f->vtable->pf_putc(c, f->userdata);
+	if ((a = _AL_MALLOC(sizeof(*a))) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	a->hndl = f->normal.hndl;
+	a->pos = pos;
+	a->hinted = pos;
+	a->background = FALSE;
+	a->windows = NULL;
+
+	f->normal.ahead = a;
+	return 0;
 }
 
 
 
-/** Returns nonzero as soon as you reach the end of the file.
- * It does not wait for you to attempt to read beyond the end of
- * the file, contrary to the ISO C feof() function. The only way to
- * know whether you have read beyond the end of the file is to check
- * the return value of the read operation you use (and be wary of
- * pack_*getl() as EOF is also a valid return value with these functions).
- *
- * \return Returns non-zero if you are at the end of the file, zero otherwise.
+/* read_ahead_read:
+ *  raw_read() for files with read-ahead. Returns the number of bytes read.
  */
-int pack_feof(PACKFILE *f)
+static long read_ahead_read(struct _al_packfile_readahead *a, unsigned char *p, long n)
 {
-	AL_ASSERT(f);
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_feof);
+	struct _al_ahead_window *w;
+	long done = 0, c;
+	int err = 0;
+
+	if (!a->background) {
+		/* keep the system one window ahead of us */
+		if (a->pos + n + F_AHEAD_SIZE/2 > a->hinted) {
+			a->hinted = AL_MAX(a->hinted, a->pos);
+			advise_willneed(a->hndl, a->hinted, F_AHEAD_SIZE);
+			a->hinted += F_AHEAD_SIZE;
+		}
 
-	return f->vtable->pf_feof(f->userdata);
+		while (done < n) {
+			c = pread(a->hndl, p + done, n - done, a->pos + done);
+			if (c > 0)
+				done += c;
+			else if (c == 0 || errno != EINTR)
+				break;
+		}
+		a->pos += done;
+		return done;
+	}
+
+	while (done < n) {
+		w = a->front;
+
+		if (a->pos < w->offset || a->pos >= w->offset + w->size) {
+			/* the front window is used up, swap in the back one */
+			pthread_mutex_lock(&a->lock);
+
+			while (a->pending)
+				pthread_cond_wait(&a->cond, &a->lock);
+
+			if (a->back->offset != a->pos) {
+				/* somebody skipped data, read the right window */
+				a->back->offset = a->pos;
+				a->pending = TRUE;
+				pthread_cond_broadcast(&a->cond);
+				while (a->pending)
+					pthread_cond_wait(&a->cond, &a->lock);
+			}
+
+			w = a->back;
+			a->back = a->front;
+			a->front = w;
+
+			if (w->size > 0) {
+				a->back->offset = w->offset + w->size;
+				a->pending = TRUE;
+				pthread_cond_broadcast(&a->cond);
+			}
+
+			err = a->error;
+			pthread_mutex_unlock(&a->lock);
+
+			if (w->size <= 0)
+				break;
+		}
+
+		c = AL_MIN(n - done, w->offset + w->size - a->pos);
+		memcpy(p + done, w->data + (a->pos - w->offset), c);
+		done += c;
+		a->pos += c;
+	}
+
+	if (done < n && err)
+		errno = err;
+
+	return done;
 }
 
 
 
-/**Tells if an error occurred during an operation on the stream.
- * Since EOF is used to report errors by some functions, it's often
- * better to use the pack_feof() function to check explicitly for end
- * of file and pack_ferror() to check for errors. Both functions check
- * indicators that are part of the internal state of the stream to
- * detect correctly the different situations.
- *
- * \return Returns nonzero if the error indicator for the stream
- * is set, meaning that an error has occurred during a previous
- * operation on the stream.
+/* destroy_read_ahead:
+ *  Stops the read-ahead thread and frees its buffers.
  */
-int pack_ferror(PACKFILE *f)
+static void destroy_read_ahead(struct _al_packfile_readahead *a)
 {
-	AL_ASSERT(f);
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_ferror);
+	if (a->background) {
+		pthread_mutex_lock(&a->lock);
+		a->quit = TRUE;
+		pthread_cond_broadcast(&a->cond);
+		pthread_mutex_unlock(&a->lock);
+
+		pthread_join(a->thread, NULL);
+		pthread_cond_destroy(&a->cond);
+		pthread_mutex_destroy(&a->lock);
+		_AL_FREE(a->windows);
+	}
+
+	_AL_FREE(a);
+}
+
+
+
+/***************************************************
+ ********************* io_uring ********************
+ ***************************************************
+
+	Files opened with the 'u' mode flag move their data through a small
+	io_uring instance driven with raw system calls. The file is split in
+	URING_DEPTH windows of F_AHEAD_SIZE bytes which are used as a ring:
+	reads keep all of them in flight ahead of the caller, writes fill one
+	window while the previous ones are being written.
+*/
+
+
+#define URING_DEPTH		4
+
+
+#ifdef ALLEGRO_HAVE_IO_URING
+
+struct _al_uring_window
+{
+	off_t offset;						/* file position of the window */
+	long size;							/* bytes to transfer */
+	long result;						/* bytes transferred or -errno */
+	int busy;							/* submitted but not completed */
+	unsigned char *data;
+};
+
+
+struct _al_packfile_uring
+{
+	int hndl;
+	int ring;							/* io_uring file descriptor */
+	int write;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_size, cq_map_size, sqes_size;
+	int to_submit;						/* prepared entries */
+	off_t pos;							/* position of the caller */
+	off_t next;							/* reads: offset of the next window */
+	int head, count;					/* windows in flight, in file order */
+	long fill;							/* writes: bytes in the current window */
+	int error;							/* first asynchronous write error */
+	struct _al_uring_window win[URING_DEPTH];
+	unsigned char *data;
+};
+
+
+
+/* uring_enter:
+ *  Submits the prepared entries and optionally waits for completions.
+ */
+static int uring_enter(struct _al_packfile_uring *u, unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, u->ring, u->to_submit, min_complete,
+			min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret > 0)
+		u->to_submit -= AL_MIN(ret, u->to_submit);
+
+	return ret;
+}
+
+
+
+/* uring_prep:
+ *  Queues the transfer of window w, which isn't submitted yet.
+ */
+static void uring_prep(struct _al_packfile_uring *u, struct _al_uring_window *w)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = u->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = u->hndl;
+	sqe->off = w->offset;
+	sqe->addr = (unsigned long)w->data;
+	sqe->len = w->size;
+	sqe->user_data = w - u->win;
+
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	w->busy = TRUE;
+	u->to_submit++;
+}
+
+
+
+/* uring_reap:
+ *  Marks the windows of all the available completions as done. Writes
+ *  which were cut short are finished synchronously.
+ */
+static void uring_reap(struct _al_packfile_uring *u)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	struct _al_uring_window *w;
+	long sz;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		w = &u->win[cqe->user_data];
+		w->result = cqe->res;
+		w->busy = FALSE;
+
+		if (u->write) {
+			while (w->result >= 0 && w->result < w->size) {
+				sz = pwrite(u->hndl, w->data + w->result, w->size - w->result,
+					w->offset + w->result);
+				if (sz > 0)
+					w->result += sz;
+				else if (sz == 0 || errno != EINTR)
+					w->result = sz ? -errno : -EIO;
+			}
+			if (w->result < 0 && !u->error)
+				u->error = -w->result;
+		}
+		head++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+
+/* uring_wait:
+ *  Waits until window w has been transferred, or all windows if w is NULL.
+ */
+static void uring_wait(struct _al_packfile_uring *u, struct _al_uring_window *w)
+{
+	int i;
+
+	for (;;) {
+		uring_reap(u);
+
+		if (w) {
+			if (!w->busy)
+				return;
+		}
+		else {
+			for (i=0; i<URING_DEPTH; i++)
+				if (u->win[i].busy)
+					break;
+			if (i == URING_DEPTH)
+				return;
+		}
+
+		if (uring_enter(u, 1) < 0) {
+			/* the ring is unusable, give up on the outstanding windows */
+			for (i=0; i<URING_DEPTH; i++) {
+				if (u->win[i].busy) {
+					u->win[i].busy = FALSE;
+					u->win[i].result = -errno;
+					if (u->write && !u->error)
+						u->error = errno;
+				}
+			}
+			return;
+		}
+	}
+}
+
+
+
+/* destroy_uring:
+ *  Tears down the ring and frees the windows.
+ */
+static void destroy_uring(struct _al_packfile_uring *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_map && u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_map_size);
+	if (u->sq_map)
+		munmap(u->sq_map, u->sq_map_size);
+	if (u->ring >= 0)
+		close(u->ring);
+	if (u->data)
+		_AL_FREE(u->data);
+	_AL_FREE(u);
+}
+
+
+
+/* create_uring:
+ *  Sets up an io_uring instance for hndl. Returns NULL if the kernel
+ *  doesn't support it or lets us use it.
+ */
+static struct _al_packfile_uring *create_uring(int hndl, int write)
+{
+	struct _al_packfile_uring *u;
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	int i;
 
-	return f->vtable->pf_ferror(f->userdata);
-}
+	if ((u = _AL_MALLOC(sizeof(*u))) == NULL)
+		return NULL;
 
+	memset(u, 0, sizeof(*u));
+	u->hndl = hndl;
+	u->write = write;
+	u->pos = lseek(hndl, 0, SEEK_CUR);
+	u->next = u->pos;
+
+	memset(&p, 0, sizeof(p));
+	u->ring = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+	if (u->ring < 0)
+		goto Error;
+
+	u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->sq_map_size = u->cq_map_size = AL_MAX(u->sq_map_size, u->cq_map_size);
+
+	u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED) {
+		u->sq_map = NULL;
+		goto Error;
+	}
 
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_map = u->sq_map;
+	}
+	else {
+		u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED) {
+			u->cq_map = NULL;
+			goto Error;
+		}
+	}
 
-/**
- * Reads a 16 bit word from a file, using intel byte ordering.
- */
-int pack_igetw(PACKFILE *f)
-{
-	int b1, b2;
-	AL_ASSERT(f);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->ring, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto Error;
+	}
 
-	if ((b1 = pack_getc(f)) != EOF)
-		if ((b2 = pack_getc(f)) != EOF)
-			return ((b2 << 8) | b1);
+	sq = u->sq_map;
+	cq = u->cq_map;
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
 
-	return EOF;
+	if ((u->data = _AL_MALLOC_ATOMIC(URING_DEPTH * F_AHEAD_SIZE)) == NULL)
+		goto Error;
+
+	for (i=0; i<URING_DEPTH; i++)
+		u->win[i].data = u->data + i * F_AHEAD_SIZE;
+
+	return u;
+
+Error:
+	destroy_uring(u);
+	return NULL;
 }
 
 
 
-/**
- *  Reads a 32 bit long from a file, using intel byte ordering.
+/* uring_read:
+ *  raw_read() for io_uring files. Returns the number of bytes read.
  */
-long pack_igetl(PACKFILE *f)
+static long uring_read(struct _al_packfile_uring *u, unsigned char *p, long n)
 {
-	int b1, b2, b3, b4;
-	AL_ASSERT(f);
+	struct _al_uring_window *w;
+	long done = 0, c, end;
+
+	while (done < n) {
+		if (!u->count || u->pos < u->win[u->head].offset || u->pos >= u->next) {
+			/* first read or a seek outside the windows, start over */
+			uring_wait(u, NULL);
+			u->head = u->count = 0;
+			u->next = u->pos;
+		}
 
-	if ((b1 = pack_getc(f)) != EOF)
-		if ((b2 = pack_getc(f)) != EOF)
-			if ((b3 = pack_getc(f)) != EOF)
-				if ((b4 = pack_getc(f)) != EOF)
-					return (((long)b4 << 24) | ((long)b3 << 16) |
-							  ((long)b2 << 8) | (long)b1);
+		if (u->count < URING_DEPTH) {
+			while (u->count < URING_DEPTH) {
+				w = &u->win[(u->head + u->count) % URING_DEPTH];
+				w->offset = u->next;
+				w->size = F_AHEAD_SIZE;
+				uring_prep(u, w);
+				u->next += F_AHEAD_SIZE;
+				u->count++;
+			}
+			uring_enter(u, 0);
+		}
 
-	return EOF;
+		w = &u->win[u->head];
+		uring_wait(u, w);
+
+		end = w->offset + AL_MAX(w->result, 0);
+		if (u->pos < end) {
+			c = AL_MIN(n - done, end - u->pos);
+			memcpy(p + done, w->data + (u->pos - w->offset), c);
+			done += c;
+			u->pos += c;
+		}
+		else if (w->result < F_AHEAD_SIZE) {
+			/* end of file or error */
+			if (w->result < 0)
+				errno = -w->result;
+			break;
+		}
+		else {
+			u->head = (u->head + 1) % URING_DEPTH;
+			u->count--;
+		}
+	}
+
+	return done;
 }
 
 
 
-/**
- *  Writes a 16 bit int to a file, using intel byte ordering.
+/* uring_write:
+ *  raw_write() for io_uring files. The data is copied to the current
+ *  window and the window is submitted once it is full.
  */
-int pack_iputw(int w, PACKFILE *f)
+static long uring_write(struct _al_packfile_uring *u, AL_CONST unsigned char *p, long n)
 {
-	int b1, b2;
-	AL_ASSERT(f);
+	struct _al_uring_window *w;
+	long done = 0, c;
 
-	b1 = (w & 0xFF00) >> 8;
-	b2 = w & 0x00FF;
+	while (done < n) {
+		if (u->error) {
+			errno = u->error;
+			break;
+		}
 
-	if (pack_putc(b2,f)==b2)
-		if (pack_putc(b1,f)==b1)
-			return w;
+		w = &u->win[(u->head + u->count) % URING_DEPTH];
+		c = AL_MIN(n - done, F_AHEAD_SIZE - u->fill);
+		memcpy(w->data + u->fill, p + done, c);
+		u->fill += c;
+		done += c;
+
+		if (u->fill == F_AHEAD_SIZE) {
+			w->offset = u->pos;
+			w->size = u->fill;
+			uring_prep(u, w);
+			uring_enter(u, 0);
+			u->pos += u->fill;
+			u->fill = 0;
+
+			if (++u->count == URING_DEPTH) {
+				/* all windows busy, wait for the oldest one */
+				uring_wait(u, &u->win[u->head]);
+				u->head = (u->head + 1) % URING_DEPTH;
+				u->count--;
+			}
+		}
+	}
 
-	return EOF;
+	return done;
 }
 
 
 
-/**
- *  Writes a 32 bit long to a file, using intel byte ordering.
+/* uring_patch:
+ *  raw_patch() for io_uring files. Bytes which are still in the current
+ *  window are patched there, the others with pwrite() once nothing is in
+ *  flight.
  */
-long pack_iputl(long l, PACKFILE *f)
+static int uring_patch(struct _al_packfile_uring *u, off_t offset, AL_CONST unsigned char *p, long n)
 {
-	int b1, b2, b3, b4;
-	AL_ASSERT(f);
+	long c;
 
-	b1 = (int)((l & 0xFF000000L) >> 24);
-	b2 = (int)((l & 0x00FF0000L) >> 16);
-	b3 = (int)((l & 0x0000FF00L) >> 8);
-	b4 = (int)l & 0x00FF;
+	uring_wait(u, NULL);
 
-	if (pack_putc(b4,f)==b4)
-		if (pack_putc(b3,f)==b3)
-			if (pack_putc(b2,f)==b2)
-				if (pack_putc(b1,f)==b1)
-					return l;
+	if (offset < u->pos) {
+		c = AL_MIN(n, u->pos - offset);
+		if (raw_pwrite(u->hndl, p, c, offset))
+			return -1;
+		offset += c;
+		p += c;
+		n -= c;
+	}
 
-	return EOF;
+	if (n > 0) {
+		AL_ASSERT(offset - u->pos + n <= u->fill);
+		memcpy(u->win[(u->head + u->count) % URING_DEPTH].data + (offset - u->pos), p, n);
+	}
+
+	if (u->error) {
+		errno = u->error;
+		return -1;
+	}
+
+	return 0;
 }
 
 
 
-/**
- *  Reads a 16 bit int from a file, using motorola byte-ordering.
+/* uring_close:
+ *  Writes the last window and waits for all transfers. Returns zero on
+ *  success, otherwise stores the first write error in errno.
  */
-int pack_mgetw(PACKFILE *f)
+static int uring_close(struct _al_packfile_uring *u)
 {
-	int b1, b2;
-	AL_ASSERT(f);
+	int error;
+
+	if (u->write && u->fill > 0 && !u->error) {
+		struct _al_uring_window *w = &u->win[(u->head + u->count) % URING_DEPTH];
+		w->offset = u->pos;
+		w->size = u->fill;
+		uring_prep(u, w);
+		u->pos += u->fill;
+		u->fill = 0;
+	}
 
-	if ((b1 = pack_getc(f)) != EOF)
-		if ((b2 = pack_getc(f)) != EOF)
-			return ((b1 << 8) | b2);
+	if (u->to_submit)
+		uring_enter(u, 0);
+	uring_wait(u, NULL);
 
-	return EOF;
+	error = u->error;
+	destroy_uring(u);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
 }
 
+#endif
+
 
 
-/**
- * Reads a 32 bit long from a file, using motorola byte-ordering.
+/* raw_setup_io:
+ *  Applies the I/O strategies requested with the mode flags to the file
+ *  descriptor at the bottom of a chain of packfiles.
  */
-long pack_mgetl(PACKFILE *f)
+static void raw_setup_io(PACKFILE *f, int io)
 {
-	int b1, b2, b3, b4;
 	AL_ASSERT(f);
+	AL_ASSERT(f->is_normal_packfile);
 
-	if ((b1 = pack_getc(f)) != EOF)
-		if ((b2 = pack_getc(f)) != EOF)
-			if ((b3 = pack_getc(f)) != EOF)
-				if ((b4 = pack_getc(f)) != EOF)
-					return (((long)b1 << 24) | ((long)b2 << 16) |
-							  ((long)b3 << 8) | (long)b4);
+	if (!io || (f->normal.flags & PACKFILE_FLAG_MEMORY))
+		return;
 
-	return EOF;
+#ifdef ALLEGRO_HAVE_IO_URING
+	if (io & IO_URING) {
+		f->normal.uring = create_uring(f->normal.hndl,
+			f->normal.flags & PACKFILE_FLAG_WRITE);
+		if (f->normal.uring)
+			return;
+	}
+#endif
+
+	if ((io & (IO_SEQUENTIAL | IO_BACKGROUND)) && !(f->normal.flags & PACKFILE_FLAG_WRITE))
+		raw_read_ahead(f, io & IO_BACKGROUND);
 }
 
 
 
-/**
- *  Writes a 16 bit int to a file, using motorola byte-ordering.
- */
-int pack_mputw(int w, PACKFILE *f)
-{
-	int b1, b2;
-	AL_ASSERT(f);
+/***************************************************
+ ****************** Shared readers *****************
+ ***************************************************
 
-	b1 = (w & 0xFF00) >> 8;
-	b2 = w & 0x00FF;
+	Handles opened with pack_fdup_reader() share the file descriptor and
+	the chunk table of the original file. Whichever handle is closed last
+	releases them.
+*/
 
-	if (pack_putc(b1,f)==b1)
-		if (pack_putc(b2,f)==b2)
-			return w;
 
-	return EOF;
-}
+struct _al_packfile_shared
+{
+	pthread_mutex_t lock;
+	int refs;							/* handles using the descriptor */
+	struct _al_packfile_toc *toc;		/* table of the original file */
+};
 
 
 
-/**
- *  Writes a 32 bit long to a file, using motorola byte-ordering.
+/* share_packfile:
+ *  Makes dup use the descriptor and the table of f. Returns zero on
+ *  success.
  */
-long pack_mputl(long l, PACKFILE *f)
+static int share_packfile(PACKFILE *f, PACKFILE *dup)
 {
-	int b1, b2, b3, b4;
-	AL_ASSERT(f);
+	struct _al_packfile_shared *s = f->normal.shared;
 
-	b1 = (int)((l & 0xFF000000L) >> 24);
-	b2 = (int)((l & 0x00FF0000L) >> 16);
-	b3 = (int)((l & 0x0000FF00L) >> 8);
-	b4 = (int)l & 0x00FF;
+	if (!s) {
+		if ((s = _AL_MALLOC(sizeof(*s))) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
 
-	if (pack_putc(b1,f)==b1)
-		if (pack_putc(b2,f)==b2)
-			if (pack_putc(b3,f)==b3)
-				if (pack_putc(b4,f)==b4)
-					return l;
+		if (pthread_mutex_init(&s->lock, NULL)) {
+			_AL_FREE(s);
+			errno = ENOMEM;
+			return -1;
+		}
 
-	return EOF;
+		s->refs = 1;
+		s->toc = f->normal.toc;
+		f->normal.shared = s;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->refs++;
+	pthread_mutex_unlock(&s->lock);
+
+	dup->normal.shared = s;
+	dup->normal.toc = s->toc;
+
+	return 0;
 }
 
 
 
-/** Reads n bytes from f and stores them at memory location p.
- * Example:
- * \code
- *	unsigned char buf[256];
- *	...
- *	if (256 != pack_fread(buf, 256, input_file))
- *		abort_on_error("Truncated input file!");
- * \endcode
- *
- * \return Returns the number of bytes read, which will be less
- * than `n' if EOF is reached or an error occurs. Error codes are
- * stored in errno.
+/* release_shared:
+ *  Stops f from sharing its descriptor. Returns TRUE if it was the last
+ *  handle, which has to close the descriptor.
  */
-long pack_fread(void *p, long n, PACKFILE *f)
+static int release_shared(PACKFILE *f)
 {
-	AL_ASSERT(f);
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_fread);
-	AL_ASSERT(p);
-	AL_ASSERT(n >= 0);
+	struct _al_packfile_shared *s = f->normal.shared;
+	int refs;
 
-	return f->vtable->pf_fread(p, n, f->userdata);
-}
+	pthread_mutex_lock(&s->lock);
+	refs = --s->refs;
+	pthread_mutex_unlock(&s->lock);
 
+	f->normal.shared = NULL;
 
+	if (refs > 0)
+		return FALSE;
 
-/**
- *  Writes n bytes to the file f from memory location p.
- *
- *  \return Returns the number
- *  of items written, which will be less than n if an error occurs. Error
- *  codes are stored in errno.
- */
-long pack_fwrite(const void *p, long n, PACKFILE *f)
-{
-	AL_ASSERT(f);
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_fwrite);
-	AL_ASSERT(p);
-	AL_ASSERT(n >= 0);
+	pthread_mutex_destroy(&s->lock);
+	if (s->toc)
+		destroy_toc(s->toc);
+	_AL_FREE(s);
 
-	return f->vtable->pf_fwrite(p, n, f->userdata);
+	return TRUE;
 }
 
 
 
-/** Moves one single character back to the input buffer.
- * Like with ungetc from libc, only a single push back is guaranteed.
- *
- * Note: pack_fgets internally uses pack_ungetc(), so never use
- * pack_ungetc() directly after using pack_fgets() on a PACKFILE.
- *
- * \return Returns c on success, or EOF on error.
+/* toc_shared:
+ *  Tells whether the table of f belongs to all the handles sharing it.
  */
-int pack_ungetc(int c, PACKFILE *f)
+static int toc_shared(PACKFILE *f)
 {
-	AL_ASSERT(f);
-	AL_ASSERT(f->vtable);
-	AL_ASSERT(f->vtable->pf_ungetc);
-
-	return f->vtable->pf_ungetc(c, f->userdata);
+	return (f->normal.shared) && (f->normal.toc == f->normal.shared->toc);
 }
 
 
 
-
 /***************************************************
- ************ "Normal" packfile vtable *************
+ ***************** Raw file access *****************
  ***************************************************
 
-	Ideally this would be the only section which knows about the details
-	of "normal" packfiles. However, this ideal is still being violated in
-	many places (partly due to the API, and partly because it would be
-	quite a lot of work to move the _al_normal_packfile_details field
-	into the userdata field of the PACKFILE structure.
+	The bottom of every chain of "normal" packfiles reads and writes its
+	bytes either through a file descriptor or a memory block. These helpers
+	hide the difference from the buffering code above.
 */
 
 
-static int normal_fclose(void *_f);
-static int normal_getc(void *_f);
-static int normal_ungetc(int ch, void *_f);
-static int normal_putc(int c, void *_f);
-static long normal_fread(void *p, long n, void *_f);
-static long normal_fwrite(AL_CONST void *p, long n, void *_f);
-static int normal_fseek(void *_f, int offset);
-static int normal_feof(void *_f);
-static int normal_ferror(void *_f);
+/* raw_attach:
+ *  Makes f read from or write to the file descriptor fd, or the memory
+ *  block mem if it is not NULL.
+ */
+static void raw_attach(PACKFILE *f, int fd, AL_CONST struct _al_packfile_memory *mem)
+{
+	AL_ASSERT(f);
+	AL_ASSERT(f->is_normal_packfile);
 
-static int normal_refill_buffer(PACKFILE *f);
-static int normal_flush_buffer(PACKFILE *f, int last);
+	if (mem) {
+		f->normal.mem = *mem;
+		f->normal.mem.pos = 0;
+		f->normal.hndl = -1;
+		f->normal.flags |= PACKFILE_FLAG_MEMORY;
+	}
+	else {
+		f->normal.hndl = fd;
+	}
+}
 
 
 
-static PACKFILE_VTABLE normal_vtable =
+/* raw_publish:
+ *  Tells the owner of a growable memory block where it is and how big.
+ */
+static void raw_publish(PACKFILE *f)
 {
-	normal_fclose,
-	normal_getc,
-	normal_ungetc,
-	normal_fread,
-	normal_putc,
-	normal_fwrite,
-	normal_fseek,
-	normal_feof,
-	normal_ferror
-};
+	if (f->normal.mem.out) {
+		*f->normal.mem.out = f->normal.mem.data;
+		*f->normal.mem.out_size = f->normal.mem.size;
+	}
+}
 
 
 
-static int normal_fclose(void *_f)
+/* raw_vectored:
+ *  Tells whether f is a plain file descriptor whose bytes go to the disk
+ *  unchanged, so that readv() and writev() can replace its buffer.
+ */
+static int raw_vectored(PACKFILE *f)
 {
-	PACKFILE *f = _f;
-	int ret;
-
-	if (f->normal.flags & PACKFILE_FLAG_WRITE) {
-		if (f->normal.flags & PACKFILE_FLAG_CHUNK) {
-			f = pack_fclose_chunk(_f);
-			if (!f)
-				return -1;
+	if ((!f->is_normal_packfile) || (f->normal.parent) || (f->normal.hndl < 0) ||
+		 (f->normal.passpos) || (f->normal.ahead) || (f->normal.uring) ||
+		 (f->normal.behind) || (f->normal.shared))
+		return FALSE;
+
+	return !(f->normal.flags & (PACKFILE_FLAG_PACK | PACKFILE_FLAG_OLD_CRYPT |
+		PACKFILE_FLAG_MEMORY | PACKFILE_FLAG_CHECKSUM | PACKFILE_FLAG_INPLACE |
+		PACKFILE_FLAG_EOF | PACKFILE_FLAG_ERROR));
+}
 
-			return pack_fclose(f);
-		}
 
-		normal_flush_buffer(f, TRUE);
-	}
 
-	if (f->normal.parent) {
-		ret = pack_fclose(f->normal.parent);
-	}
-	else {
-		ret = close(f->normal.hndl);
-	}
+/* raw_iov:
+ *  Reads or writes the iovcnt blocks of iov with readv() or writev(),
+ *  skipping the first skip bytes of the first one. The buffer of f must be
+ *  empty. Reads stop at the end of the file. Returns the number of bytes
+ *  transferred.
+ */
+static long raw_iov(PACKFILE *f, AL_CONST struct iovec *iov, int iovcnt, long skip, int write)
+{
+	struct iovec v[IOV_BATCH];
+	long done = 0, want, sz;
+	int i, n;
+
+	while (iovcnt > 0) {
+		/* copy a batch, trimmed to what is left of the file when reading */
+		want = write ? LONG_MAX : f->normal.todo;
+		for (n=0; (n < IOV_BATCH) && (n < iovcnt) && (want > 0); n++) {
+			v[n].iov_base = (unsigned char *)iov[n].iov_base + (n ? 0 : skip);
+			v[n].iov_len = AL_MIN((long)iov[n].iov_len - (n ? 0 : skip), want);
+			want -= v[n].iov_len;
+		}
+		if (n == 0)
+			break;
 
-	if (f->normal.pack_data) {
-		free_lzss_pack_data(f->normal.pack_data);
-		f->normal.pack_data = NULL;
-	}
+		errno = 0;
+		sz = write ? writev(f->normal.hndl, v, n) : readv(f->normal.hndl, v, n);
+		if (sz < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN))
+				continue;
+			f->normal.flags |= PACKFILE_FLAG_ERROR;
+			break;
+		}
+		if (sz == 0)
+			break;
 
-	if (f->normal.unpack_data) {
-		free_lzss_unpack_data(f->normal.unpack_data);
-		f->normal.unpack_data = NULL;
+		done += sz;
+		f->normal.pos += sz;
+		if (write)
+			f->normal.todo += sz;
+		else
+			f->normal.todo -= sz;
+
+		/* step over the blocks done, resuming inside a partial one */
+		for (i=0; (i < n) && (sz >= (long)v[i].iov_len); i++)
+			sz -= v[i].iov_len;
+		skip = (i ? 0 : skip) + sz;
+		iov += i;
+		iovcnt -= i;
+		if ((iovcnt > 0) && (skip == (long)iov[0].iov_len)) {
+			iov++;
+			iovcnt--;
+			skip = 0;
+		}
 	}
 
-	if (f->normal.passdata) {
-		_AL_FREE(f->normal.passdata);
-		f->normal.passdata = NULL;
-		f->normal.passpos = NULL;
-	}
+	if ((!write) && normal_no_more_input(f))
+		f->normal.flags |= PACKFILE_FLAG_EOF;
 
-	return ret;
+	return done;
 }
 
 
 
-/* normal_no_more_input:
- *  Return non-zero if the number of bytes remaining in the file (todo) is
- *  less than or equal to zero.
- *
- *  However, there is a special case.	If we are reading from a LZSS
- *  compressed file, the latest call to lzss_read() may have suspended while
- *  writing out a sequence of bytes due to the output buffer being too small.
- *  In that case the `todo' count would be decremented (possibly to zero),
- *  but the output isn't yet completely written out.
+/* raw_read:
+ *  Reads n bytes into p. Returns the number of bytes read, which is less
+ *  than n only on errors or when a memory block runs out of data.
  */
-static INLINE int normal_no_more_input(PACKFILE *f)
+static long raw_read(PACKFILE *f, unsigned char *p, long n)
 {
-	/* see normal_refill_buffer() to see when lzss_read() is called */
-	if (f->normal.parent && (f->normal.flags & PACKFILE_FLAG_PACK) &&
-		 _al_lzss_incomplete_state(f->normal.unpack_data))
-		return 0;
+	long sz, done, offset;
+
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY) {
+		n = AL_MIN(n, f->normal.mem.size - f->normal.mem.pos);
+		if (n <= 0)
+			return 0;
+		memcpy(p, f->normal.mem.data + f->normal.mem.pos, n);
+		f->normal.mem.pos += n;
+		return n;
+	}
 
-	return (f->normal.todo <= 0);
-}
+#ifdef ALLEGRO_HAVE_IO_URING
+	if (f->normal.uring)
+		return uring_read(f->normal.uring, p, n);
+#endif
 
+	if (f->normal.ahead)
+		return read_ahead_read(f->normal.ahead, p, n);
 
+	offset = lseek(f->normal.hndl, 0, SEEK_CUR);
+	done = 0;
 
-static int normal_getc(void *_f)
-{
-	PACKFILE *f = _f;
+	errno = 0;
+	sz = read(f->normal.hndl, p, n);
 
-	f->normal.buf_size--;
-	if (f->normal.buf_size > 0)
-		return *(f->normal.buf_pos++);
+	while (sz+done < n) {
+		if ((sz < 0) && ((errno != EINTR) && (errno != EAGAIN)))
+			return done;
 
-	if (f->normal.buf_size == 0) {
-		if (normal_no_more_input(f))
-			f->normal.flags |= PACKFILE_FLAG_EOF;
-		return *(f->normal.buf_pos++);
+		if (sz > 0)
+			done += sz;
+
+		lseek(f->normal.hndl, offset+done, SEEK_SET);
+		errno = 0;
+		sz = read(f->normal.hndl, p+done, n-done);
 	}
 
-	return normal_refill_buffer(f);
+	return n;
 }
 
 
 
-static int normal_ungetc(int c, void *_f)
+/* raw_write:
+ *  Writes n bytes from p. Returns the number of bytes written, which is less
+ *  than n on errors. Fixed size memory blocks which run out of space set
+ *  errno to ENOSPC, growable ones are reallocated.
+ */
+static long raw_write(PACKFILE *f, AL_CONST unsigned char *p, long n)
 {
-	PACKFILE *f = _f;
+	long sz, done, offset;
 
-	if (f->normal.buf_pos == f->normal.buf) {
-		return EOF;
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY) {
+		struct _al_packfile_memory *mem = &f->normal.mem;
+
+		if (mem->pos + n > mem->capacity) {
+			if ((mem->out) || (mem->limit)) {
+				long capacity = mem->capacity ? mem->capacity : F_BUF_SIZE;
+				unsigned char *data;
+
+				while (capacity < mem->pos + n)
+					capacity *= 2;
+
+				if ((data = _AL_REALLOC(mem->data, capacity)) == NULL) {
+					errno = ENOMEM;
+					return 0;
+				}
+				mem->data = data;
+				mem->capacity = capacity;
+			}
+			else {
+				n = mem->capacity - mem->pos;
+				errno = ENOSPC;
+			}
+		}
+
+		if (n > 0) {
+			memcpy(mem->data + mem->pos, p, n);
+			mem->pos += n;
+			if (mem->pos > mem->size)
+				mem->size = mem->pos;
+		}
+		raw_publish(f);
+		return AL_MAX(n, 0);
 	}
-	else {
-		*(--f->normal.buf_pos) = (unsigned char)c;
-		f->normal.buf_size++;
-		f->normal.flags &= ~PACKFILE_FLAG_EOF;
-		return (unsigned char)c;
+
+#ifdef ALLEGRO_HAVE_IO_URING
+	if (f->normal.uring)
+		return uring_write(f->normal.uring, p, n);
+#endif
+
+	offset = lseek(f->normal.hndl, 0, SEEK_CUR);
+	done = 0;
+
+	errno = 0;
+	sz = write(f->normal.hndl, p, n);
+
+	while (sz+done < n) {
+		if ((sz < 0) && ((errno != EINTR) && (errno != EAGAIN)))
+			return done;
+
+		if (sz > 0)
+			done += sz;
+
+		lseek(f->normal.hndl, offset+done, SEEK_SET);
+		errno = 0;
+		sz = write(f->normal.hndl, p+done, n-done);
 	}
+
+	return n;
 }
 
 
 
-static long normal_fread(void *p, long n, void *_f)
+/* raw_pwrite:
+ *  Writes n bytes from p at the given offset of hndl, without moving the
+ *  file position. Returns zero on success.
+ */
+static int raw_pwrite(int hndl, AL_CONST unsigned char *p, long n, off_t offset)
 {
-	PACKFILE *f = _f;
-	unsigned char *cp = (unsigned char *)p;
-	long i;
-	int c;
+	long sz;
 
-	for (i=0; i<n; i++) {
-		if ((c = normal_getc(f)) == EOF)
-			break;
+	while (n > 0) {
+		sz = pwrite(hndl, p, n, offset);
+
+		if (sz < 0) {
+			if ((errno != EINTR) && (errno != EAGAIN))
+				return -1;
+			continue;
+		}
 
-		*(cp++) = c;
+		if (sz == 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		p += sz;
+		n -= sz;
+		offset += sz;
 	}
 
-	return i;
+	return 0;
 }
 
 
 
-static int normal_putc(int c, void *_f)
+/* raw_patch:
+ *  Overwrites n bytes at the given offset, which must have been written
+ *  already. Returns zero on success.
+ */
+static int raw_patch(PACKFILE *f, long offset, AL_CONST unsigned char *p, long n)
 {
-	PACKFILE *f = _f;
-
-	if (f->normal.buf_size + 1 >= F_BUF_SIZE) {
-		if (normal_flush_buffer(f, FALSE))
-			return EOF;
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY) {
+		if (offset + n > f->normal.mem.size) {
+			errno = ENOSPC;
+			return -1;
+		}
+		memcpy(f->normal.mem.data + offset, p, n);
+		return 0;
 	}
 
-	f->normal.buf_size++;
-	return (*(f->normal.buf_pos++) = c);
+#ifdef ALLEGRO_HAVE_IO_URING
+	if (f->normal.uring)
+		return uring_patch(f->normal.uring, offset, p, n);
+#endif
+
+	return raw_pwrite(f->normal.hndl, p, n, offset);
 }
 
 
 
-static long normal_fwrite(AL_CONST void *p, long n, void *_f)
+/* raw_pread:
+ *  Reads n bytes at the given offset into p, without moving the file
+ *  position. Returns the number of bytes read.
+ */
+static long raw_pread(PACKFILE *f, long offset, unsigned char *p, long n)
 {
-	PACKFILE *f = _f;
-	AL_CONST unsigned char *cp = (AL_CONST unsigned char *)p;
-	long i;
+	long sz, done = 0;
+
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY) {
+		n = AL_MIN(n, f->normal.mem.size - offset);
+		if (n <= 0)
+			return 0;
+		memcpy(p, f->normal.mem.data + offset, n);
+		return n;
+	}
 
-	for (i=0; i<n; i++) {
-		if (normal_putc(*cp++, f) == EOF)
+	while (done < n) {
+		sz = pread(f->normal.hndl, p + done, n - done, offset + done);
+		if (sz > 0)
+			done += sz;
+		else if ((sz == 0) || ((errno != EINTR) && (errno != EAGAIN)))
 			break;
 	}
 
-	return i;
+	return done;
 }
 
 
 
-static int normal_fseek(void *_f, int offset)
+/* raw_size:
+ *  Returns the size of the file or memory block, or -1 on error.
+ */
+static long raw_size(PACKFILE *f)
 {
-	PACKFILE *f = _f;
-	int i;
+	struct stat st;
 
-	if (f->normal.flags & PACKFILE_FLAG_WRITE)
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY)
+		return f->normal.mem.size;
+
+	if (fstat(f->normal.hndl, &st))
 		return -1;
 
-	errno = 0;
+	return st.st_size;
+}
 
-	/* skip forward through the buffer */
-	if (f->normal.buf_size > 0) {
-		i = AL_MIN(offset, f->normal.buf_size);
-		f->normal.buf_size -= i;
-		f->normal.buf_pos += i;
-		offset -= i;
-		if ((f->normal.buf_size <= 0) && normal_no_more_input(f))
-			f->normal.flags |= PACKFILE_FLAG_EOF;
-	}
 
-	/* need to seek some more? */
-	if (offset > 0) {
-		i = AL_MIN(offset, f->normal.todo);
 
-		if ((f->normal.flags & PACKFILE_FLAG_PACK) || (f->normal.passpos)) {
-			/* for compressed or encrypted files, we just have to read through the data */
-			while (i > 0) {
-				pack_getc(f);
-				i--;
-			}
-		}
-		else {
-			if (f->normal.parent) {
-				/* pass the seek request on to the parent file */
-				pack_fseek(f->normal.parent, i);
-			}
-			else {
-				/* do a real seek */
-				lseek(f->normal.hndl, i, SEEK_CUR);
-			}
-			f->normal.todo -= i;
-			if (normal_no_more_input(f))
-				f->normal.flags |= PACKFILE_FLAG_EOF;
-		}
-	}
+/* raw_seekable:
+ *  Tells whether data already written to f can still be patched.
+ */
+static int raw_seekable(PACKFILE *f)
+{
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY)
+		return TRUE;
 
-	if (errno)
-		return -1;
-	else
-		return 0;
+	return (lseek(f->normal.hndl, 0, SEEK_CUR) >= 0);
 }
 
 
 
-static int normal_feof(void *_f)
+/* raw_spill:
+ *  Moves a memory block staging a chunk to a temporary file and encrypts
+ *  it, after which f writes to the file. Returns zero on success.
+ */
+static int raw_spill(PACKFILE *f)
 {
-	PACKFILE *f = _f;
+	struct _al_packfile_memory *mem = &f->normal.mem;
+	int fd;
 
-	return (f->normal.flags & PACKFILE_FLAG_EOF);
+	if ((fd = open_temp_file()) < 0)
+		return -1;
+
+	if (f->normal.passdata) {
+		key_seek(f, 0);
+		xor_stream(f, mem->data, mem->size);
+	}
+
+	if ((raw_pwrite(fd, mem->data, mem->size, 0)) || (lseek(fd, mem->size, SEEK_SET) < 0)) {
+		close(fd);
+		f->normal.flags |= PACKFILE_FLAG_ERROR;
+		return -1;
+	}
+
+	_AL_FREE(mem->data);
+	memset(mem, 0, sizeof(*mem));
+	f->normal.flags &= ~PACKFILE_FLAG_MEMORY;
+	f->normal.hndl = fd;
+
+	return 0;
 }
 
 
 
-static int normal_ferror(void *_f)
+/* raw_discard:
+ *  Frees the staging area of a chunk, whether it is in memory or spilled.
+ */
+static void raw_discard(PACKFILE *f)
 {
-	PACKFILE *f = _f;
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY)
+		_AL_FREE(f->normal.mem.data);
+	else if (f->normal.hndl >= 0)
+		close(f->normal.hndl);
 
-	return (f->normal.flags & PACKFILE_FLAG_ERROR);
+	drop_key(f);
+	free_packfile(f);
 }
 
 
 
-/* normal_refill_buffer:
- *  Refills the read buffer. The file must have been opened in read mode,
- *  and the buffer must be empty.
+/* raw_tell:
+ *  Returns the position of the next raw_read(), or -1 on error.
  */
-static int normal_refill_buffer(PACKFILE *f)
+static long raw_tell(PACKFILE *f)
 {
-	int i, sz, done, offset;
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY)
+		return f->normal.mem.pos;
 
-	if (f->normal.flags & PACKFILE_FLAG_EOF)
-		return EOF;
+#ifdef ALLEGRO_HAVE_IO_URING
+	if (f->normal.uring)
+		return f->normal.uring->pos;
+#endif
 
-	if (normal_no_more_input(f)) {
-		f->normal.flags |= PACKFILE_FLAG_EOF;
-		return EOF;
-	}
+	if (f->normal.ahead)
+		return f->normal.ahead->pos;
 
-	if (f->normal.parent) {
-		if (f->normal.flags & PACKFILE_FLAG_PACK) {
-			f->normal.buf_size = lzss_read(f->normal.parent,
-				f->normal.unpack_data, AL_MIN(F_BUF_SIZE, f->normal.todo),
-				f->normal.buf);
-		}
-		else {
-			f->normal.buf_size = pack_fread(f->normal.buf,
-				AL_MIN(F_BUF_SIZE, f->normal.todo), f->normal.parent);
-		}
-		if (f->normal.parent->normal.flags & PACKFILE_FLAG_EOF)
-			f->normal.todo = 0;
-		if (f->normal.parent->normal.flags & PACKFILE_FLAG_ERROR)
-			goto Error;
-	}
-	else {
-		f->normal.buf_size = AL_MIN(F_BUF_SIZE, f->normal.todo);
+	return lseek(f->normal.hndl, 0, SEEK_CUR);
+}
 
-		offset = lseek(f->normal.hndl, 0, SEEK_CUR);
-		done = 0;
 
-		errno = 0;
-		sz = read(f->normal.hndl, f->normal.buf, f->normal.buf_size);
 
-		while (sz+done < f->normal.buf_size) {
-			if ((sz < 0) && ((errno != EINTR) && (errno != EAGAIN)))
-				goto Error;
+/* raw_dup:
+ *  Makes dst read the descriptor or memory block of src from pos on,
+ *  without touching the file position. Returns zero on success.
+ */
+static int raw_dup(PACKFILE *dst, PACKFILE *src, long pos)
+{
+	if (src->normal.flags & PACKFILE_FLAG_MEMORY) {
+		raw_attach(dst, -1, &src->normal.mem);
+		dst->normal.mem.pos = pos;
+		dst->normal.mem.out = NULL;
+		dst->normal.mem.out_size = NULL;
+		return 0;
+	}
 
-			if (sz > 0)
-				done += sz;
+	raw_attach(dst, src->normal.hndl, NULL);
+	return raw_read_at(dst, pos);
+}
 
-			lseek(f->normal.hndl, offset+done, SEEK_SET);
-			errno = 0;
-			sz = read(f->normal.hndl, f->normal.buf+done, f->normal.buf_size-done);
-		}
 
-		if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))) {
-			for (i=0; i<f->normal.buf_size; i++) {
-				f->normal.buf[i] ^= *(f->normal.passpos++);
-				if (!*f->normal.passpos)
-					f->normal.passpos = f->normal.passdata;
-			}
-		}
+
+/* raw_seek:
+ *  Moves the position by offset bytes, which may be negative. Returns zero
+ *  on success.
+ */
+static int raw_seek(PACKFILE *f, long offset)
+{
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY) {
+		AL_ASSERT(f->normal.mem.pos + offset >= 0);
+		f->normal.mem.pos = AL_MIN(f->normal.mem.pos + offset, f->normal.mem.size);
+		return 0;
 	}
 
-	f->normal.todo -= f->normal.buf_size;
-	f->normal.buf_pos = f->normal.buf;
-	f->normal.buf_size--;
-	if (f->normal.buf_size <= 0)
-		if (normal_no_more_input(f))
-			f->normal.flags |= PACKFILE_FLAG_EOF;
+#ifdef ALLEGRO_HAVE_IO_URING
+	if (f->normal.uring) {
+		f->normal.uring->pos += offset;
+		return 0;
+	}
+#endif
 
-	if (f->normal.buf_size < 0)
-		return EOF;
-	else
-		return *(f->normal.buf_pos++);
+	if (f->normal.ahead) {
+		f->normal.ahead->pos += offset;
+		return 0;
+	}
 
-Error:
-	errno = EFAULT;
-	f->normal.flags |= PACKFILE_FLAG_ERROR;
-	return EOF;
+	return (lseek(f->normal.hndl, offset, SEEK_CUR) < 0) ? -1 : 0;
 }
 
 
 
-/* normal_flush_buffer:
- *  Flushes a file buffer to the disk. The file must be open in write mode.
+/* raw_close:
+ *  Releases the file descriptor. Memory blocks are never freed, growable
+ *  ones are handed over to their owner.
  */
-static int normal_flush_buffer(PACKFILE *f, int last)
+static int raw_close(PACKFILE *f)
 {
-	int i, sz, done, offset;
-
-	if (f->normal.buf_size > 0) {
-		if (f->normal.flags & PACKFILE_FLAG_PACK) {
-			if (lzss_write(f->normal.parent, f->normal.pack_data, f->normal.buf_size, f->normal.buf, last))
-				goto Error;
-		}
-		else {
-			if ((f->normal.passpos) && (!(f->normal.flags & PACKFILE_FLAG_OLD_CRYPT))) {
-				for (i=0; i<f->normal.buf_size; i++) {
-					f->normal.buf[i] ^= *(f->normal.passpos++);
-					if (!*f->normal.passpos)
-						f->normal.passpos = f->normal.passdata;
-				}
-			}
+	int ret = 0, last = TRUE;
 
-			offset = lseek(f->normal.hndl, 0, SEEK_CUR);
-			done = 0;
-
-			errno = 0;
-			sz = write(f->normal.hndl, f->normal.buf, f->normal.buf_size);
+	if (f->normal.shared)
+		last = release_shared(f);
 
-			while (sz+done < f->normal.buf_size) {
-				if ((sz < 0) && ((errno != EINTR) && (errno != EAGAIN)))
-					goto Error;
+	if (f->normal.flags & PACKFILE_FLAG_MEMORY) {
+		raw_publish(f);
+		return 0;
+	}
 
-				if (sz > 0)
-					done += sz;
+#ifdef ALLEGRO_HAVE_IO_URING
+	if (f->normal.uring) {
+		ret = uring_close(f->normal.uring);
+		f->normal.uring = NULL;
+	}
+#endif
 
-				lseek(f->normal.hndl, offset+done, SEEK_SET);
-				errno = 0;
-				sz = write(f->normal.hndl, f->normal.buf+done, f->normal.buf_size-done);
-			}
-		}
-		f->normal.todo += f->normal.buf_size;
+	if (f->normal.ahead) {
+		destroy_read_ahead(f->normal.ahead);
+		f->normal.ahead = NULL;
 	}
 
-	f->normal.buf_pos = f->normal.buf;
-	f->normal.buf_size = 0;
-	return 0;
+	if ((last) && (close(f->normal.hndl)) && (!ret))
+		ret = -1;
 
-Error:
-	errno = EFAULT;
-	f->normal.flags |= PACKFILE_FLAG_ERROR;
-	return EOF;
+	return ret;
 }
 
 // vim:tabstop=4 shiftwidth=4
@@ -256,12 +256,28 @@ static void lzss_deletenode(int p, LZSS_PACK_DATA *dat)
 
 
 
+/**
+ *  Encrypts the flag byte of a group of codes with the legacy scheme.
+ */
+static void lzss_crypt(PACKFILE *file, LZSS_PACK_DATA *dat)
+{
+	dat->code_buf[0] ^= *file->normal.passpos;
+	file->normal.passpos++;
+	if (!*file->normal.passpos)
+		file->normal.passpos = file->normal.passdata;
+}
+
+
+
 /**
  *  Packs size bytes from buf, using the pack information contained in dat.
  *  Returns 0 on success.
  */
 int lzss_write(PACKFILE *file, LZSS_PACK_DATA *dat, int size, unsigned char *buf, int last)
 {
+	/* the legacy encryption is decided once per call, not per flag byte */
+	const int crypt = (file->is_normal_packfile) && (file->normal.passpos) &&
+		(file->normal.flags & PACKFILE_FLAG_OLD_CRYPT);
 	int i = dat->i;
 	int c = dat->c;
 	int len = dat->len;
@@ -335,17 +351,11 @@ int lzss_write(PACKFILE *file, LZSS_PACK_DATA *dat, int size, unsigned char *buf
 
 		if ((mask <<= 1) == 0) {			/* shift mask left one bit */
 
-			if ((file->is_normal_packfile) && (file->normal.passpos) &&
-				 (file->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
-			{
-				dat->code_buf[0] ^= *file->normal.passpos;
-				file->normal.passpos++;
-				if (!*file->normal.passpos)
-					file->normal.passpos = file->normal.passdata;
-			}
+			if (crypt)
+				lzss_crypt(file, dat);
 
-			for (i=0; i<code_buf_ptr; i++)		/* send at most 8 units of */
-				pack_putc(dat->code_buf[i], file);	/* code together */
+			/* send at most 8 units of code together */
+			pack_fwrite(dat->code_buf, code_buf_ptr, file);
 
 			if (pack_ferror(file)) {
 				ret = EOF;
@@ -392,21 +402,13 @@ int lzss_write(PACKFILE *file, LZSS_PACK_DATA *dat, int size, unsigned char *buf
 
 	if (code_buf_ptr > 1) {			  /* send remaining code */
 
-		if ((file->is_normal_packfile) && (file->normal.passpos) &&
-			 (file->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
-		{
-			dat->code_buf[0] ^= *file->normal.passpos;
-			file->normal.passpos++;
-			if (!*file->normal.passpos)
-				file->normal.passpos = file->normal.passdata;
-		}
+		if (crypt)
+			lzss_crypt(file, dat);
 
-		for (i=0; i<code_buf_ptr; i++) {
-			pack_putc(dat->code_buf[i], file);
-			if (pack_ferror(file)) {
-				ret = EOF;
-				goto getout;
-			}
+		pack_fwrite(dat->code_buf, code_buf_ptr, file);
+		if (pack_ferror(file)) {
+			ret = EOF;
+			goto getout;
 		}
 	}
 
@@ -466,10 +468,20 @@ void free_lzss_unpack_data(LZSS_UNPACK_DATA *dat)
 
 
 /**
- *  Unpacks from dat into buf, until either EOF is reached or s bytes have
- *  been extracted. Returns the number of bytes added to the buffer
+ *  Reads a byte for lzss_unpack(). With direct set, file is a normal
+ *  packfile and the byte may come straight from its buffer.
  */
-int lzss_read(PACKFILE *file, LZSS_UNPACK_DATA *dat, int s, unsigned char *buf)
+#define LZSS_GETC(file, direct)	((direct) ? pack_getc_fast(file) : pack_getc(file))
+
+
+
+/**
+ *  Decoder shared by the variants of lzss_read(). direct and crypt are
+ *  constants in every call, so the compiler generates a separate copy of
+ *  the loop for each of them, without tests for the other cases inside.
+ */
+static inline int lzss_unpack(PACKFILE *file, LZSS_UNPACK_DATA *dat, int s, unsigned char *buf,
+	const int direct, const int crypt)
 {
 	int i = dat->i;
 	int j = dat->j;
@@ -490,12 +502,10 @@ int lzss_read(PACKFILE *file, LZSS_UNPACK_DATA *dat, int s, unsigned char *buf)
 
 	for (;;) {
 		if (((flags >>= 1) & 256) == 0) {
-			if ((c = pack_getc(file)) == EOF)
+			if ((c = LZSS_GETC(file, direct)) == EOF)
 				break;
 
-			if ((file->is_normal_packfile) && (file->normal.passpos) &&
-				 (file->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
-			{
+			if (crypt) {
 				c ^= *file->normal.passpos;
 				file->normal.passpos++;
 				if (!*file->normal.passpos)
@@ -506,7 +516,7 @@ int lzss_read(PACKFILE *file, LZSS_UNPACK_DATA *dat, int s, unsigned char *buf)
 		}
 
 		if (flags & 1) {
-			if ((c = pack_getc(file)) == EOF)
+			if ((c = LZSS_GETC(file, direct)) == EOF)
 				break;
 			dat->text_buf[r++] = c;
 			r &= (N - 1);
@@ -519,9 +529,9 @@ int lzss_read(PACKFILE *file, LZSS_UNPACK_DATA *dat, int s, unsigned char *buf)
 				;
 		}
 		else {
-			if ((i = pack_getc(file)) == EOF)
+			if ((i = LZSS_GETC(file, direct)) == EOF)
 				break;
-			if ((j = pack_getc(file)) == EOF)
+			if ((j = LZSS_GETC(file, direct)) == EOF)
 				break;
 			i |= ((j & 0xF0) << 4);
 			j = (j & 0x0F) + THRESHOLD;
@@ -556,6 +566,23 @@ int lzss_read(PACKFILE *file, LZSS_UNPACK_DATA *dat, int s, unsigned char *buf)
 
 
 
+/**
+ *  Unpacks from dat into buf, until either EOF is reached or s bytes have
+ *  been extracted. Returns the number of bytes added to the buffer
+ */
+int lzss_read(PACKFILE *file, LZSS_UNPACK_DATA *dat, int s, unsigned char *buf)
+{
+	if (!file->is_normal_packfile)
+		return lzss_unpack(file, dat, s, buf, FALSE, FALSE);
+
+	if ((file->normal.passpos) && (file->normal.flags & PACKFILE_FLAG_OLD_CRYPT))
+		return lzss_unpack(file, dat, s, buf, TRUE, TRUE);
+
+	return lzss_unpack(file, dat, s, buf, TRUE, FALSE);
+}
+
+
+
 /**
  *  Return non-zero if the previous lzss_read() call was in the middle of
  *  unpacking a sequence of bytes into the supplied buffer, but had to suspend